@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_BACKEND_H
+#define LITEPCIE_LIB_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "litepcie.h"
+
+/*
+ * Transport backends.
+ *
+ * Everything in the library that talks to the device goes through one of
+ * these, the int fd handed out by litepcie_open() is an index into a small
+ * device table holding the backend ops and its private state.
+ */
+
+#define LITEPCIE_MAX_DEVICES 16
+#define LITEPCIE_WAIT_NONE   UINT64_MAX
+
+/* same layout as LitePCIeCsrOp, type is a LitePCIeCsrOpType */
+struct litepcie_csr_op {
+    uint32_t type;
+    uint32_t addr;
+    uint32_t value; /* in for writes/RMW/polls, out: what the register held after the op */
+    uint32_t mask; /* RMW and poll only */
+};
+
+struct litepcie_device;
+
+struct litepcie_backend_ops {
+    const char *name;
+
+    /* returns 1 if this backend handles the device name */
+    int (*probe)(const char *name);
+    int (*open)(struct litepcie_device *dev, const char *name);
+    void (*close)(struct litepcie_device *dev);
+
+    uint32_t (*readl)(struct litepcie_device *dev, uint32_t addr);
+    void (*writel)(struct litepcie_device *dev, uint32_t addr, uint32_t val);
+    /* 0 when every op ran, 1 when a poll timed out and the rest was skipped */
+    int (*csr_batch)(struct litepcie_device *dev, struct litepcie_csr_op *ops, uint32_t count);
+
+    /* type is one of LitePCIeMemoryType */
+    void *(*map)(struct litepcie_device *dev, uint32_t type, uint8_t channel, size_t *size);
+    void (*unmap)(struct litepcie_device *dev, uint32_t type, uint8_t channel, void *addr);
+
+    int (*dma_enable)(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader, uint8_t enable);
+    /* gate an enabled direction without touching its table or counts */
+    int (*dma_pause)(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader, uint8_t pause);
+    /* ring geometry, must be set while the direction is disabled and before mapping it */
+    int (*dma_geometry)(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader,
+                        uint32_t buffer_size, uint32_t buffer_count, uint32_t buffer_per_irq);
+    /* IRQ coalescing (LitePCIeCoalesceMode), applied on the next enable */
+    int (*dma_coalesce)(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader,
+                        uint32_t mode, uint32_t buffer_per_irq, uint32_t latency_us);
+    /* block until the reader total reaches reader_count or the writer total
+     * reaches writer_count (LITEPCIE_WAIT_NONE skips a direction),
+     * 0 once one did, 1 on timeout */
+    int (*wait)(struct litepcie_device *dev, uint8_t channel,
+                uint64_t reader_count, uint64_t writer_count, int64_t timeout_us);
+
+    /* driver counters, 0 on success */
+    int (*stats)(struct litepcie_device *dev, LitePCIeStats *stats);
+    /* snapshot of a channel's counts page, mapped or not */
+    int (*dma_stats)(struct litepcie_device *dev, uint8_t channel, DMACounts *counts);
+
+    int (*flash)(struct litepcie_device *dev, LitePCIeFlashCallData *m);
+    /* whole SPI commands run by the driver: programs of up to
+     * LITEPCIE_FLASH_PROGRAM_MAX bytes (split into page programs, the last
+     * one still running on return), reads of up to LITEPCIE_FLASH_READ_MAX
+     * bytes, erases (cmd per litepcie_flash_erase_size, done on return) and
+     * the CRC-32 of up to LITEPCIE_FLASH_READ_MAX bytes, chained from *crc.
+     * 0 on success, callers fall back to flash() transfers otherwise */
+    int (*flash_program)(struct litepcie_device *dev, uint32_t addr, const uint8_t *data, uint32_t size);
+    int (*flash_read)(struct litepcie_device *dev, uint32_t addr, uint8_t *data, uint32_t size);
+    int (*flash_erase)(struct litepcie_device *dev, uint32_t addr, uint8_t cmd);
+    int (*flash_crc)(struct litepcie_device *dev, uint32_t addr, uint32_t size, uint32_t *crc);
+    void (*reload)(struct litepcie_device *dev);
+};
+
+struct litepcie_flash_info;
+
+struct litepcie_device {
+    const struct litepcie_backend_ops *ops;
+    void *priv;
+    struct litepcie_flash_info *flash_info; /* first litepcie_flash_probe result, freed on close */
+};
+
+#ifdef __APPLE__
+extern const struct litepcie_backend_ops litepcie_backend_iokit;
+#endif
+extern const struct litepcie_backend_ops litepcie_backend_sim;
+
+struct litepcie_device *litepcie_get_device(int fd);
+
+/* fallback for backends without a native batch path */
+int litepcie_csr_batch_generic(struct litepcie_device *dev, struct litepcie_csr_op *ops, uint32_t count);
+
+#endif /* LITEPCIE_LIB_BACKEND_H */
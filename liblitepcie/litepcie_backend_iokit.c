@@ -0,0 +1,679 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifdef __APPLE__
+
+#include <IOKit/IOKitLib.h>
+#include <IOKit/IOReturn.h>
+#include <IOKit/hidsystem/IOHIDShared.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "litepcie_backend.h"
+#include "litepcie_csr_window.h"
+#include "litepcie_dma_progress.h"
+#include "litepcie.h"
+
+/* one outstanding driver side waiter per channel direction */
+struct iokit_waiter {
+    uint64_t count; /* what it was armed for */
+    uint8_t armed;
+};
+
+/* a LITEPCIE_CSR_MEMORY mapping, accessed with plain loads and stores */
+struct iokit_csr_map {
+    mach_vm_address_t address; /* what IOConnectMapMemory64 returned */
+    volatile uint8_t *regs; /* the window's first register */
+    uint32_t window; /* LitePCIeCsrWindow */
+    uint32_t base;
+    uint32_t size;
+};
+
+struct iokit_priv {
+    io_connect_t connection;
+    struct iokit_csr_map csr[LITEPCIE_CSR_WINDOW_COUNT];
+    uint32_t csr_count;
+    IONotificationPortRef notify;
+    mach_port_t wake_port;
+    DMACounts *counts[DMA_CHANNEL_COUNT];
+    struct iokit_waiter waiter[DMA_CHANNEL_COUNT][2];
+};
+
+static void _print_kerr_details(kern_return_t ret)
+{
+    printf("\tSystem: 0x%02x\n", err_get_system(ret));
+    printf("\tSubsystem: 0x%03x\n", err_get_sub(ret));
+    printf("\tCode: 0x%04x\n", err_get_code(ret));
+}
+
+/*
+ * Map BAR0, or failing that whichever whitelisted windows the dext hands out,
+ * so register access skips the user client round trip. Older dexts don't know
+ * LITEPCIE_CSR_MEMORY, everything then stays on the call path.
+ */
+static void iokit_csr_map(struct iokit_priv *priv)
+{
+    for (uint32_t window = 0; window < LITEPCIE_CSR_WINDOW_COUNT; window++) {
+        const struct litepcie_csr_window *w = &litepcie_csr_windows[window];
+        struct iokit_csr_map *m = &priv->csr[priv->csr_count];
+        mach_vm_address_t address = 0;
+        mach_vm_size_t length = 0;
+        uint32_t skip;
+
+        if (window != LITEPCIE_CSR_WINDOW_BAR && w->size == 0)
+            continue;
+
+        if (IOConnectMapMemory64(priv->connection, LITEPCIE_DMA_MEMORY(LITEPCIE_CSR_MEMORY, window),
+                                 mach_task_self(), &address, &length, kIOMapAnywhere) != kIOReturnSuccess)
+            continue;
+
+        skip = w->base - litepcie_csr_window_map_offset(w->base);
+        m->address = address;
+        m->window = window;
+        m->regs = (volatile uint8_t *)address + skip;
+        m->base = w->base;
+        m->size = window == LITEPCIE_CSR_WINDOW_BAR ? (uint32_t)length : w->size;
+        priv->csr_count++;
+
+        /* the whole BAR covers every window */
+        if (window == LITEPCIE_CSR_WINDOW_BAR)
+            break;
+    }
+}
+
+static void iokit_csr_unmap(struct iokit_priv *priv)
+{
+    for (uint32_t i = 0; i < priv->csr_count; i++)
+        IOConnectUnmapMemory(priv->connection, LITEPCIE_DMA_MEMORY(LITEPCIE_CSR_MEMORY, priv->csr[i].window),
+                             mach_task_self(), priv->csr[i].address);
+    priv->csr_count = 0;
+}
+
+static volatile uint32_t *iokit_csr_reg(struct iokit_priv *priv, uint32_t addr)
+{
+    for (uint32_t i = 0; i < priv->csr_count; i++) {
+        struct iokit_csr_map *m = &priv->csr[i];
+        if (addr >= m->base && addr - m->base + 4 <= m->size && !(addr & 3))
+            return (volatile uint32_t *)(m->regs + (addr - m->base));
+    }
+    return NULL;
+}
+
+static int iokit_probe(const char *name)
+{
+    return 1;
+}
+
+static int iokit_open(struct litepcie_device *dev, const char *name)
+{
+    static const char* dextIdentifier = "litepcie";
+
+    kern_return_t ret = kIOReturnSuccess;
+    io_iterator_t iterator = IO_OBJECT_NULL;
+    io_service_t service = IO_OBJECT_NULL;
+    struct iokit_priv *priv;
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return -1;
+
+    /// - Tag: ClientApp_Connect
+    ret = IOServiceGetMatchingServices(kIOMainPortDefault, IOServiceNameMatching(dextIdentifier), &iterator);
+    if (ret != kIOReturnSuccess) {
+        printf("Unable to find service for identifier with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+    }
+
+    printf("Searching for dext service...\n");
+    while ((service = IOIteratorNext(iterator)) != IO_OBJECT_NULL) {
+        // Open a connection to this user client as a server to that client, and store the instance in "service"
+        ret = IOServiceOpen(service, mach_task_self_, kIOHIDServerConnectType, &priv->connection);
+
+        if (ret == kIOReturnSuccess) {
+            printf("\tOpened service.\n");
+            break;
+        } else {
+            printf("\tFailed opening service with error: 0x%08x.\n", ret);
+        }
+
+        IOObjectRelease(service);
+    }
+    IOObjectRelease(iterator);
+
+    if (service == IO_OBJECT_NULL) {
+        printf("Failed to match to device.\n");
+        free(priv);
+        return -1;
+    }
+
+    priv->notify = IONotificationPortCreate(kIOMainPortDefault);
+    if (priv->notify == NULL) {
+        printf("Failed to create notification port.\n");
+        IOServiceClose(priv->connection);
+        free(priv);
+        return -1;
+    }
+    priv->wake_port = IONotificationPortGetMachPort(priv->notify);
+
+    iokit_csr_map(priv);
+
+    dev->priv = priv;
+    return 0;
+}
+
+static void iokit_close(struct litepcie_device *dev)
+{
+    struct iokit_priv *priv = dev->priv;
+
+    iokit_csr_unmap(priv);
+    IOServiceClose(priv->connection);
+    IONotificationPortDestroy(priv->notify);
+    free(priv);
+}
+
+static uint32_t iokit_readl(struct litepcie_device *dev, uint32_t addr)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    volatile uint32_t *reg = iokit_csr_reg(priv, addr);
+
+    uint32_t olen = 1;
+    uint64_t output = 0;
+    uint64_t input = addr;
+
+    if (reg)
+        return *reg;
+
+    ret = IOConnectCallScalarMethod(priv->connection, LITEPCIE_READ_CSR, &input, 1, &output, &olen);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_READ_CSR failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+    }
+
+    return (uint32_t)output;
+}
+
+static void iokit_writel(struct litepcie_device *dev, uint32_t addr, uint32_t val)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    volatile uint32_t *reg = iokit_csr_reg(priv, addr);
+
+    uint32_t olen = 0;
+    uint64_t input[2] = { addr, val };
+
+    if (reg) {
+        *reg = val;
+        return;
+    }
+    ret = IOConnectCallScalarMethod(priv->connection, LITEPCIE_WRITE_CSR, input, 2, NULL, &olen);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_WRITE_CSR failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+    }
+}
+
+static int iokit_csr_batch(struct litepcie_device *dev, struct litepcie_csr_op *ops, uint32_t count)
+{
+    struct iokit_priv *priv = dev->priv;
+    LitePCIeCsrOp input[LITEPCIE_CSR_BATCH_MAX];
+    LitePCIeCsrBatchResult output;
+    kern_return_t ret = kIOReturnSuccess;
+    uint32_t mapped = 0;
+
+    /* with the registers mapped there is nothing to save by going through the dext */
+    while (mapped < count && iokit_csr_reg(priv, ops[mapped].addr))
+        mapped++;
+    if (count && mapped == count)
+        return litepcie_csr_batch_generic(dev, ops, count);
+
+    /* one round trip per LITEPCIE_CSR_BATCH_MAX ops */
+    for (uint32_t done = 0; done < count;) {
+        uint32_t n = count - done < LITEPCIE_CSR_BATCH_MAX ? count - done : LITEPCIE_CSR_BATCH_MAX;
+        size_t olen = sizeof(output);
+
+        for (uint32_t i = 0; i < n; i++) {
+            input[i].type = ops[done + i].type;
+            input[i].addr = ops[done + i].addr;
+            input[i].value = ops[done + i].value;
+            input[i].mask = ops[done + i].mask;
+        }
+
+        ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_CSR_BATCH, input, n * sizeof(LitePCIeCsrOp), &output, &olen);
+        if (ret != kIOReturnSuccess) {
+            printf("LITEPCIE_CSR_BATCH failed with error: 0x%08x.\n", ret);
+            _print_kerr_details(ret);
+            return -1;
+        }
+
+        /* a poll that timed out still reports the value it last saw */
+        for (uint32_t i = 0; i < n && i <= output.completed; i++)
+            ops[done + i].value = output.value[i];
+
+        /* a poll timed out, what follows it never ran */
+        if (output.completed < n)
+            return 1;
+        done += n;
+    }
+
+    return 0;
+}
+
+static void *iokit_map(struct litepcie_device *dev, uint32_t type, uint8_t channel, size_t *size)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+    mach_vm_address_t address = 0;
+    mach_vm_size_t length = 0;
+
+    ret = IOConnectMapMemory64(priv->connection, LITEPCIE_DMA_MEMORY(type, channel), mach_task_self(), &address, &length, kIOMapAnywhere);
+    if (ret != kIOReturnSuccess) {
+        printf("IOConnectMapMemory64 0x%x failed with error: 0x%08x.\n", type, ret);
+        _print_kerr_details(ret);
+        return NULL;
+    }
+
+    if (type == LITEPCIE_DMA_COUNTS && channel < DMA_CHANNEL_COUNT)
+        priv->counts[channel] = (DMACounts*)address;
+
+    if (size)
+        *size = length;
+    return (void*)address;
+}
+
+static void iokit_unmap(struct litepcie_device *dev, uint32_t type, uint8_t channel, void *addr)
+{
+    struct iokit_priv *priv = dev->priv;
+
+    if (type == LITEPCIE_DMA_COUNTS && channel < DMA_CHANNEL_COUNT)
+        priv->counts[channel] = NULL;
+
+    IOConnectUnmapMemory(priv->connection, LITEPCIE_DMA_MEMORY(type, channel), mach_task_self(), (mach_vm_address_t)addr);
+}
+
+static int iokit_dma_enable(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader, uint8_t enable)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+    uint32_t selector = is_reader ? LITEPCIE_CONFIG_DMA_READER_CHANNEL : LITEPCIE_CONFIG_DMA_WRITER_CHANNEL;
+
+    LitePCIeConfigDmaChannelData data;
+    data.channel = channel;
+    data.enable = enable;
+
+    ret = IOConnectCallStructMethod(priv->connection, selector, &data, sizeof(LitePCIeConfigDmaChannelData), NULL, 0);
+
+    if (ret != kIOReturnSuccess) {
+        printf("%s failed with error: 0x%08x.\n",
+            is_reader ? "LITEPCIE_CONFIG_DMA_READER_CHANNEL" : "LITEPCIE_CONFIG_DMA_WRITER_CHANNEL", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_dma_pause(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader, uint8_t pause)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeConfigDmaPauseData data;
+    data.channel = channel;
+    data.is_reader = is_reader;
+    data.pause = pause;
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_CONFIG_DMA_PAUSE, &data, sizeof(LitePCIeConfigDmaPauseData), NULL, 0);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_CONFIG_DMA_PAUSE failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_dma_geometry(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader,
+                              uint32_t buffer_size, uint32_t buffer_count, uint32_t buffer_per_irq)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeConfigDmaGeometryData data;
+    data.channel = channel;
+    data.is_reader = is_reader;
+    data.buffer_size = buffer_size;
+    data.buffer_count = buffer_count;
+    data.buffer_per_irq = buffer_per_irq;
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_CONFIG_DMA_GEOMETRY, &data, sizeof(LitePCIeConfigDmaGeometryData), NULL, 0);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_CONFIG_DMA_GEOMETRY failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_dma_coalesce(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader,
+                              uint32_t mode, uint32_t buffer_per_irq, uint32_t latency_us)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeConfigDmaCoalesceData data;
+    data.channel = channel;
+    data.is_reader = is_reader;
+    data.mode = mode;
+    data.buffer_per_irq = buffer_per_irq;
+    data.latency_us = latency_us;
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_CONFIG_DMA_COALESCE, &data, sizeof(LitePCIeConfigDmaCoalesceData), NULL, 0);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_CONFIG_DMA_COALESCE failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void iokit_wait_callout(void *refcon, IOReturn result, void **args, uint32_t num_args)
+{
+    struct iokit_waiter *waiter = refcon;
+
+    /* a stale completion (aborted by a re-arm) doesn't disarm the new waiter */
+    if (num_args >= 2 && (uint64_t)(uintptr_t)args[1] == waiter->count)
+        waiter->armed = 0;
+}
+
+static int iokit_wait_arm(struct iokit_priv *priv, uint8_t channel, uint8_t is_reader, uint64_t count)
+{
+    struct iokit_waiter *waiter = &priv->waiter[channel][is_reader];
+    uint64_t ref[kOSAsyncRef64Count];
+    kern_return_t ret;
+
+    if (count == LITEPCIE_WAIT_NONE || (waiter->armed && waiter->count <= count))
+        return 0;
+
+    LitePCIeDmaWaitData data;
+    data.channel = channel;
+    data.is_reader = is_reader;
+    data.count = count;
+
+    ref[kIOAsyncCalloutFuncIndex] = (uint64_t)(uintptr_t)iokit_wait_callout;
+    ref[kIOAsyncCalloutRefconIndex] = (uint64_t)(uintptr_t)waiter;
+    waiter->count = count;
+    waiter->armed = 1;
+
+    ret = IOConnectCallAsyncStructMethod(priv->connection, LITEPCIE_DMA_WAIT, priv->wake_port, ref, kIOAsyncCalloutCount,
+                                         &data, sizeof(LitePCIeDmaWaitData), NULL, NULL);
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_DMA_WAIT failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        waiter->armed = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_wait(struct litepcie_device *dev, uint8_t channel,
+                      uint64_t reader_count, uint64_t writer_count, int64_t timeout_us)
+{
+    struct iokit_priv *priv = dev->priv;
+    DMACounts *counts;
+    uint64_t deadline;
+    struct {
+        mach_msg_header_t header;
+        uint8_t body[512];
+    } msg;
+
+    if (channel >= DMA_CHANNEL_COUNT || priv->counts[channel] == NULL)
+        return -1;
+    counts = priv->counts[channel];
+
+    /* the driver completes the armed waiters from its IRQ path, the counts
+     * page stays the source of truth and is re-checked after every wakeup */
+    deadline = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + (uint64_t)timeout_us * 1000;
+    for (;;) {
+        uint64_t now;
+        mach_msg_return_t mr;
+
+        if (litepcie_dma_progress_count(&counts->reader) >= reader_count
+            || litepcie_dma_progress_count(&counts->writer) >= writer_count)
+            return 0;
+
+        now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        if (now >= deadline)
+            return 1;
+
+        if (iokit_wait_arm(priv, channel, 1, reader_count) != 0 || iokit_wait_arm(priv, channel, 0, writer_count) != 0)
+            return -1;
+
+        mr = mach_msg(&msg.header, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg), priv->wake_port,
+                      (mach_msg_timeout_t)((deadline - now + 999999) / 1000000), MACH_PORT_NULL);
+        if (mr == MACH_MSG_SUCCESS)
+            IODispatchCalloutFromMessage(NULL, &msg.header, priv->notify);
+        else if (mr != MACH_RCV_TIMED_OUT)
+            return -1;
+    }
+}
+
+static int iokit_stats(struct litepcie_device *dev, LitePCIeStats *stats)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+    size_t olen = sizeof(*stats);
+
+    memset(stats, 0, sizeof(*stats));
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_GET_STATS, NULL, 0, stats, &olen);
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_GET_STATS failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return stats->version == LITEPCIE_STATS_VERSION ? 0 : -1;
+}
+
+static int iokit_dma_stats(struct litepcie_device *dev, uint8_t channel, DMACounts *counts)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+    uint64_t input = channel;
+    size_t olen = sizeof(*counts);
+
+    if (channel >= DMA_CHANNEL_COUNT)
+        return -1;
+
+    /* already mapped, no need to ask */
+    if (priv->counts[channel] != NULL) {
+        litepcie_dma_counts_read(priv->counts[channel], counts);
+        return 0;
+    }
+
+    ret = IOConnectCallMethod(priv->connection, LITEPCIE_GET_DMA_STATS, &input, 1, NULL, 0, NULL, NULL, counts, &olen);
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_GET_DMA_STATS failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return litepcie_dma_counts_valid(counts) ? 0 : -1;
+}
+
+static int iokit_flash(struct litepcie_device *dev, LitePCIeFlashCallData *m)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    size_t olen = sizeof(LitePCIeFlashCallData);
+    LitePCIeFlashCallData output;
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_FLASH, m, sizeof(LitePCIeFlashCallData), &output, &olen);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_FLASH failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    m->rx_data = output.rx_data;
+    return 0;
+}
+
+static int iokit_flash_program(struct litepcie_device *dev, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeFlashProgramData input = {
+        .addr = addr,
+        .size = size,
+    };
+
+    if (size > sizeof(input.data))
+        return -1;
+    memcpy(input.data, data, size);
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_FLASH_PROGRAM, &input, sizeof(input), NULL, NULL);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_FLASH_PROGRAM failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_flash_read(struct litepcie_device *dev, uint32_t addr, uint8_t *data, uint32_t size)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeFlashReadData input = {
+        .addr = addr,
+        .size = size,
+    };
+    size_t olen = size;
+
+    /* IOKit hands outputs above 4 KB to the driver as a descriptor of data itself */
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_FLASH_READ, &input, sizeof(input), data, &olen);
+
+    if (ret != kIOReturnSuccess || olen != size) {
+        printf("LITEPCIE_FLASH_READ failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_flash_erase(struct litepcie_device *dev, uint32_t addr, uint8_t cmd)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeFlashEraseData input = {
+        .addr = addr,
+        .cmd = cmd,
+    };
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_FLASH_ERASE, &input, sizeof(input), NULL, NULL);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_FLASH_ERASE failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int iokit_flash_crc(struct litepcie_device *dev, uint32_t addr, uint32_t size, uint32_t *crc)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeFlashCrcData input = {
+        .addr = addr,
+        .size = size,
+        .crc = *crc,
+    };
+    LitePCIeFlashCrcData output;
+    size_t olen = sizeof(output);
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_FLASH_CRC, &input, sizeof(input), &output, &olen);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_FLASH_CRC failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+        return -1;
+    }
+
+    *crc = output.crc;
+    return 0;
+}
+
+static void iokit_reload(struct litepcie_device *dev)
+{
+    struct iokit_priv *priv = dev->priv;
+    kern_return_t ret = kIOReturnSuccess;
+
+    size_t olen = 0;
+    LitePCIeICAPCallData input = { .addr = 0x0, .data = 0x0 };
+
+    ret = IOConnectCallStructMethod(priv->connection, LITEPCIE_ICAP, &input, sizeof(LitePCIeICAPCallData), NULL, &olen);
+
+    if (ret != kIOReturnSuccess) {
+        printf("LITEPCIE_ICAP failed with error: 0x%08x.\n", ret);
+        _print_kerr_details(ret);
+    }
+}
+
+const struct litepcie_backend_ops litepcie_backend_iokit = {
+    .name = "iokit",
+    .probe = iokit_probe,
+    .open = iokit_open,
+    .close = iokit_close,
+    .readl = iokit_readl,
+    .writel = iokit_writel,
+    .csr_batch = iokit_csr_batch,
+    .map = iokit_map,
+    .unmap = iokit_unmap,
+    .dma_enable = iokit_dma_enable,
+    .dma_pause = iokit_dma_pause,
+    .dma_geometry = iokit_dma_geometry,
+    .dma_coalesce = iokit_dma_coalesce,
+    .wait = iokit_wait,
+    .stats = iokit_stats,
+    .dma_stats = iokit_dma_stats,
+    .flash = iokit_flash,
+    .flash_program = iokit_flash_program,
+    .flash_read = iokit_flash_read,
+    .flash_erase = iokit_flash_erase,
+    .flash_crc = iokit_flash_crc,
+    .reload = iokit_reload,
+};
+
+#endif /* __APPLE__ */
@@ -0,0 +1,724 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "litepcie_backend.h"
+#include "litepcie_dma_coalesce.h"
+#include "litepcie_dma_common.h"
+#include "litepcie_dma_progress.h"
+#include "litepcie_dma_ring.h"
+#include "litepcie_irq_route.h"
+#include "litepcie_sim.h"
+#include "litepcie.h"
+
+/*
+ * Simulated device backend.
+ *
+ * Plays the part of the dext on top of the software device model: owns the
+ * DMA rings and the counts page, programs the descriptor tables and does the
+ * MSI servicing, so the rest of the library runs unchanged. Selected with a
+ * device name starting with "sim", optionally followed by ":<bytes/s>" to
+ * throttle the DMA engines and ":<channels>" to model a multi-channel board
+ * (channels csr.h does not describe get extra banks inside the model, the
+ * library only drives the ones csr.h has).
+ */
+
+#define SIM_PAGE_SIZE 4096
+
+struct sim_dma_ring {
+    uint8_t *buf;
+    uint64_t bus;
+    DMAProgress *progress; /* lives in the counts page */
+    DMAGeometry *geometry; /* &progress->geometry */
+    DMAStats *stats; /* lives in the counts page too */
+    DMALevels *levels; /* as do these */
+    const DMAHostCursor *host; /* client written, in the host page */
+    uint64_t count_prev;
+    uint64_t irq_time_prev; /* ns */
+    uint8_t enabled;
+    uint8_t paused;
+    /* the model's table still holds this ring with this IRQ stride, rewound
+     * once it was rewritten and the engine starts over at buffer 0 */
+    uint8_t table_valid;
+    uint8_t table_rewound;
+    uint32_t table_stride;
+    struct litepcie_dma_coalesce coalesce;
+    uint8_t held_off;
+    uint64_t holdoff_deadline; /* ns */
+};
+
+struct sim_dma_channel {
+    struct sim_dma_ring reader; /* host -> device */
+    struct sim_dma_ring writer; /* device -> host */
+    DMACounts *counts;
+    DMAHost *host;
+};
+
+struct sim_priv {
+    struct litepcie_sim *sim;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    pthread_cond_t coalesce;
+    pthread_t coalesce_thread;
+    uint8_t coalesce_running;
+    uint8_t stop;
+    uint32_t msi_enable; /* wanted, the coalescing thread is the only one writing it out */
+    uint32_t msi_written;
+    uint32_t channels;
+    uint64_t interrupts; /* the model has a single MSI source */
+    uint64_t vector_reads;
+    struct litepcie_irq_route route;
+    struct sim_dma_channel channel[LITEPCIE_SIM_MAX_CHANNELS];
+};
+
+static uint64_t sim_now_ns(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_usec * 1000;
+}
+
+/* fold one direction's loop status into its progress block, called locked with the sequence open */
+static uint64_t sim_service(struct sim_priv *priv, uint8_t channel, uint8_t is_reader, uint64_t now, uint64_t *delta)
+{
+    struct sim_dma_channel *c = &priv->channel[channel];
+    struct sim_dma_ring *ring = is_reader ? &c->reader : &c->writer;
+    uint32_t base = litepcie_sim_dma_base(priv->sim, channel);
+    uint32_t count = ring->geometry->bufferCount;
+    uint64_t hwcount, total;
+
+    hwcount = litepcie_dma_loop_status_count(litepcie_sim_readl(priv->sim, base + (is_reader ? PCIE_DMA_READER_TABLE_LOOP_STATUS_OFFSET : PCIE_DMA_WRITER_TABLE_LOOP_STATUS_OFFSET)), count);
+    *delta = litepcie_dma_count_delta(ring->count_prev, hwcount, count);
+    total = ring->progress->countTotal + *delta;
+    litepcie_dma_stats_service(ring->stats, *delta, ring->geometry->bufferSize, count, ring->count_prev > hwcount);
+    if (litepcie_dma_host_overrun(ring->host, total, count, is_reader))
+        ring->stats->heldOverruns += 1;
+    ring->count_prev = hwcount;
+
+    litepcie_dma_progress_set_count(ring->progress, total);
+    ring->progress->lastIrqTime = now;
+    ring->progress->irq.mmioReads += 1;
+
+    if (litepcie_dma_levels_due(ring->levels, now)) {
+        litepcie_dma_levels_sample(ring->levels,
+                                   litepcie_sim_readl(priv->sim, base + (is_reader ? PCIE_DMA_BUFFERING_READER_FIFO_LEVEL_ADDR : PCIE_DMA_BUFFERING_WRITER_FIFO_LEVEL_ADDR)),
+                                   litepcie_sim_readl(priv->sim, base + (is_reader ? PCIE_DMA_READER_TABLE_LEVEL_OFFSET : PCIE_DMA_WRITER_TABLE_LEVEL_OFFSET)),
+                                   now);
+        ring->progress->irq.mmioReads += 2;
+    }
+
+    return total;
+}
+
+static void sim_irq(void *opaque, uint32_t vector)
+{
+    struct sim_priv *priv = opaque;
+    const struct litepcie_irq_target *target;
+    uint32_t pending, clear = 0, hold = 0, bit = 0;
+    uint64_t now = sim_now_ns();
+
+    /* the model raises a single MSI, decode the vector register like the dext does */
+    vector = litepcie_sim_readl(priv->sim, CSR_TO_OFFSET(CSR_PCIE_MSI_VECTOR_ADDR));
+    pending = vector & priv->route.mask[0];
+
+    pthread_mutex_lock(&priv->lock);
+    priv->interrupts += 1;
+    priv->vector_reads += 1;
+    while ((target = litepcie_irq_route_next(&priv->route, &pending, &bit)) != NULL) {
+        struct sim_dma_channel *c = &priv->channel[target->channel];
+        struct sim_dma_ring *ring = target->is_reader ? &c->reader : &c->writer;
+        DMAIrqCounts *irq = &ring->progress->irq;
+        uint64_t total, delta, holdoff;
+
+        clear |= 1 << bit;
+        litepcie_dma_progress_begin(ring->progress);
+        total = sim_service(priv, target->channel, target->is_reader, now, &delta);
+        irq->irqs += 1;
+
+        if (ring->coalesce.mode == LITEPCIE_COALESCE_ADAPTIVE) {
+            litepcie_dma_coalesce_sample(&ring->coalesce, now, total);
+            holdoff = litepcie_dma_coalesce_holdoff_ns(&ring->coalesce, ring->geometry->bufferCount, ring->table_stride);
+            if (holdoff != 0 && !ring->held_off) {
+                ring->held_off = 1;
+                ring->holdoff_deadline = now + holdoff;
+                irq->holdoffs += 1;
+                hold |= 1 << bit;
+            }
+        }
+        litepcie_dma_progress_end(ring->progress);
+        litepcie_dma_stats_irq(ring->stats, ring->irq_time_prev, now, sim_now_ns(),
+                               delta, ring->table_stride);
+        ring->irq_time_prev = now;
+    }
+    if (hold) {
+        priv->msi_enable &= ~hold;
+        pthread_cond_signal(&priv->coalesce);
+    }
+    pthread_cond_broadcast(&priv->progress);
+    pthread_mutex_unlock(&priv->lock);
+
+    litepcie_sim_writel(priv->sim, CSR_TO_OFFSET(CSR_PCIE_MSI_CLEAR_ADDR), clear);
+}
+
+/*
+ * Releases held off directions once their latency target is up, like the
+ * dext's coalescing timer. Unmasking a pending source calls straight back
+ * into sim_irq, so MSI enable is only written from here, unlocked, until the
+ * model has caught up with priv->msi_enable.
+ */
+static void *sim_coalesce_thread(void *opaque)
+{
+    struct sim_priv *priv = opaque;
+
+    pthread_mutex_lock(&priv->lock);
+    while (!priv->stop) {
+        uint64_t now = sim_now_ns(), next = 0;
+        uint32_t release = 0, msi_enable;
+
+        for (uint32_t ch = 0; ch < priv->channels; ch++) {
+            struct sim_dma_channel *c = &priv->channel[ch];
+
+            for (uint8_t is_reader = 0; is_reader < 2; is_reader++) {
+                struct sim_dma_ring *ring = is_reader ? &c->reader : &c->writer;
+
+                if (!ring->held_off)
+                    continue;
+                if (ring->holdoff_deadline <= now) {
+                    /* completions during the holdoff only latched the vector, catch up by hand */
+                    uint64_t total, delta;
+
+                    litepcie_dma_progress_begin(ring->progress);
+                    total = sim_service(priv, ch, is_reader, now, &delta);
+                    litepcie_dma_progress_end(ring->progress);
+                    litepcie_dma_coalesce_released(&ring->coalesce, now, ring->holdoff_deadline, total);
+                    ring->held_off = 0;
+                    release |= 1 << (is_reader ? litepcie_dma_reader_irq(ch) : litepcie_dma_writer_irq(ch));
+                } else if (next == 0 || ring->holdoff_deadline < next) {
+                    next = ring->holdoff_deadline;
+                }
+            }
+        }
+
+        if (release) {
+            priv->msi_enable |= release;
+            pthread_cond_broadcast(&priv->progress);
+            pthread_mutex_unlock(&priv->lock);
+            litepcie_sim_writel(priv->sim, CSR_TO_OFFSET(CSR_PCIE_MSI_CLEAR_ADDR), release);
+            pthread_mutex_lock(&priv->lock);
+        }
+
+        if (priv->msi_enable != priv->msi_written) {
+            msi_enable = priv->msi_enable;
+            priv->msi_written = msi_enable;
+            pthread_mutex_unlock(&priv->lock);
+            litepcie_sim_writel(priv->sim, CSR_TO_OFFSET(CSR_PCIE_MSI_ENABLE_ADDR), msi_enable);
+            pthread_mutex_lock(&priv->lock);
+            continue;
+        }
+        if (release)
+            continue;
+
+        if (next == 0) {
+            pthread_cond_wait(&priv->coalesce, &priv->lock);
+        } else {
+            struct timespec deadline = { .tv_sec = next / 1000000000ULL, .tv_nsec = next % 1000000000ULL };
+            pthread_cond_timedwait(&priv->coalesce, &priv->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&priv->lock);
+
+    return NULL;
+}
+
+static void *sim_alloc(size_t size)
+{
+    void *p = NULL;
+
+    if (posix_memalign(&p, SIM_PAGE_SIZE, size) != 0)
+        return NULL;
+    memset(p, 0, size);
+    return p;
+}
+
+static void sim_ring_free(struct sim_priv *priv, struct sim_dma_ring *ring)
+{
+    if (ring->buf == NULL)
+        return;
+    litepcie_sim_dma_unmap(priv->sim, ring->bus);
+    free(ring->buf);
+    ring->buf = NULL;
+}
+
+static int sim_ring_alloc(struct sim_priv *priv, struct sim_dma_ring *ring,
+                          uint32_t buffer_size, uint32_t buffer_count, uint32_t buffer_per_irq)
+{
+    size_t size = (size_t)buffer_size * buffer_count;
+
+    ring->buf = sim_alloc(size);
+    if (!ring->buf)
+        return -1;
+    if (litepcie_sim_dma_map(priv->sim, ring->buf, size, &ring->bus) != 0) {
+        free(ring->buf);
+        ring->buf = NULL;
+        return -1;
+    }
+    litepcie_dma_progress_begin(ring->progress);
+    ring->geometry->bufferSize = buffer_size;
+    ring->geometry->bufferCount = buffer_count;
+    ring->geometry->bufferPerIrq = buffer_per_irq;
+    litepcie_dma_progress_end(ring->progress);
+
+    return 0;
+}
+
+static int sim_probe(const char *name)
+{
+    return strncmp(name, "sim", 3) == 0;
+}
+
+static void sim_close(struct litepcie_device *dev);
+
+static int sim_open(struct litepcie_device *dev, const char *name)
+{
+    struct litepcie_sim_config cfg;
+    struct sim_priv *priv;
+    const char *rate, *channels;
+
+    priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return -1;
+
+    litepcie_sim_config_default(&cfg);
+    rate = strchr(name, ':');
+    if (rate) {
+        cfg.line_rate = strtoull(rate + 1, NULL, 0);
+        channels = strchr(rate + 1, ':');
+        if (channels)
+            cfg.dma_channels = strtoul(channels + 1, NULL, 0);
+    }
+
+    priv->sim = litepcie_sim_create(&cfg);
+    if (!priv->sim) {
+        printf("Failed to create simulated device.\n");
+        free(priv);
+        return -1;
+    }
+    priv->channels = cfg.dma_channels;
+    litepcie_irq_route_build(&priv->route, priv->channels, 1, false);
+    pthread_mutex_init(&priv->lock, NULL);
+    pthread_cond_init(&priv->progress, NULL);
+    pthread_cond_init(&priv->coalesce, NULL);
+    dev->priv = priv;
+
+    for (uint32_t i = 0; i < priv->channels; i++) {
+        struct sim_dma_channel *c = &priv->channel[i];
+        c->counts = sim_alloc(SIM_PAGE_SIZE);
+        c->host = sim_alloc(SIM_PAGE_SIZE);
+        if (!c->counts || !c->host) {
+            sim_close(dev);
+            return -1;
+        }
+        c->counts->version = LITEPCIE_DMA_COUNTS_VERSION;
+        c->counts->size = sizeof(DMACounts);
+        c->reader.progress = &c->counts->reader;
+        c->writer.progress = &c->counts->writer;
+        c->reader.geometry = &c->reader.progress->geometry;
+        c->writer.geometry = &c->writer.progress->geometry;
+        c->reader.stats = &c->counts->readerStats;
+        c->writer.stats = &c->counts->writerStats;
+        c->reader.levels = &c->counts->readerLevels;
+        c->writer.levels = &c->counts->writerLevels;
+        c->host->version = LITEPCIE_DMA_HOST_VERSION;
+        c->host->size = sizeof(DMAHost);
+        c->reader.host = &c->host->reader;
+        c->writer.host = &c->host->writer;
+        litepcie_dma_coalesce_init(&c->reader.coalesce, LITEPCIE_COALESCE_FIXED, 0);
+        litepcie_dma_coalesce_init(&c->writer.coalesce, LITEPCIE_COALESCE_FIXED, 0);
+        if (sim_ring_alloc(priv, &c->reader, DMA_BUFFER_SIZE, DMA_BUFFER_COUNT, DMA_BUFFER_PER_IRQ)
+            || sim_ring_alloc(priv, &c->writer, DMA_BUFFER_SIZE, DMA_BUFFER_COUNT, DMA_BUFFER_PER_IRQ)) {
+            printf("Failed to allocate simulated DMA buffers.\n");
+            sim_close(dev);
+            return -1;
+        }
+    }
+
+    if (pthread_create(&priv->coalesce_thread, NULL, sim_coalesce_thread, priv) != 0) {
+        sim_close(dev);
+        return -1;
+    }
+    priv->coalesce_running = 1;
+
+    litepcie_sim_set_irq_handler(priv->sim, sim_irq, priv);
+    printf("Opened simulated device.\n");
+
+    return 0;
+}
+
+static void sim_close(struct litepcie_device *dev)
+{
+    struct sim_priv *priv = dev->priv;
+
+    if (priv->coalesce_running) {
+        pthread_mutex_lock(&priv->lock);
+        priv->stop = 1;
+        pthread_cond_signal(&priv->coalesce);
+        pthread_mutex_unlock(&priv->lock);
+        pthread_join(priv->coalesce_thread, NULL);
+    }
+    litepcie_sim_destroy(priv->sim);
+    for (uint32_t i = 0; i < priv->channels; i++) {
+        free(priv->channel[i].reader.buf);
+        free(priv->channel[i].writer.buf);
+        free(priv->channel[i].counts);
+        free(priv->channel[i].host);
+    }
+    pthread_cond_destroy(&priv->coalesce);
+    pthread_cond_destroy(&priv->progress);
+    pthread_mutex_destroy(&priv->lock);
+    free(priv);
+}
+
+static uint32_t sim_readl(struct litepcie_device *dev, uint32_t addr)
+{
+    struct sim_priv *priv = dev->priv;
+    return litepcie_sim_readl(priv->sim, addr);
+}
+
+static void sim_writel(struct litepcie_device *dev, uint32_t addr, uint32_t val)
+{
+    struct sim_priv *priv = dev->priv;
+    litepcie_sim_writel(priv->sim, addr, val);
+}
+
+static void *sim_map(struct litepcie_device *dev, uint32_t type, uint8_t channel, size_t *size)
+{
+    struct sim_priv *priv = dev->priv;
+    struct sim_dma_channel *c;
+    struct sim_dma_ring *ring;
+
+    if (channel >= priv->channels)
+        return NULL;
+    c = &priv->channel[channel];
+
+    switch (type) {
+    case LITEPCIE_DMA_READER:
+    case LITEPCIE_DMA_WRITER:
+        ring = (type == LITEPCIE_DMA_READER) ? &c->reader : &c->writer;
+        if (size)
+            *size = (size_t)ring->geometry->bufferSize * ring->geometry->bufferCount;
+        return ring->buf;
+    case LITEPCIE_DMA_COUNTS:
+        if (size)
+            *size = sizeof(DMACounts);
+        return c->counts;
+    case LITEPCIE_DMA_HOST:
+        if (size)
+            *size = sizeof(DMAHost);
+        return c->host;
+    default:
+        return NULL;
+    }
+}
+
+static void sim_unmap(struct litepcie_device *dev, uint32_t type, uint8_t channel, void *addr)
+{
+    /* buffers live as long as the device */
+}
+
+static void sim_setup_table(struct sim_priv *priv, uint32_t base, struct sim_dma_ring *ring, uint8_t is_reader)
+{
+    uint32_t enable = is_reader ? PCIE_DMA_READER_ENABLE_OFFSET : PCIE_DMA_WRITER_ENABLE_OFFSET;
+    uint32_t reset = is_reader ? PCIE_DMA_READER_TABLE_FLUSH_OFFSET : PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET;
+    uint32_t prog_n = is_reader ? PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET : PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET;
+    uint32_t value = is_reader ? PCIE_DMA_READER_TABLE_VALUE_OFFSET : PCIE_DMA_WRITER_TABLE_VALUE_OFFSET;
+    uint32_t we = is_reader ? PCIE_DMA_READER_TABLE_WE_OFFSET : PCIE_DMA_WRITER_TABLE_WE_OFFSET;
+    DMAGeometry *g = ring->geometry;
+    struct litepcie_dma_segment segment = { .address = ring->bus, .length = (uint64_t)g->bufferSize * g->bufferCount };
+    uint32_t stride = litepcie_dma_coalesce_stride(&ring->coalesce, g->bufferPerIrq);
+    uint64_t address;
+
+    /* same as the dext, a table left by a stop is reused while it is all there */
+    if (ring->table_valid && ring->table_stride == stride &&
+        litepcie_sim_readl(priv->sim, base + (is_reader ? PCIE_DMA_READER_TABLE_LEVEL_OFFSET : PCIE_DMA_WRITER_TABLE_LEVEL_OFFSET)) == g->bufferCount)
+        return;
+
+    litepcie_sim_writel(priv->sim, base + enable, 0);
+    litepcie_sim_writel(priv->sim, base + reset, 1);
+    litepcie_sim_writel(priv->sim, base + prog_n, 0);
+
+    for (uint32_t i = 0; i < g->bufferCount; i++) {
+        if (litepcie_dma_ring_address(&segment, 1, (uint64_t)i * g->bufferSize, g->bufferSize, &address) != 0)
+            break;
+        litepcie_sim_writel(priv->sim, base + value, litepcie_dma_desc_config(g->bufferSize, litepcie_dma_desc_irq(i, stride)));
+        litepcie_sim_writel(priv->sim, base + value + 4, address & 0xffffffff);
+        litepcie_sim_writel(priv->sim, base + we, address >> 32);
+    }
+
+    litepcie_sim_writel(priv->sim, base + prog_n, 1);
+
+    ring->table_valid = 1;
+    ring->table_rewound = 1;
+    ring->table_stride = stride;
+}
+
+static int sim_dma_enable(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader, uint8_t enable)
+{
+    struct sim_priv *priv = dev->priv;
+    struct sim_dma_channel *c;
+    struct sim_dma_ring *ring;
+    uint32_t base, irq;
+
+    if (channel >= priv->channels)
+        return -1;
+    c = &priv->channel[channel];
+    ring = is_reader ? &c->reader : &c->writer;
+    base = litepcie_sim_dma_base(priv->sim, channel);
+    irq = is_reader ? litepcie_dma_reader_irq(channel) : litepcie_dma_writer_irq(channel);
+
+    if (ring->enabled == enable)
+        return 0;
+    if (enable && ring->buf == NULL)
+        return -1;
+
+    if (enable) {
+        uint32_t fifo_control;
+
+        sim_setup_table(priv, base, ring, is_reader);
+        fifo_control = litepcie_sim_readl(priv->sim, base + (is_reader ? PCIE_DMA_BUFFERING_READER_FIFO_DEPTH_ADDR : PCIE_DMA_BUFFERING_WRITER_FIFO_DEPTH_ADDR));
+
+        pthread_mutex_lock(&priv->lock);
+        if (ring->table_rewound) {
+            litepcie_dma_progress_begin(ring->progress);
+            litepcie_dma_progress_set_count(ring->progress, 0);
+            ring->progress->lastIrqTime = 0;
+            litepcie_dma_progress_end(ring->progress);
+            ring->count_prev = 0;
+            ring->table_rewound = 0;
+        }
+        ring->irq_time_prev = 0;
+        litepcie_dma_levels_reset(ring->levels, fifo_control);
+        litepcie_dma_coalesce_restart(&ring->coalesce);
+        ring->held_off = 0;
+        priv->msi_enable |= 1 << irq;
+        pthread_cond_signal(&priv->coalesce);
+        pthread_mutex_unlock(&priv->lock);
+
+        litepcie_sim_writel(priv->sim, base + (is_reader ? PCIE_DMA_READER_ENABLE_OFFSET : PCIE_DMA_WRITER_ENABLE_OFFSET), 1);
+    } else {
+        /* the looping table stays, like the dext's stop */
+        litepcie_sim_writel(priv->sim, base + (is_reader ? PCIE_DMA_READER_ENABLE_OFFSET : PCIE_DMA_WRITER_ENABLE_OFFSET), 0);
+    }
+    ring->enabled = enable;
+    ring->paused = 0;
+
+    return 0;
+}
+
+static int sim_dma_pause(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader, uint8_t pause)
+{
+    struct sim_priv *priv = dev->priv;
+    struct sim_dma_ring *ring;
+
+    if (channel >= priv->channels)
+        return -1;
+    ring = is_reader ? &priv->channel[channel].reader : &priv->channel[channel].writer;
+    if (!ring->enabled)
+        return -1;
+
+    if (ring->paused != pause) {
+        litepcie_sim_writel(priv->sim, litepcie_sim_dma_base(priv->sim, channel) + (is_reader ? PCIE_DMA_READER_ENABLE_OFFSET : PCIE_DMA_WRITER_ENABLE_OFFSET), !pause);
+        ring->paused = pause;
+    }
+
+    return 0;
+}
+
+static int sim_dma_geometry(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader,
+                            uint32_t buffer_size, uint32_t buffer_count, uint32_t buffer_per_irq)
+{
+    struct sim_priv *priv = dev->priv;
+    struct sim_dma_ring *ring;
+
+    if (channel >= priv->channels || !litepcie_dma_geometry_valid(buffer_size, buffer_count, buffer_per_irq))
+        return -1;
+    ring = is_reader ? &priv->channel[channel].reader : &priv->channel[channel].writer;
+    if (ring->enabled)
+        return -1;
+
+    if (ring->geometry->bufferSize == buffer_size && ring->geometry->bufferCount == buffer_count) {
+        /* same ring, only the IRQ stride changes */
+        pthread_mutex_lock(&priv->lock);
+        litepcie_dma_progress_begin(ring->progress);
+        ring->geometry->bufferPerIrq = buffer_per_irq;
+        litepcie_dma_progress_end(ring->progress);
+        pthread_mutex_unlock(&priv->lock);
+        return 0;
+    }
+
+    ring->table_valid = 0;
+    sim_ring_free(priv, ring);
+    if (sim_ring_alloc(priv, ring, buffer_size, buffer_count, buffer_per_irq) != 0) {
+        if (sim_ring_alloc(priv, ring, DMA_BUFFER_SIZE, DMA_BUFFER_COUNT, DMA_BUFFER_PER_IRQ) != 0) {
+            /* like the dext, no ring at all shows as an empty geometry */
+            litepcie_dma_progress_begin(ring->progress);
+            ring->geometry->bufferSize = 0;
+            ring->geometry->bufferCount = 0;
+            ring->geometry->bufferPerIrq = 0;
+            litepcie_dma_progress_end(ring->progress);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sim_dma_coalesce(struct litepcie_device *dev, uint8_t channel, uint8_t is_reader,
+                            uint32_t mode, uint32_t buffer_per_irq, uint32_t latency_us)
+{
+    struct sim_priv *priv = dev->priv;
+    struct sim_dma_ring *ring;
+
+    if (channel >= priv->channels || !litepcie_dma_coalesce_valid(mode, latency_us))
+        return -1;
+    ring = is_reader ? &priv->channel[channel].reader : &priv->channel[channel].writer;
+    if (ring->enabled || buffer_per_irq > ring->geometry->bufferCount)
+        return -1;
+
+    pthread_mutex_lock(&priv->lock);
+    if (buffer_per_irq != 0) {
+        litepcie_dma_progress_begin(ring->progress);
+        ring->geometry->bufferPerIrq = buffer_per_irq;
+        litepcie_dma_progress_end(ring->progress);
+    }
+    litepcie_dma_coalesce_init(&ring->coalesce, mode, latency_us);
+    pthread_mutex_unlock(&priv->lock);
+
+    return 0;
+}
+
+static int sim_wait(struct litepcie_device *dev, uint8_t channel,
+                    uint64_t reader_count, uint64_t writer_count, int64_t timeout_us)
+{
+    struct sim_priv *priv = dev->priv;
+    struct sim_dma_channel *c;
+    struct timespec deadline;
+    struct timeval now;
+    int done = 0, ret = 0;
+
+    if (channel >= priv->channels)
+        return -1;
+    c = &priv->channel[channel];
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + (now.tv_usec + timeout_us) / 1000000;
+    deadline.tv_nsec = ((now.tv_usec + timeout_us) % 1000000) * 1000;
+
+    /* the counts only move under the lock, so a check under it can't miss a broadcast */
+    pthread_mutex_lock(&priv->lock);
+    for (;;) {
+        done = litepcie_dma_progress_count(c->reader.progress) >= reader_count
+            || litepcie_dma_progress_count(c->writer.progress) >= writer_count;
+        if (done || ret == ETIMEDOUT)
+            break;
+        ret = pthread_cond_timedwait(&priv->progress, &priv->lock, &deadline);
+    }
+    pthread_mutex_unlock(&priv->lock);
+
+    return done ? 0 : 1;
+}
+
+static int sim_stats(struct litepcie_device *dev, LitePCIeStats *stats)
+{
+    struct sim_priv *priv = dev->priv;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->version = LITEPCIE_STATS_VERSION;
+    stats->size = sizeof(*stats);
+    stats->time = sim_now_ns();
+    stats->sources = priv->route.sources;
+
+    pthread_mutex_lock(&priv->lock);
+    stats->interrupts[0] = priv->interrupts;
+    stats->vectorReads[0] = priv->vector_reads;
+    pthread_mutex_unlock(&priv->lock);
+
+    return 0;
+}
+
+static int sim_dma_stats(struct litepcie_device *dev, uint8_t channel, DMACounts *counts)
+{
+    struct sim_priv *priv = dev->priv;
+
+    if (channel >= priv->channels)
+        return -1;
+    litepcie_dma_counts_read(priv->channel[channel].counts, counts);
+    return 0;
+}
+
+static int sim_flash(struct litepcie_device *dev, LitePCIeFlashCallData *m)
+{
+    /* no SPI flash in the model */
+    return -1;
+}
+
+static int sim_flash_program(struct litepcie_device *dev, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    return -1;
+}
+
+static int sim_flash_read(struct litepcie_device *dev, uint32_t addr, uint8_t *data, uint32_t size)
+{
+    return -1;
+}
+
+static int sim_flash_erase(struct litepcie_device *dev, uint32_t addr, uint8_t cmd)
+{
+    return -1;
+}
+
+static int sim_flash_crc(struct litepcie_device *dev, uint32_t addr, uint32_t size, uint32_t *crc)
+{
+    return -1;
+}
+
+static void sim_reload(struct litepcie_device *dev)
+{
+}
+
+const struct litepcie_backend_ops litepcie_backend_sim = {
+    .name = "sim",
+    .probe = sim_probe,
+    .open = sim_open,
+    .close = sim_close,
+    .readl = sim_readl,
+    .writel = sim_writel,
+    .csr_batch = litepcie_csr_batch_generic,
+    .map = sim_map,
+    .unmap = sim_unmap,
+    .dma_enable = sim_dma_enable,
+    .dma_pause = sim_dma_pause,
+    .dma_geometry = sim_dma_geometry,
+    .dma_coalesce = sim_dma_coalesce,
+    .wait = sim_wait,
+    .stats = sim_stats,
+    .dma_stats = sim_dma_stats,
+    .flash = sim_flash,
+    .flash_program = sim_flash_program,
+    .flash_read = sim_flash_read,
+    .flash_erase = sim_flash_erase,
+    .flash_crc = sim_flash_crc,
+    .reload = sim_reload,
+};
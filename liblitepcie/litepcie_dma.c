@@ -8,90 +8,105 @@
  *
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include "litepcie_backend.h"
 #include "litepcie_dma.h"
+#include "litepcie_dma_common.h"
+#include "litepcie_dma_progress.h"
 #include "litepcie_helpers.h"
 #include "litepcie.h"
 
 
-void litepcie_dma_set_loopback(int fd, struct litepcie_dma_ctrl *dma, uint8_t loopback_enable) {
+int litepcie_dma_set_loopback(int fd, struct litepcie_dma_ctrl *dma, uint8_t loopback_enable) {
+    uint32_t base;
+
     printf("litepcie_dma_set_loopback\n");
-#ifdef CSR_PCIE_DMA0_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 0) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA0_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA1_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 1) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA1_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA2_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 2) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA2_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA3_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 3) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA3_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA4_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 4) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA4_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA5_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 5) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA5_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA6_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 6) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA6_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
-#ifdef CSR_PCIE_DMA7_LOOPBACK_ENABLE_ADDR
-    if (dma->dma_channel == 7) {
-        litepcie_writel(fd, CSR_TO_OFFSET(CSR_PCIE_DMA7_LOOPBACK_ENABLE_ADDR), loopback_enable ? 1 : 0);
-    }
-#endif
+    if (litepcie_dma_channel_base(dma->dma_channel, &base) != 0)
+        return -1;
+    litepcie_writel(fd, base + PCIE_DMA_LOOPBACK_ENABLE_OFFSET, loopback_enable ? 1 : 0);
+    return 0;
+}
+
+/* released first, see DMAHostCursor */
+static void litepcie_dma_host_publish(DMAHostCursor *c, uint64_t acquired, uint64_t held)
+{
+    __atomic_store_n(&c->released, acquired - held, __ATOMIC_RELEASE);
+    __atomic_store_n(&c->acquired, acquired, __ATOMIC_RELEASE);
 }
 
+/*
+ * A restart with an unchanged table carries the driver counts on from where
+ * the direction stopped instead of from 0, take them as the new start.
+ */
 void litepcie_dma_writer(struct litepcie_dma_ctrl *dma, uint8_t enable) {
-    kern_return_t ret = kIOReturnSuccess;
-    
-    LitePCIeConfigDmaChannelData data;
-    data.channel = dma->dma_channel;
-    data.enable = enable;
-    
-    ret = IOConnectCallStructMethod(dma->fd, LITEPCIE_CONFIG_DMA_WRITER_CHANNEL, &data, sizeof(LitePCIeConfigDmaChannelData), NULL, 0);
-    
-    if (ret != kIOReturnSuccess) {
-        printf("LITEPCIE_CONFIG_DMA_WRITER_CHANNEL failed with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
+    struct litepcie_device *dev = litepcie_get_device(dma->fd);
+
+    if (!dev || dma->writer_enabled == enable)
+        return;
+    if (dev->ops->dma_enable(dev, dma->dma_channel, 0, enable) != 0)
+        return;
+    dma->writer_enabled = enable;
+    if (enable && dma->hw_counts) {
+        dma->writer_hw_count = litepcie_dma_progress_count(&dma->hw_counts->writer);
+        dma->writer_sw_count = dma->writer_hw_count;
+        dma->buffers_available_read = 0;
+        dma->writer_acquired = dma->writer_sw_count;
+        dma->writer_held = 0;
+        dma->writer_runs.runs = 0;
+        if (dma->host)
+            litepcie_dma_host_publish(&dma->host->writer, dma->writer_acquired, 0);
     }
 }
 
 void litepcie_dma_reader(struct litepcie_dma_ctrl *dma, uint8_t enable) {
-    kern_return_t ret = kIOReturnSuccess;
-    
-    LitePCIeConfigDmaChannelData data;
-    data.channel = dma->dma_channel;
-    data.enable = enable;
-    
-    ret = IOConnectCallStructMethod(dma->fd, LITEPCIE_CONFIG_DMA_READER_CHANNEL, &data, sizeof(LitePCIeConfigDmaChannelData), NULL, 0);
-    
-    if (ret != kIOReturnSuccess) {
-        printf("LITEPCIE_CONFIG_DMA_READER_CHANNEL failed with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
+    struct litepcie_device *dev = litepcie_get_device(dma->fd);
+
+    if (!dev || dma->reader_enabled == enable)
+        return;
+    if (dev->ops->dma_enable(dev, dma->dma_channel, 1, enable) != 0)
+        return;
+    dma->reader_enabled = enable;
+    if (enable && dma->hw_counts) {
+        dma->reader_hw_count = litepcie_dma_progress_count(&dma->hw_counts->reader);
+        dma->reader_sw_count = dma->reader_hw_count;
+        dma->buffers_available_write = 0;
+        dma->reader_synced = 0;
+        dma->reader_acquired = dma->reader_sw_count;
+        dma->reader_held = 0;
+        dma->reader_runs.runs = 0;
+        if (dma->host)
+            litepcie_dma_host_publish(&dma->host->reader, dma->reader_acquired, 0);
     }
 }
 
+int litepcie_dma_pause(struct litepcie_dma_ctrl *dma, uint8_t pause) {
+    struct litepcie_device *dev = litepcie_get_device(dma->fd);
+
+    if (!dev || !dev->ops->dma_pause)
+        return -1;
+    if (dma->use_writer && dma->writer_enabled && dev->ops->dma_pause(dev, dma->dma_channel, 0, pause) != 0)
+        return -1;
+    if (dma->use_reader && dma->reader_enabled && dev->ops->dma_pause(dev, dma->dma_channel, 1, pause) != 0)
+        return -1;
+    return 0;
+}
+
+int litepcie_dma_set_coalesce(struct litepcie_dma_ctrl *dma, uint8_t is_reader,
+                              uint32_t mode, uint32_t buffer_per_irq, uint32_t latency_us) {
+    struct litepcie_device *dev = litepcie_get_device(dma->fd);
+
+    if (!dev || !dev->ops->dma_coalesce)
+        return -1;
+    return dev->ops->dma_coalesce(dev, dma->dma_channel, is_reader, mode, buffer_per_irq, latency_us);
+}
+
 ///* lock */
 //
 //uint8_t litepcie_request_dma(int fd, uint8_t reader, uint8_t writer) {
@@ -114,16 +129,72 @@ void litepcie_dma_reader(struct litepcie_dma_ctrl *dma, uint8_t enable) {
 ////    checked_ioctl(fd, LITEPCIE_IOCTL_LOCK, &m);
 //}
 
+static int litepcie_dma_set_geometry(struct litepcie_device *dev, struct litepcie_dma_ctrl *dma,
+                                     uint8_t is_reader, struct litepcie_dma_geometry *g)
+{
+    if (g->buffer_size == 0 && g->buffer_count == 0 && g->buffer_per_irq == 0)
+        return 0;
+
+    if (g->buffer_size == 0)
+        g->buffer_size = DMA_BUFFER_SIZE;
+    if (g->buffer_count == 0)
+        g->buffer_count = DMA_BUFFER_COUNT;
+    if (g->buffer_per_irq == 0)
+        g->buffer_per_irq = g->buffer_count < DMA_BUFFER_PER_IRQ ? g->buffer_count : DMA_BUFFER_PER_IRQ;
+
+    if (!dev->ops->dma_geometry)
+        return -1;
+    return dev->ops->dma_geometry(dev, dma->dma_channel, is_reader, g->buffer_size, g->buffer_count, g->buffer_per_irq);
+}
+
+static void litepcie_dma_get_geometry(struct litepcie_dma_geometry *g, const DMAGeometry *hw)
+{
+    g->buffer_size = hw->bufferSize;
+    g->buffer_count = hw->bufferCount;
+    g->buffer_per_irq = hw->bufferPerIrq;
+}
+
 int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, uint8_t zero_copy)
 {
-    kern_return_t ret = kIOReturnSuccess;
-    
+    struct litepcie_device *dev;
+    DMAProgress progress;
+
+    dma->reader_enabled = 0;
+    dma->writer_enabled = 0;
     dma->reader_sw_count = 0;
     dma->writer_sw_count = 0;
+    dma->reader_hw_count = 0;
+    dma->writer_hw_count = 0;
+
+    dma->buffers_available_read = 0;
+    dma->buffers_available_write = 0;
+    dma->writer_overruns = 0;
+    dma->writer_dropped = 0;
+    dma->reader_underruns = 0;
+    dma->reader_dropped = 0;
+    dma->reader_synced = 0;
+
+    dma->hw_counts = NULL;
+    dma->host = NULL;
+    dma->reader_acquired = 0;
+    dma->reader_held = 0;
+    dma->writer_acquired = 0;
+    dma->writer_held = 0;
+    dma->reader_runs.runs = 0;
+    dma->writer_runs.runs = 0;
+
+    dma->wait_spin_us = LITEPCIE_DMA_WAIT_SPIN_US;
+    dma->wait_spins = 0;
+    dma->wait_sleeps = 0;
 
     dma->zero_copy = zero_copy;
 
     dma->fd = litepcie_open(device_name, O_RDWR);
+    dev = litepcie_get_device(dma->fd);
+    if (!dev) {
+        printf("failed to open %s\n", device_name);
+        return EXIT_FAILURE;
+    }
 
     /* request dma reader and writer */
 //    if ((litepcie_request_dma(dma->fds.fd, dma->use_reader, dma->use_writer) == 0)) {
@@ -131,52 +202,65 @@ int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, ui
 //        return -1;
 //    }
 
-    litepcie_dma_set_loopback(dma->fd, dma, dma->loopback);
-    
+    if (litepcie_dma_set_loopback(dma->fd, dma, dma->loopback) != 0) {
+        printf("no DMA channel %d in csr.h\n", dma->dma_channel);
+        return EXIT_FAILURE;
+    }
+
+    /* geometry has to be settled before the rings get mapped */
+    if (dma->use_writer && litepcie_dma_set_geometry(dev, dma, 0, &dma->writer_geometry) != 0) {
+        printf("failed to set writer geometry");
+        return EXIT_FAILURE;
+    }
+    if (dma->use_reader && litepcie_dma_set_geometry(dev, dma, 1, &dma->reader_geometry) != 0) {
+        printf("failed to set reader geometry");
+        return EXIT_FAILURE;
+    }
+
     if (dma->use_writer) {
-        mach_vm_address_t writerAddress = 0;
-        mach_vm_size_t writerSize = 0;
-        
-        ret = IOConnectMapMemory64(dma->fd, LITEPCIE_DMA_WRITER | 0, mach_task_self(), &writerAddress, &writerSize, kIOMapAnywhere);
-        
-        printf("writer ret: 0x%x\n", ret);
-        
-        if (writerAddress != 0) {
-            dma->buf_rd = (uint8_t*)writerAddress;
-        } else {
+        dma->buf_rd = dev->ops->map(dev, LITEPCIE_DMA_WRITER, dma->dma_channel, NULL);
+        if (dma->buf_rd == NULL) {
             printf("failed to acquire writer mapped buffer");
             return EXIT_FAILURE;
         }
     }
     
     if (dma->use_reader) {
-        mach_vm_address_t readerAddress = 0;
-        mach_vm_size_t readerSize = 0;
-        ret = IOConnectMapMemory64(dma->fd, LITEPCIE_DMA_READER | 0, mach_task_self(), &readerAddress, &readerSize, kIOMapAnywhere);
-        
-        printf("reader ret: 0x%x\n", ret);
-        
-        if (readerAddress != 0) {
-            dma->buf_wr = (uint8_t*)readerAddress;
-        } else {
+        dma->buf_wr = dev->ops->map(dev, LITEPCIE_DMA_READER, dma->dma_channel, NULL);
+        if (dma->buf_wr == NULL) {
             printf("failed to acquire reader mapped buffer");
             return EXIT_FAILURE;
         }
     }
     
     if (dma->use_writer || dma->use_reader) {
-        mach_vm_address_t countAddress = 0;
-        mach_vm_size_t countsize = 0;
-        ret = IOConnectMapMemory64(dma->fd, LITEPCIE_DMA_COUNTS | 0, mach_task_self(), &countAddress, &countsize, kIOMapAnywhere);
-        
-        printf("counts ret: 0x%x\n", ret);
-        
-        if (countAddress != 0) {
-            dma->hw_counts = (DMACounts*)countAddress;
-        } else {
+        dma->hw_counts = dev->ops->map(dev, LITEPCIE_DMA_COUNTS, dma->dma_channel, NULL);
+        if (dma->hw_counts == NULL) {
             printf("failed to acquire counts mapped buffer");
             return EXIT_FAILURE;
         }
+        if (!litepcie_dma_counts_valid(dma->hw_counts)) {
+            printf("counts page version %u size %u, expected %u size %zu\n",
+                dma->hw_counts->version, dma->hw_counts->size, LITEPCIE_DMA_COUNTS_VERSION, sizeof(DMACounts));
+            return EXIT_FAILURE;
+        }
+        litepcie_dma_progress_read(&dma->hw_counts->reader, &progress);
+        litepcie_dma_get_geometry(&dma->reader_geometry, &progress.geometry);
+        litepcie_dma_progress_read(&dma->hw_counts->writer, &progress);
+        litepcie_dma_get_geometry(&dma->writer_geometry, &progress.geometry);
+    }
+
+    if (dma->zero_copy && (dma->use_writer || dma->use_reader)) {
+        dma->host = dev->ops->map(dev, LITEPCIE_DMA_HOST, dma->dma_channel, NULL);
+        if (dma->host == NULL) {
+            printf("failed to acquire host cursor page");
+            return EXIT_FAILURE;
+        }
+        if (!litepcie_dma_host_valid(dma->host)) {
+            printf("host page version %u size %u, expected %u size %zu\n",
+                dma->host->version, dma->host->size, LITEPCIE_DMA_HOST_VERSION, sizeof(DMAHost));
+            return EXIT_FAILURE;
+        }
     }
 
     return 0;
@@ -184,85 +268,501 @@ int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, ui
 
 void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma)
 {
-    if (dma->use_reader)
-        litepcie_dma_reader(dma, 0);
-    if (dma->use_writer)
-        litepcie_dma_writer(dma, 0);
+    struct litepcie_device *dev = litepcie_get_device(dma->fd);
+
+    if (!dev)
+        return;
+
+    litepcie_dma_stop(dma);
 
 //    litepcie_release_dma(dma->fds.fd, dma->use_reader, dma->use_writer);
 
     if (dma->use_reader)
-        IOConnectUnmapMemory(dma->fd, LITEPCIE_DMA_READER | 0, mach_task_self(), (mach_vm_address_t)dma->buf_rd);
+        dev->ops->unmap(dev, LITEPCIE_DMA_READER, dma->dma_channel, dma->buf_wr);
     if (dma->use_writer)
-        IOConnectUnmapMemory(dma->fd, LITEPCIE_DMA_WRITER | 0, mach_task_self(), (mach_vm_address_t)dma->buf_wr);
+        dev->ops->unmap(dev, LITEPCIE_DMA_WRITER, dma->dma_channel, dma->buf_rd);
     if (dma->use_writer || dma->use_reader)
-        IOConnectUnmapMemory(dma->fd, LITEPCIE_DMA_COUNTS | 0, mach_task_self(), (mach_vm_address_t)dma->hw_counts);
+        dev->ops->unmap(dev, LITEPCIE_DMA_COUNTS, dma->dma_channel, dma->hw_counts);
+    if (dma->host) {
+        /* nothing held anymore as far as the driver is concerned */
+        litepcie_dma_host_publish(&dma->host->reader, dma->reader_acquired, 0);
+        litepcie_dma_host_publish(&dma->host->writer, dma->writer_acquired, 0);
+        dev->ops->unmap(dev, LITEPCIE_DMA_HOST, dma->dma_channel, dma->host);
+        dma->host = NULL;
+    }
+
+    litepcie_close(dma->fd);
 }
 
-void litepcie_dma_process(struct litepcie_dma_ctrl *dma)
+uint64_t litepcie_dma_hw_count(struct litepcie_dma_ctrl *dma, uint8_t is_reader)
+{
+    return litepcie_dma_progress_count(is_reader ? &dma->hw_counts->reader : &dma->hw_counts->writer);
+}
+
+void litepcie_dma_get_progress(struct litepcie_dma_ctrl *dma, uint8_t is_reader, DMAProgress *progress)
 {
-    /* set / get dma */
+    litepcie_dma_progress_read(is_reader ? &dma->hw_counts->reader : &dma->hw_counts->writer, progress);
+}
+
+static inline void litepcie_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ volatile("pause");
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static int64_t litepcie_dma_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int litepcie_dma_wait(struct litepcie_dma_ctrl *dma, uint32_t min_buffers, int64_t timeout_us)
+{
+    struct litepcie_device *dev = litepcie_get_device(dma->fd);
+    uint64_t reader_count = LITEPCIE_WAIT_NONE, writer_count = LITEPCIE_WAIT_NONE;
+    int64_t start, spent;
+    int ret;
+
+    if (!dev)
+        return -1;
+    /* both the spin and the counts to wait for come from the counts page */
+    if (!dma->hw_counts)
+        return -ENOTSUP;
+
+    if (dma->use_reader)
+        reader_count = dma->reader_hw_count + min_buffers;
     if (dma->use_writer)
+        writer_count = dma->writer_hw_count + min_buffers;
+
+    /* spin first, for short gaps a wakeup costs more than the wait itself */
+    start = litepcie_dma_time_us();
+    do {
+        if (litepcie_dma_progress_count(&dma->hw_counts->reader) >= reader_count
+            || litepcie_dma_progress_count(&dma->hw_counts->writer) >= writer_count) {
+            dma->wait_spins++;
+            return 0;
+        }
+        litepcie_cpu_relax();
+        spent = litepcie_dma_time_us() - start;
+    } while (spent < dma->wait_spin_us && spent < timeout_us);
+
+    if (spent >= timeout_us)
+        return 1;
+
+    ret = dev->ops->wait(dev, dma->dma_channel, reader_count, writer_count, timeout_us - spent);
+    if (ret == 0)
+        dma->wait_sleeps++;
+    return ret;
+}
+
+/*
+ * Host side of the device -> host ring. The device keeps writing whether or
+ * not the host kept up, once more than a ring minus the one being written
+ * is unread the oldest buffers are gone: skip exactly those, the host picks
+ * up again at the oldest one still intact, and account for them instead of
+ * handing out garbage.
+ */
+static void litepcie_dma_sync_read(struct litepcie_dma_ctrl *dma)
+{
+    uint32_t count = dma->writer_geometry.buffer_count;
+    uint64_t next = dma->writer_sw_count - dma->buffers_available_read;
+    uint64_t unread, lost;
+
+    dma->writer_hw_count = litepcie_dma_progress_count(&dma->hw_counts->writer);
+    if (dma->writer_hw_count <= dma->writer_sw_count)
+        return;
+
+    unread = dma->writer_hw_count - next;
+    if (unread > count - 1) {
+        lost = unread - (count - 1);
+        next += lost;
+        dma->writer_overruns++;
+        dma->writer_dropped += lost;
+    }
+
+    dma->buffers_available_read = dma->writer_hw_count - next;
+    dma->usr_read_buf_offset = next % count;
+    dma->writer_sw_count = dma->writer_hw_count;
+}
+
+/*
+ * Host side of the host -> device ring. The host stays reader_lead buffers
+ * ahead of the device, when the device catches up with what was handed out
+ * it has replayed stale buffers: count them and restart just ahead of it.
+ * The first sync after an enable only takes the device position, nothing
+ * was handed out yet that it could have caught up with.
+ */
+static void litepcie_dma_sync_write(struct litepcie_dma_ctrl *dma)
+{
+    uint32_t count = dma->reader_geometry.buffer_count;
+    uint32_t lead = dma->reader_lead;
+    uint64_t next = dma->reader_sw_count - dma->buffers_available_write;
+    uint64_t target;
+
+    if (lead == 0 || lead > count - 1)
+        lead = count / 2;
+
+    dma->reader_hw_count = litepcie_dma_progress_count(&dma->hw_counts->reader);
+    if (dma->reader_hw_count > next) {
+        if (dma->reader_synced) {
+            dma->reader_underruns++;
+            dma->reader_dropped += dma->reader_hw_count - next;
+        }
+        next = dma->reader_hw_count;
+        dma->reader_sw_count = next;
+    }
+    dma->reader_synced = 1;
+
+    target = dma->reader_hw_count + lead;
+    if (target > dma->reader_sw_count)
+        dma->reader_sw_count = target;
+    dma->buffers_available_write = dma->reader_sw_count - next;
+    dma->usr_write_buf_offset = next % count;
+}
+
+int litepcie_dma_start(struct litepcie_dma_ctrl *dma)
+{
+    /* losses are per stream, counted from the enable on */
+    dma->writer_overruns = 0;
+    dma->writer_dropped = 0;
+    dma->reader_underruns = 0;
+    dma->reader_dropped = 0;
+
+    /* writer first, RX is ready by the time loopback data comes back */
+    if (dma->use_writer) {
         litepcie_dma_writer(dma, 1);
-    if (dma->use_reader)
-        litepcie_dma_reader(dma, 1);
-    
-    if (dma->hw_counts->hwWriterCountTotal > dma->writer_sw_count) {
-        /* count available buffers */
-        dma->buffers_available_read = dma->hw_counts->hwWriterCountTotal - dma->writer_sw_count;
-        dma->usr_read_buf_offset = dma->writer_sw_count % DMA_BUFFER_COUNT;
-        dma->writer_sw_count = dma->writer_sw_count + dma->buffers_available_read;
-    } else {
-        dma->buffers_available_read = 0;
+        if (!dma->writer_enabled)
+            return -1;
     }
-    
-    if (dma->hw_counts->hwReaderCountTotal > dma->reader_sw_count) {
-        /* count available buffers */
-        dma->buffers_available_write = DMA_BUFFER_COUNT / 2 + (dma->hw_counts->hwReaderCountTotal - dma->reader_sw_count);
-        dma->usr_write_buf_offset = dma->reader_sw_count % DMA_BUFFER_COUNT;
-        dma->reader_sw_count = dma->reader_sw_count + dma->buffers_available_write;
-    } else {
-        dma->buffers_available_write = 0;
+    if (dma->use_reader) {
+        litepcie_dma_reader(dma, 1);
+        if (!dma->reader_enabled) {
+            litepcie_dma_writer(dma, 0);
+            return -1;
+        }
     }
+    return 0;
+}
+
+void litepcie_dma_stop(struct litepcie_dma_ctrl *dma)
+{
+    if (dma->use_reader)
+        litepcie_dma_reader(dma, 0);
+    if (dma->use_writer)
+        litepcie_dma_writer(dma, 0);
+}
+
+/* shared page only, no call into the driver */
+void litepcie_dma_process(struct litepcie_dma_ctrl *dma)
+{
+    litepcie_dma_sync_read(dma);
+    litepcie_dma_sync_write(dma);
+}
+
+/*
+ * Hand out the next run of up to max slots, contiguous in the ring. slot is
+ * the countTotal number of the first one, run how many were taken.
+ */
+static uint8_t *litepcie_dma_take_read(struct litepcie_dma_ctrl *dma, uint64_t max, uint64_t *slot, uint64_t *run)
+{
+    uint32_t count = dma->writer_geometry.buffer_count;
+    uint8_t *ret;
+    uint64_t n;
+
+    if (!dma->buffers_available_read || !max)
+        return NULL;
+
+    n = count - dma->usr_read_buf_offset;
+    if (n > dma->buffers_available_read)
+        n = dma->buffers_available_read;
+    if (n > max)
+        n = max;
+
+    *slot = dma->writer_sw_count - dma->buffers_available_read;
+    *run = n;
+    dma->buffers_available_read -= n;
+    ret = dma->buf_rd + dma->usr_read_buf_offset * dma->writer_geometry.buffer_size;
+    dma->usr_read_buf_offset = (dma->usr_read_buf_offset + n) % count;
+    return ret;
+}
+
+static uint8_t *litepcie_dma_take_write(struct litepcie_dma_ctrl *dma, uint64_t max, uint64_t *slot, uint64_t *run)
+{
+    uint32_t count = dma->reader_geometry.buffer_count;
+    uint8_t *ret;
+    uint64_t n;
+
+    if (!dma->buffers_available_write || !max)
+        return NULL;
+
+    n = count - dma->usr_write_buf_offset;
+    if (n > dma->buffers_available_write)
+        n = dma->buffers_available_write;
+    if (n > max)
+        n = max;
+
+    *slot = dma->reader_sw_count - dma->buffers_available_write;
+    *run = n;
+    dma->buffers_available_write -= n;
+    ret = dma->buf_wr + dma->usr_write_buf_offset * dma->reader_geometry.buffer_size;
+    dma->usr_write_buf_offset = (dma->usr_write_buf_offset + n) % count;
+    return ret;
 }
 
 char *litepcie_dma_next_read_buffer(struct litepcie_dma_ctrl *dma)
 {
-    if (dma->hw_counts->hwWriterCountTotal > dma->writer_sw_count) {
-        /* count available buffers */
-        dma->buffers_available_read = dma->hw_counts->hwWriterCountTotal - dma->writer_sw_count;
-        dma->usr_read_buf_offset = dma->writer_sw_count % DMA_BUFFER_COUNT;
-        dma->writer_sw_count = dma->writer_sw_count + dma->buffers_available_read;
+    uint64_t slot, run;
+
+    litepcie_dma_sync_read(dma);
+    return (char*)litepcie_dma_take_read(dma, 1, &slot, &run);
+}
+
+char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma)
+{
+    uint64_t slot, run;
+
+    litepcie_dma_sync_write(dma);
+    return (char*)litepcie_dma_take_write(dma, 1, &slot, &run);
+}
+
+/*
+ * Zero-copy. Held slots are [acquired - held, acquired) as far as the driver
+ * is concerned, that includes slots an overrun skipped between two held
+ * runs: the device went past them anyway. The runs themselves are kept so a
+ * release knows which slot it gives back and drops the gap after it too.
+ */
+
+static int litepcie_dma_held_full(const struct litepcie_dma_held *h)
+{
+    return h->runs == DMA_BUFFER_COUNT_MAX;
+}
+
+static void litepcie_dma_hold(DMAHostCursor *c, uint64_t *acquired, uint64_t *held, struct litepcie_dma_held *h,
+                              uint64_t slot, uint64_t run)
+{
+    uint32_t last = (h->head + h->runs - 1) % DMA_BUFFER_COUNT_MAX;
+
+    if (h->runs && h->first[last] + h->count[last] == slot) {
+        h->count[last] += run;
     } else {
-        dma->buffers_available_read = 0;
+        last = (h->head + h->runs) % DMA_BUFFER_COUNT_MAX;
+        h->first[last] = slot;
+        h->count[last] = run;
+        h->runs++;
     }
-    
-    if (!dma->buffers_available_read)
+    *acquired = slot + run;
+    *held = *acquired - h->first[h->head];
+    litepcie_dma_host_publish(c, *acquired, *held);
+}
+
+static int litepcie_dma_unhold(DMAHostCursor *c, uint64_t acquired, uint64_t *held, struct litepcie_dma_held *h,
+                               uint64_t run, uint64_t *slot)
+{
+    if (!h->runs || h->count[h->head] < run)
+        return -1;
+
+    *slot = h->first[h->head];
+    h->first[h->head] += run;
+    h->count[h->head] -= run;
+    if (!h->count[h->head]) {
+        h->head = (h->head + 1) % DMA_BUFFER_COUNT_MAX;
+        h->runs--;
+    }
+    *held = h->runs ? acquired - h->first[h->head] : 0;
+    litepcie_dma_host_publish(c, acquired, *held);
+    return 0;
+}
+
+/* back on the slot a ring later, what was read from it may be torn */
+static int litepcie_dma_read_torn(struct litepcie_dma_ctrl *dma, uint64_t slot)
+{
+    return litepcie_dma_progress_count(&dma->hw_counts->writer) >= slot + dma->writer_geometry.buffer_count;
+}
+
+/* already sent, with whatever the slot held before */
+static int litepcie_dma_write_torn(struct litepcie_dma_ctrl *dma, uint64_t slot)
+{
+    return litepcie_dma_progress_count(&dma->hw_counts->reader) > slot;
+}
+
+char *litepcie_dma_acquire_read_buffer(struct litepcie_dma_ctrl *dma)
+{
+    uint8_t *ret;
+    uint64_t slot, run;
+
+    if (!dma->zero_copy || litepcie_dma_held_full(&dma->writer_runs))
         return NULL;
-    
-    dma->buffers_available_read--;
-    uint8_t *ret = dma->buf_rd + dma->usr_read_buf_offset * DMA_BUFFER_SIZE;
-    dma->usr_read_buf_offset = (dma->usr_read_buf_offset + 1) % DMA_BUFFER_COUNT;
+
+    litepcie_dma_sync_read(dma);
+    ret = litepcie_dma_take_read(dma, 1, &slot, &run);
+    if (!ret)
+        return NULL;
+
+    litepcie_dma_hold(&dma->host->writer, &dma->writer_acquired, &dma->writer_held, &dma->writer_runs, slot, run);
     return (char*)ret;
 }
 
-char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma)
+int litepcie_dma_release_read_buffer(struct litepcie_dma_ctrl *dma)
 {
-    if (dma->hw_counts->hwReaderCountTotal > dma->reader_sw_count) {
-        /* count available buffers */
-        dma->buffers_available_write = DMA_BUFFER_COUNT / 2 + (dma->hw_counts->hwReaderCountTotal - dma->reader_sw_count);
-        dma->usr_write_buf_offset = dma->reader_sw_count % DMA_BUFFER_COUNT;
-        dma->reader_sw_count = dma->reader_sw_count + dma->buffers_available_write;
-    } else {
-        dma->buffers_available_write = 0;
-    }
-    
-    if (!dma->buffers_available_write)
+    uint64_t slot;
+
+    if (!dma->zero_copy || litepcie_dma_unhold(&dma->host->writer, dma->writer_acquired, &dma->writer_held, &dma->writer_runs, 1, &slot))
+        return -1;
+    return litepcie_dma_read_torn(dma, slot);
+}
+
+char *litepcie_dma_acquire_write_buffer(struct litepcie_dma_ctrl *dma)
+{
+    uint8_t *ret;
+    uint64_t slot, run;
+
+    if (!dma->zero_copy || litepcie_dma_held_full(&dma->reader_runs))
         return NULL;
-    
-    dma->buffers_available_write--;
-    
-    uint8_t *ret = dma->buf_wr + dma->usr_write_buf_offset * DMA_BUFFER_SIZE;
-    dma->usr_write_buf_offset = (dma->usr_write_buf_offset + 1) % DMA_BUFFER_COUNT;
+
+    litepcie_dma_sync_write(dma);
+    ret = litepcie_dma_take_write(dma, 1, &slot, &run);
+    if (!ret)
+        return NULL;
+
+    litepcie_dma_hold(&dma->host->reader, &dma->reader_acquired, &dma->reader_held, &dma->reader_runs, slot, run);
     return (char*)ret;
 }
+
+int litepcie_dma_release_write_buffer(struct litepcie_dma_ctrl *dma)
+{
+    uint64_t slot;
+
+    if (!dma->zero_copy || litepcie_dma_unhold(&dma->host->reader, dma->reader_acquired, &dma->reader_held, &dma->reader_runs, 1, &slot))
+        return -1;
+    return litepcie_dma_write_torn(dma, slot);
+}
+
+/*
+ * Spans, the batched form of the above: one counter read, then everything
+ * ready up to the ring wrap in one go. Outside zero_copy they behave like
+ * the next_*_buffer calls, nothing is held but the commit still tells if
+ * the device got there first.
+ */
+
+uint32_t litepcie_dma_acquire_read_span(struct litepcie_dma_ctrl *dma, struct litepcie_dma_span *span, uint32_t max_buffers)
+{
+    uint64_t run = 0;
+
+    span->data = NULL;
+    span->count = 0;
+    if (dma->zero_copy && litepcie_dma_held_full(&dma->writer_runs))
+        return 0;
+
+    litepcie_dma_sync_read(dma);
+    span->data = (char*)litepcie_dma_take_read(dma, max_buffers ? max_buffers : UINT64_MAX, &span->first, &run);
+    span->count = run;
+    if (span->data && dma->zero_copy)
+        litepcie_dma_hold(&dma->host->writer, &dma->writer_acquired, &dma->writer_held, &dma->writer_runs, span->first, run);
+    return span->count;
+}
+
+int litepcie_dma_commit_read_span(struct litepcie_dma_ctrl *dma, const struct litepcie_dma_span *span)
+{
+    uint64_t slot = span->first;
+
+    if (!span->count)
+        return -1;
+    if (dma->zero_copy &&
+        litepcie_dma_unhold(&dma->host->writer, dma->writer_acquired, &dma->writer_held, &dma->writer_runs, span->count, &slot))
+        return -1;
+    return litepcie_dma_read_torn(dma, slot);
+}
+
+uint32_t litepcie_dma_acquire_write_span(struct litepcie_dma_ctrl *dma, struct litepcie_dma_span *span, uint32_t max_buffers)
+{
+    uint64_t run = 0;
+
+    span->data = NULL;
+    span->count = 0;
+    if (dma->zero_copy && litepcie_dma_held_full(&dma->reader_runs))
+        return 0;
+
+    litepcie_dma_sync_write(dma);
+    span->data = (char*)litepcie_dma_take_write(dma, max_buffers ? max_buffers : UINT64_MAX, &span->first, &run);
+    span->count = run;
+    if (span->data && dma->zero_copy)
+        litepcie_dma_hold(&dma->host->reader, &dma->reader_acquired, &dma->reader_held, &dma->reader_runs, span->first, run);
+    return span->count;
+}
+
+int litepcie_dma_commit_write_span(struct litepcie_dma_ctrl *dma, const struct litepcie_dma_span *span)
+{
+    uint64_t slot = span->first;
+
+    if (!span->count)
+        return -1;
+    if (dma->zero_copy &&
+        litepcie_dma_unhold(&dma->host->reader, dma->reader_acquired, &dma->reader_held, &dma->reader_runs, span->count, &slot))
+        return -1;
+    return litepcie_dma_write_torn(dma, slot);
+}
+
+/*
+ * Copy mode. Slots that are contiguous in the ring go out in one memcpy,
+ * which is already vectorized (and non-temporal for large sizes) in libc.
+ */
+
+int litepcie_dma_read(struct litepcie_dma_ctrl *dma, void *dst, uint32_t max_buffers)
+{
+    uint32_t count = dma->writer_geometry.buffer_count;
+    uint32_t size = dma->writer_geometry.buffer_size;
+    uint8_t *out = dst;
+    uint32_t done = 0;
+
+    if (dma->zero_copy)
+        return -1;
+
+    litepcie_dma_sync_read(dma);
+    while (done < max_buffers) {
+        uint64_t slot, run, hw, torn;
+        uint8_t *from = litepcie_dma_take_read(dma, max_buffers - done, &slot, &run);
+        if (!from)
+            break;
+        memcpy(out + (size_t)done * size, from, run * size);
+
+        /* the device may have come around to the oldest ones during the
+           copy, drop those like an overrun would have */
+        hw = litepcie_dma_progress_count(&dma->hw_counts->writer);
+        torn = hw >= slot + count ? hw - (slot + count) + 1 : 0;
+        if (torn > run)
+            torn = run;
+        if (torn) {
+            memmove(out + (size_t)done * size, out + (size_t)(done + torn) * size, (run - torn) * size);
+            dma->writer_overruns++;
+            dma->writer_dropped += torn;
+        }
+        done += run - torn;
+    }
+    return done;
+}
+
+int litepcie_dma_write(struct litepcie_dma_ctrl *dma, const void *src, uint32_t max_buffers)
+{
+    uint32_t size = dma->reader_geometry.buffer_size;
+    const uint8_t *in = src;
+    uint32_t done = 0;
+
+    if (dma->zero_copy)
+        return -1;
+
+    litepcie_dma_sync_write(dma);
+    while (done < max_buffers) {
+        uint64_t slot, run;
+        uint8_t *to = litepcie_dma_take_write(dma, max_buffers - done, &slot, &run);
+        if (!to)
+            break;
+        memcpy(to, in + (size_t)done * size, run * size);
+        done += run;
+    }
+    return done;
+}
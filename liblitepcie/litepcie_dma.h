@@ -14,17 +14,40 @@
 #include <stdint.h>
 #include <poll.h>
 
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOReturn.h>
-#include <IOKit/hidsystem/IOHIDShared.h>
-#include <IOKit/usb/USB.h>
-
 #include "litepcie.h"
 
+/* busy-poll budget of litepcie_dma_wait before it sleeps in the driver */
+#define LITEPCIE_DMA_WAIT_SPIN_US 20
+
+/* ring geometry of one direction, zero fields keep the driver value */
+struct litepcie_dma_geometry {
+    uint32_t buffer_size;
+    uint32_t buffer_count;
+    uint32_t buffer_per_irq;
+};
+
+/* zero-copy runs still held, oldest first. An overrun skips slots between
+ * two runs, releasing a run also lets go of the gap after it */
+struct litepcie_dma_held {
+    uint64_t first[DMA_BUFFER_COUNT_MAX];
+    uint64_t count[DMA_BUFFER_COUNT_MAX];
+    uint32_t head, runs;
+};
+
+/* contiguous run of ring buffers, first is the countTotal number of data */
+struct litepcie_dma_span {
+    char *data;
+    uint32_t count;
+    uint64_t first;
+};
+
 struct litepcie_dma_ctrl {
     uint8_t dma_channel;
-    uint32_t fd;
+    int fd;
     uint8_t use_reader, use_writer, loopback, zero_copy;
+    uint8_t reader_enabled, writer_enabled;
+    /* requested before litepcie_dma_init, the actual geometry after */
+    struct litepcie_dma_geometry reader_geometry, writer_geometry;
     uint8_t *buf_rd, *buf_wr;
     DMACounts* hw_counts;
     uint64_t reader_sw_count;
@@ -33,19 +56,85 @@ struct litepcie_dma_ctrl {
     uint64_t writer_hw_count;
     uint64_t buffers_available_read, buffers_available_write;
     uint64_t usr_read_buf_offset, usr_write_buf_offset;
+    /* ring policy, set before litepcie_dma_init: buffers kept queued
+     * ahead of the device (0 for half the ring) */
+    uint32_t reader_lead;
+    /* host side losses: rx buffers overwritten before they were read,
+     * tx buffers the device sent again because nothing new was queued */
+    uint64_t writer_overruns, writer_dropped;
+    uint64_t reader_underruns, reader_dropped;
+    /* the device sends from the moment it is enabled, what it got through
+     * before the first sync offered the host anything is not an underrun */
+    uint8_t reader_synced;
+    /* zero-copy ownership in countTotal numbering, the newest acquired slot
+     * + 1 and how many from the oldest held one on, mirrored to the driver
+     * in host */
+    DMAHost *host;
+    uint64_t reader_acquired, reader_held;
+    uint64_t writer_acquired, writer_held;
+    struct litepcie_dma_held reader_runs, writer_runs;
+    /* litepcie_dma_wait policy and how its waits ended */
+    int64_t wait_spin_us;
+    uint64_t wait_spins, wait_sleeps;
 };
 
-void litepcie_dma_set_loopback(int fd, struct litepcie_dma_ctrl* dma, uint8_t loopback_enable);
+/* -1 when csr.h does not describe dma->dma_channel */
+int litepcie_dma_set_loopback(int fd, struct litepcie_dma_ctrl* dma, uint8_t loopback_enable);
 void litepcie_dma_reader(struct litepcie_dma_ctrl *dma, uint8_t enable);
 void litepcie_dma_writer(struct litepcie_dma_ctrl *dma, uint8_t enable);
+/* gate the enabled directions without stopping them, the fast way to
+ * disarm and re-arm a stream: no table rewrite, the counts carry on */
+int litepcie_dma_pause(struct litepcie_dma_ctrl *dma, uint8_t pause);
+/* mode is a LitePCIeCoalesceMode, takes effect the next time the direction is enabled */
+int litepcie_dma_set_coalesce(struct litepcie_dma_ctrl *dma, uint8_t is_reader,
+                              uint32_t mode, uint32_t buffer_per_irq, uint32_t latency_us);
 
 //uint8_t litepcie_request_dma(int fd, uint8_t reader, uint8_t writer);
 //void litepcie_release_dma(int fd, uint8_t reader, uint8_t writer);
 //
 int litepcie_dma_init(struct litepcie_dma_ctrl *dma, const char *device_name, uint8_t zero_copy);
 void litepcie_dma_cleanup(struct litepcie_dma_ctrl *dma);
+/* enable / disable the directions in use. Start after the geometry,
+ * coalescing and first TX buffers are set up, it clears the overrun and
+ * underrun counts. -1 when the driver refused */
+int litepcie_dma_start(struct litepcie_dma_ctrl *dma);
+void litepcie_dma_stop(struct litepcie_dma_ctrl *dma);
+/* refresh the counters from the shared page, never calls into the driver */
 void litepcie_dma_process(struct litepcie_dma_ctrl *dma);
+/* block until min_buffers more buffers completed on either direction than the
+ * last litepcie_dma_process saw, 0 once they did, 1 on timeout, -ENOTSUP
+ * without a mapped counts page */
+int litepcie_dma_wait(struct litepcie_dma_ctrl *dma, uint32_t min_buffers, int64_t timeout_us);
+/* counters of the shared page, is_reader selects host -> device */
+uint64_t litepcie_dma_hw_count(struct litepcie_dma_ctrl *dma, uint8_t is_reader);
+void litepcie_dma_get_progress(struct litepcie_dma_ctrl *dma, uint8_t is_reader, DMAProgress *progress);
+/* the next ring slot, without ownership: only valid until the device comes
+ * around to it again */
 char *litepcie_dma_next_read_buffer(struct litepcie_dma_ctrl *dma);
 char *litepcie_dma_next_write_buffer(struct litepcie_dma_ctrl *dma);
+/* zero_copy: the next completed RX slot / free TX slot, owned until released.
+ * Slots are released in the order they were acquired, release returns 1 when
+ * the device got to the slot while it was held (RX data overwritten, TX
+ * buffer sent before it was filled), -1 when nothing was held. Acquire
+ * returns NULL too once DMA_BUFFER_COUNT_MAX separate runs are held */
+char *litepcie_dma_acquire_read_buffer(struct litepcie_dma_ctrl *dma);
+int litepcie_dma_release_read_buffer(struct litepcie_dma_ctrl *dma);
+char *litepcie_dma_acquire_write_buffer(struct litepcie_dma_ctrl *dma);
+int litepcie_dma_release_write_buffer(struct litepcie_dma_ctrl *dma);
+/* batched acquire: all ready buffers up to max_buffers (0 for no limit) and
+ * the ring wrap, with a single counter read. Returns span->count, 0 when
+ * nothing is ready. Held like the single buffer calls in zero_copy, commit
+ * spans in the order they were acquired, commit returns like release */
+uint32_t litepcie_dma_acquire_read_span(struct litepcie_dma_ctrl *dma, struct litepcie_dma_span *span, uint32_t max_buffers);
+int litepcie_dma_commit_read_span(struct litepcie_dma_ctrl *dma, const struct litepcie_dma_span *span);
+uint32_t litepcie_dma_acquire_write_span(struct litepcie_dma_ctrl *dma, struct litepcie_dma_span *span, uint32_t max_buffers);
+int litepcie_dma_commit_write_span(struct litepcie_dma_ctrl *dma, const struct litepcie_dma_span *span);
+/* copy mode (no zero_copy): copy up to max_buffers completed RX buffers into
+ * dst / queue up to max_buffers TX buffers from src, the ring slots are free
+ * again on return. RX buffers the device overwrote while they were copied are
+ * left out and counted as overrun. Returns how many buffers were moved, -1 in
+ * zero_copy */
+int litepcie_dma_read(struct litepcie_dma_ctrl *dma, void *dst, uint32_t max_buffers);
+int litepcie_dma_write(struct litepcie_dma_ctrl *dma, const void *src, uint32_t max_buffers);
 
 #endif /* LITEPCIE_LIB_DMA_H */
@@ -9,9 +9,12 @@
  */
 
 #include <sys/ioctl.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include "litepcie_backend.h"
 #include "litepcie_flash.h"
 #include "litepcie_helpers.h"
 #include "litepcie.h"
@@ -22,22 +25,15 @@
 #define FLASH_RETRIES 16
 
 
-void _litepcie_flash_call(int fd, LitePCIeFlashCallData* m)
+int _litepcie_flash_call(int fd, LitePCIeFlashCallData* m)
 {
-    
-    kern_return_t ret = kIOReturnSuccess;
-    
-    size_t olen = sizeof(LitePCIeFlashCallData);
-    LitePCIeFlashCallData output;
-    
-    ret = IOConnectCallStructMethod(fd, LITEPCIE_FLASH, m, sizeof(LitePCIeFlashCallData), &output, &olen);
-    
-    if (ret != kIOReturnSuccess) {
-        printf("LITEPCIE_FLASH failed with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev || dev->ops->flash(dev, m) != 0) {
+        printf("LITEPCIE_FLASH failed\n");
+        return -1;
     }
-    
-    m->rx_data = output.rx_data;
+    return 0;
 }
 
 static void flash_spi_cs(int fd, uint8_t cs_n)
@@ -82,9 +78,12 @@ static __attribute__((unused)) void flash_write_status(int fd, uint8_t value)
     flash_spi(fd, 16, FLASH_WRSR, value << 24);
 }
 
-static __attribute__((unused)) void flash_erase_sector(int fd, uint32_t addr)
+static void flash_erase_sector(int fd, uint8_t cmd, uint32_t addr)
 {
-    flash_spi(fd, 32, FLASH_SE, addr << 8);
+    if (cmd == FLASH_BE)
+        flash_spi(fd, 8, cmd, 0);
+    else
+        flash_spi(fd, 32, cmd, addr << 8);
 }
 
 static __attribute__((unused)) uint8_t flash_read_sector_lock(int fd, uint32_t addr)
@@ -102,6 +101,16 @@ static void flash_write(int fd, uint32_t addr, uint8_t byte)
     flash_spi(fd, 40, FLASH_PP, (addr << 8) | byte);
 }
 
+/* up to LITEPCIE_FLASH_PROGRAM_MAX bytes in one driver call, 0 when it ran */
+static int flash_program_pages(int fd, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev || !dev->ops->flash_program)
+        return -1;
+    return dev->ops->flash_program(dev, addr, buf, size);
+}
+
 static void flash_write_buffer(int fd, uint32_t addr, uint8_t *buf, uint16_t size)
 {
     int i;
@@ -136,41 +145,92 @@ uint8_t litepcie_flash_read(int fd, uint32_t addr)
     return flash_spi(fd, 40, FLASH_READ, addr << 8) & 0xff;
 }
 
-static void litepcie_flash_read_buffer(int fd, uint32_t addr, uint8_t *buf, uint16_t size)
+/* FLASH_FAST_READ or FLASH_RDSFDP: command, address and the dummy byte in one
+ * 40 bit transfer, then LITEPCIE_FLASH_SPI_MAX_BYTES per transfer. 0 on
+ * success, -1 when a transfer failed */
+static int flash_read_dummy(int fd, uint8_t cmd, uint32_t addr, uint8_t *buf, uint32_t size)
 {
-    int i;
-
     LitePCIeFlashCallData m;
+    uint32_t i, n;
+    int ret;
 
-    if (size == 1) {
-        buf[0] = litepcie_flash_read(fd, addr);
-
-    } else {
-        /* set cs_n */
-        flash_spi_cs(fd, 0);
+    flash_spi_cs(fd, 0);
+    m.tx_len = 40;
+    m.tx_data = litepcie_flash_spi_cmd(cmd, addr);
+    ret = _litepcie_flash_call(fd, &m);
+    for (i = 0; ret == 0 && i < size; i += n) {
+        n = size - i < LITEPCIE_FLASH_SPI_MAX_BYTES ? size - i : LITEPCIE_FLASH_SPI_MAX_BYTES;
+        m.tx_len = n * 8;
+        m.tx_data = 0;
+        ret = _litepcie_flash_call(fd, &m);
+        if (ret == 0)
+            litepcie_flash_spi_unpack(m.rx_data, buf + i, n);
+    }
+    flash_spi_cs(fd, 1);
+    return ret;
+}
 
-        /* send cmd */
-        m.tx_len = 32;
-        m.tx_data = ((uint64_t)FLASH_READ << 32) | ((uint64_t)addr << 8);
-        _litepcie_flash_call(fd, &m);
+int litepcie_flash_read_buffer(int fd, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+    struct litepcie_device *dev = litepcie_get_device(fd);
+    uint32_t i;
+
+    /* in-driver reads, falling back to a transfer per 5 bytes on older drivers */
+    for (i = 0; dev && dev->ops->flash_read && i < size;) {
+        uint32_t chunk = size - i < LITEPCIE_FLASH_READ_MAX ? size - i : LITEPCIE_FLASH_READ_MAX;
+        if (dev->ops->flash_read(dev, addr + i, buf + i, chunk) != 0)
+            break;
+        i += chunk;
+    }
+    if (i == size)
+        return 0;
 
-        /* read bytes */
-        for (i=0; i<size; i++) {
-            m.tx_len = 8;
-            _litepcie_flash_call(fd, &m);
-            buf[i] = m.rx_data;
-        }
+    return flash_read_dummy(fd, FLASH_FAST_READ, addr + i, buf + i, size - i);
+}
 
-        /* release cs_n */
-        flash_spi_cs(fd, 1);
+/* summed by the driver, -1 when it can't */
+static int flash_crc_driver(int fd, uint32_t addr, uint32_t size, uint32_t *crc)
+{
+    struct litepcie_device *dev = litepcie_get_device(fd);
+    uint32_t i, n;
+
+    if (!dev || !dev->ops->flash_crc)
+        return -1;
+    *crc = 0;
+    for (i = 0; i < size; i += n) {
+        n = size - i < LITEPCIE_FLASH_READ_MAX ? size - i : LITEPCIE_FLASH_READ_MAX;
+        if (dev->ops->flash_crc(dev, addr + i, n, crc) != 0)
+            return -1;
     }
+    return 0;
 }
 
-int litepcie_flash_get_erase_block_size(int fd)
+int litepcie_flash_crc32(int fd, uint32_t addr, uint32_t size, uint32_t *crc)
 {
-    return FLASH_SECTOR_SIZE;
+    uint8_t *sector;
+    uint32_t i, n;
+
+    if (flash_crc_driver(fd, addr, size, crc) == 0)
+        return 0;
+
+    /* read back and sum here */
+    sector = malloc(FLASH_SECTOR_SIZE);
+    if (!sector)
+        return 1;
+    *crc = 0;
+    for (i = 0; i < size; i += n) {
+        n = size - i < FLASH_SECTOR_SIZE ? size - i : FLASH_SECTOR_SIZE;
+        if (litepcie_flash_read_buffer(fd, addr + i, sector, n) != 0) {
+            free(sector);
+            return -1;
+        }
+        *crc = litepcie_crc32(*crc, sector, n);
+    }
+    free(sector);
+    return 0;
 }
 
+
 static int litepcie_flash_get_flash_program_size(int fd)
 {
     int software_cs = 1;
@@ -185,19 +245,324 @@ static int litepcie_flash_get_flash_program_size(int fd)
         return 1;
 }
 
+static uint32_t flash_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void flash_add_erase_type(struct litepcie_flash_info *info, uint32_t size, uint8_t cmd)
+{
+    uint32_t i;
+
+    /* only what the driver runs, 3 byte addressing */
+    if (info->erase_count == LITEPCIE_FLASH_ERASE_TYPES || cmd == FLASH_BE || !litepcie_flash_erase_size(cmd) ||
+        size == 0 || (size & (size - 1)) != 0)
+        return;
+    for (i = info->erase_count; i > 0 && info->erase[i - 1].size > size; i--)
+        info->erase[i] = info->erase[i - 1];
+    info->erase[i].size = size;
+    info->erase[i].cmd = cmd;
+    info->erase_count += 1;
+}
+
+/* JESD216 Basic Flash Parameter Table, 0 when the part has none */
+static int flash_probe_sfdp(int fd, struct litepcie_flash_info *info)
+{
+    uint8_t header[16];
+    uint8_t bfpt[9 * 4];
+    uint32_t density, erase;
+
+    if (flash_read_dummy(fd, FLASH_RDSFDP, 0, header, sizeof(header)) != 0)
+        return 0;
+    if (memcmp(header, "SFDP", 4) != 0)
+        return 0;
+    /* first parameter header is the BFPT, ID 0xFF00, at least 9 DWORDs */
+    if (header[8] != 0x00 || header[15] != 0xff || header[11] < 9)
+        return 0;
+    if (flash_read_dummy(fd, FLASH_RDSFDP, header[12] | (header[13] << 8) | (header[14] << 16), bfpt,
+                         sizeof(bfpt)) != 0)
+        return 0;
+
+    /* DWORD 2, size in bits */
+    density = flash_le32(bfpt + 4);
+    if (density & 0x80000000)
+        info->size = (density & 0x7fffffff) >= 3 && (density & 0x7fffffff) < 35 ? 1u << ((density & 0x7fffffff) - 3) : 0;
+    else
+        info->size = (density + 1) / 8;
+
+    /* DWORDs 8 and 9, four (size exponent, opcode) pairs */
+    for (int i = 0; i < LITEPCIE_FLASH_ERASE_TYPES; i++) {
+        erase = flash_le32(bfpt + (i < 2 ? 7 : 8) * 4) >> ((i & 1) * 16);
+        if ((erase & 0xff) != 0 && (erase & 0xff) < 32)
+            flash_add_erase_type(info, 1u << (erase & 0xff), (erase >> 8) & 0xff);
+    }
+    info->sfdp = info->erase_count != 0;
+    return info->sfdp;
+}
+
+static void flash_probe(int fd, struct litepcie_flash_info *info)
+{
+    memset(info, 0, sizeof(*info));
+
+    info->jedec_id = flash_read_id(fd, FLASH_READ_ID_REG);
+
+    /* SFDP needs the chip select held across transfers */
+    if (litepcie_flash_get_flash_program_size(fd) > 1 && flash_probe_sfdp(fd, info))
+        return;
+
+    /* capacity byte is log2 of the size for the usual vendors */
+    if ((info->jedec_id & 0xff) >= 16 && (info->jedec_id & 0xff) < 32)
+        info->size = 1u << (info->jedec_id & 0xff);
+    switch (info->jedec_id >> 16) {
+    case 0xef: /* Winbond */
+    case 0xc2: /* Macronix */
+    case 0xc8: /* GigaDevice */
+    case 0x9d: /* ISSI */
+        flash_add_erase_type(info, 32 << 10, FLASH_SE_32K);
+        /* fall through */
+    case 0x20: /* Micron, 4 KB subsectors but no 32 KB erase */
+        flash_add_erase_type(info, 4 << 10, FLASH_SE_4K);
+        break;
+    }
+    flash_add_erase_type(info, FLASH_SECTOR_SIZE, FLASH_SE);
+}
+
+void litepcie_flash_probe(int fd, struct litepcie_flash_info *info)
+{
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    /* the part does not change under an open fd, the SPI traffic is paid once */
+    if (dev && dev->flash_info) {
+        *info = *dev->flash_info;
+        return;
+    }
+    flash_probe(fd, info);
+    if (dev && (dev->flash_info = malloc(sizeof(*info))))
+        *dev->flash_info = *info;
+}
+
+int litepcie_flash_plan_erase(const struct litepcie_flash_info *info, uint32_t base, uint32_t size,
+                              struct litepcie_flash_erase_op *ops, uint32_t max_ops)
+{
+    uint32_t count = 0;
+    uint32_t addr = base;
+    uint32_t end = base + size;
+    uint32_t unit = info->erase[0].size;
+    int i;
+
+    /* an erase never reaches past the range */
+    if (info->erase_count == 0 || base % unit != 0 || size % unit != 0 || end < base)
+        return -EINVAL;
+    /* nor past the end of the part, when its size is known */
+    if (info->size != 0 && (base > info->size || size > info->size - base))
+        return -EINVAL;
+
+    if (info->size != 0 && base == 0 && size == info->size) {
+        if (max_ops > 0) {
+            ops[0].addr = 0;
+            ops[0].size = info->size;
+            ops[0].cmd = FLASH_BE;
+        }
+        return 1;
+    }
+
+    while (addr < end) {
+        for (i = info->erase_count - 1; i > 0; i--) {
+            if ((addr & (info->erase[i].size - 1)) == 0 && end - addr >= info->erase[i].size)
+                break;
+        }
+        /* the smallest erase is what is left, it has to line up as well */
+        if ((addr & (info->erase[i].size - 1)) != 0 || end - addr < info->erase[i].size)
+            return -EINVAL;
+        if (count < max_ops) {
+            ops[count].addr = addr;
+            ops[count].size = info->erase[i].size;
+            ops[count].cmd = info->erase[i].cmd;
+        }
+        count += 1;
+        addr += info->erase[i].size;
+    }
+    return count;
+}
+
+int litepcie_flash_get_erase_block_size(int fd)
+{
+    struct litepcie_flash_info info;
+
+    litepcie_flash_probe(fd, &info);
+    return info.erase[0].size;
+}
+
+/* one erase command, back once WIP cleared */
+static void flash_erase_block(int fd, const struct litepcie_flash_erase_op *op)
+{
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    /* the driver polls WIP itself */
+    if (dev && dev->ops->flash_erase && dev->ops->flash_erase(dev, op->addr, op->cmd) == 0)
+        return;
+
+    flash_write_enable(fd);
+    flash_erase_sector(fd, op->cmd, op->addr);
+    while (flash_read_status(fd) & FLASH_WIP) {
+        usleep(1000);
+    }
+}
+
+/* erase [base, base + size) as planned, returns the number of commands or
+ * -EINVAL for a range that is not made of whole blocks */
+static int flash_erase_range(int fd, const struct litepcie_flash_info *info, uint32_t base, uint32_t size,
+                             void (*progress_cb)(void *opaque, const char *fmt, ...), void *opaque)
+{
+    struct litepcie_flash_erase_op ops[64];
+    uint32_t addr = base, end = base + size;
+    uint32_t i;
+    int total = 0, count;
+
+    /* the plan is greedy from the start address on, so it can go in chunks */
+    while (addr < end) {
+        count = litepcie_flash_plan_erase(info, addr, end - addr, ops, 64);
+        if (count < 0)
+            return count;
+        if (count > 64)
+            count = 64;
+        for (i = 0; i < count; i++) {
+            if (progress_cb) {
+                progress_cb(opaque, "Erasing @%08x\r", ops[i].addr);
+            }
+            flash_erase_block(fd, &ops[i]);
+        }
+        total += count;
+        addr = ops[count - 1].addr + ops[count - 1].size;
+    }
+    return total;
+}
+
+/*
+ * Program in driver calls of several pages, each page staged while the one
+ * before it programs, then verify all of it with a single driver CRC (or a
+ * single read without one) and go again over the pages that did not take.
+ * 0 on success, -1 when the driver can't.
+ */
+static int flash_program_pipelined(int fd, uint8_t *buf, uint32_t base, uint32_t size)
+{
+    uint32_t pages = size / LITEPCIE_FLASH_PAGE_SIZE;
+    uint8_t *cmp_buf, *pending;
+    uint32_t i, n, crc;
+    int retries, ret = 1;
+
+    cmp_buf = malloc(size);
+    pending = malloc(pages);
+    if (!cmp_buf || !pending) {
+        free(cmp_buf);
+        free(pending);
+        return -1;
+    }
+    memset(pending, 1, pages);
+
+    for (retries = 0; retries <= FLASH_RETRIES; retries++) {
+        /* runs of pending pages, LITEPCIE_FLASH_PROGRAM_MAX at a time */
+        for (i = 0; i < pages; i += n) {
+            for (n = 0; i + n < pages && pending[i + n] &&
+                 (n + 1) * LITEPCIE_FLASH_PAGE_SIZE <= LITEPCIE_FLASH_PROGRAM_MAX; n++)
+                ;
+            if (n == 0) {
+                n = 1;
+                continue;
+            }
+            if (flash_program_pages(fd, base + i * LITEPCIE_FLASH_PAGE_SIZE,
+                                    buf + i * LITEPCIE_FLASH_PAGE_SIZE, n * LITEPCIE_FLASH_PAGE_SIZE) != 0) {
+                ret = retries == 0 && i == 0 ? -1 : 1;
+                goto end;
+            }
+        }
+
+        /* verify, both wait for the last page. The data only comes back to
+           find the pages to redo */
+        if (flash_crc_driver(fd, base, size, &crc) == 0 && crc == litepcie_crc32(0, buf, size)) {
+            ret = 0;
+            goto end;
+        }
+        if (litepcie_flash_read_buffer(fd, base, cmp_buf, size) != 0)
+            goto end;
+        for (i = 0, n = 0; i < pages; i++) {
+            pending[i] = memcmp(buf + i * LITEPCIE_FLASH_PAGE_SIZE, cmp_buf + i * LITEPCIE_FLASH_PAGE_SIZE,
+                                LITEPCIE_FLASH_PAGE_SIZE) != 0;
+            n += pending[i];
+        }
+        if (n == 0) {
+            ret = 0;
+            goto end;
+        }
+    }
+    printf("Not able to write page\n");
+
+end:
+    free(cmp_buf);
+    free(pending);
+    return ret;
+}
+
+/* program size bytes (a multiple of the program size) and verify them, 0 on success */
+static int flash_program_verify(int fd, uint8_t *buf, uint32_t base, uint32_t size, uint16_t flash_program_size)
+{
+    uint8_t cmp_buf[256];
+    uint32_t i = 0;
+    int retries = 0;
+
+    if (flash_program_size > 1 && size % LITEPCIE_FLASH_PAGE_SIZE == 0) {
+        int ret = flash_program_pipelined(fd, buf, base, size);
+        if (ret >= 0)
+            return ret;
+    }
+
+    while (i < size) {
+        /* wait flash to be ready */
+        while (flash_read_status(fd) & FLASH_WIP)
+            usleep(100);
+
+        /* write flash page */
+        flash_write_enable(fd);
+        flash_write_buffer(fd, base + i, buf + i, flash_program_size);
+        flash_write_disable(fd);
+
+        /* wait flash to be ready*/
+        while (flash_read_status(fd) & FLASH_WIP)
+            usleep(100);
+
+        /* verify flash page */
+        if (litepcie_flash_read_buffer(fd, base + i, cmp_buf, flash_program_size) != 0)
+            return 1;
+        if (memcmp(buf + i, cmp_buf, flash_program_size) != 0) {
+            retries += 1;
+        } else {
+            i += flash_program_size;
+            retries = 0;
+        }
+
+        if (retries > FLASH_RETRIES) {
+            printf("Not able to write page\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 int litepcie_flash_write(int fd,
                      uint8_t *buf, uint32_t base, uint32_t size,
                      void (*progress_cb)(void *opaque, const char *fmt, ...),
                      void *opaque)
 {
     int i;
-    int retries;
     uint16_t flash_program_size;
+    struct litepcie_flash_info info;
 
     flash_program_size = litepcie_flash_get_flash_program_size(fd);
     printf("flash_program_size: %d\n", flash_program_size);
 
-    uint8_t cmp_buf[256];
+    /* erase sizes of the part */
+    litepcie_flash_probe(fd, &info);
 
     /* dummy command because in some case the first erase does not
        work. */
@@ -207,16 +572,10 @@ int litepcie_flash_write(int fd,
      flash_write_enable(fd);
 
 #ifndef FLASH_FULL_ERASE
-    /* erase */
-    for(i = 0; i < size; i += FLASH_SECTOR_SIZE) {
-        if (progress_cb) {
-            progress_cb(opaque, "Erasing @%08x\r", base + i);
-        }
-        flash_write_enable(fd);
-        flash_erase_sector(fd, base + i);
-        while (flash_read_status(fd) & FLASH_WIP) {
-            usleep(1000);
-        }
+    /* erase, fewest commands that cover the range */
+    if (flash_erase_range(fd, &info, base, size, progress_cb, opaque) < 0) {
+        flash_write_disable(fd);
+        return -EINVAL;
     }
     if (progress_cb) {
         progress_cb(opaque, "\n");
@@ -232,46 +591,154 @@ int litepcie_flash_write(int fd,
 #endif
     flash_write_disable(fd);
 
-    i = 0;
-    retries = 0;
-    while (i < size) {
-        if (progress_cb && (i % FLASH_SECTOR_SIZE) == 0) {
+    for (i = 0; i < size; i += FLASH_SECTOR_SIZE) {
+        uint32_t n = size - i < FLASH_SECTOR_SIZE ? size - i : FLASH_SECTOR_SIZE;
+        if (progress_cb) {
             progress_cb(opaque, "Writing @%08x\r", base + i);
         }
+        if (flash_program_verify(fd, buf + i, base + i, n, flash_program_size) != 0)
+            return 1;
+    }
 
-        /* wait flash to be ready */
-        while (flash_read_status(fd) & FLASH_WIP)
-            usleep(100);
+    if (progress_cb) {
+        progress_cb(opaque, "\n");
+    }
 
-        /* write flash page */
-        flash_write_enable(fd);
-        flash_write_buffer(fd, base + i, buf + i, flash_program_size);
-        flash_write_disable(fd);
+    return 0;
+}
 
-        /* wait flash to be ready*/
-        while (flash_read_status(fd) & FLASH_WIP)
-            usleep(100);
+/* bits a program can't set back to 1 without an erase first */
+static int flash_needs_erase(const uint8_t *old, const uint8_t *new, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        if ((old[i] & new[i]) != new[i])
+            return 1;
+    }
+    return 0;
+}
 
-        /* verify flash page */
-        litepcie_flash_read_buffer(fd, base + i, cmp_buf, flash_program_size);
-        if (memcmp(buf + i, cmp_buf, flash_program_size) != 0) {
-            retries += 1;
-        } else {
-            i += flash_program_size;
-            retries = 0;
+static int flash_is_erased(const uint8_t *buf, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        if (buf[i] != 0xff)
+            return 0;
+    }
+    return 1;
+}
+
+int litepcie_flash_update(int fd,
+                          uint8_t *buf, uint32_t base, uint32_t size,
+                          struct litepcie_flash_update_stats *stats,
+                          void (*progress_cb)(void *opaque, const char *fmt, ...),
+                          void *opaque)
+{
+    struct litepcie_flash_info info;
+    uint8_t *old, *cur, *erase;
+    uint32_t i, j, k, n, span, unit, chunk, units;
+    uint16_t flash_program_size;
+    int ret = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    flash_program_size = litepcie_flash_get_flash_program_size(fd);
+    litepcie_flash_probe(fd, &info);
+
+    /* dummy command because in some case the first erase does not
+       work. */
+    flash_read_id(fd, 0);
+
+    /* decisions per smallest erase block, read back a sector at a time */
+    unit = info.erase[0].size;
+    if (base % unit != 0 || (info.size != 0 && (base > info.size || size > info.size - base)))
+        return -EINVAL;
+    chunk = unit > FLASH_SECTOR_SIZE ? unit : FLASH_SECTOR_SIZE;
+    old = malloc(chunk);
+    cur = malloc(chunk);
+    erase = malloc(chunk / unit);
+    if (!old || !cur || !erase) {
+        free(old);
+        free(cur);
+        free(erase);
+        return 1;
+    }
+
+    for (i = 0; i < size; i += n) {
+        n = size - i < chunk ? size - i : chunk;
+        /* a size that ends inside a block: the rest of it has to survive an erase */
+        units = (n + unit - 1) / unit;
+        span = units * unit;
+
+        if (progress_cb) {
+            progress_cb(opaque, "Checking @%08x\r", base + i);
         }
 
-        if (retries > FLASH_RETRIES) {
-            printf("Not able to write page\n");
-            return 1;
+        /* what is there already, a single in-driver read per chunk, and what
+           it should become, the old tail past size included */
+        if (litepcie_flash_read_buffer(fd, base + i, old, span) != 0) {
+            ret = -1;
+            goto end;
+        }
+        memcpy(cur, buf + i, n);
+        memcpy(cur + n, old + n, span - n);
+        for (j = 0; j < units; j++) {
+            stats->blocks += 1;
+            if (memcmp(old + j * unit, cur + j * unit, unit) == 0) {
+                stats->unchanged += 1;
+                erase[j] = 0;
+                continue;
+            }
+            /* only clearing bits, program over the old contents */
+            erase[j] = flash_needs_erase(old + j * unit, cur + j * unit, unit);
+            stats->erased += erase[j];
+        }
+
+        /* runs of blocks to erase, merged into bigger erases where they line up */
+        for (j = 0; j < units; j = k) {
+            for (k = j; k < units && erase[k]; k++)
+                ;
+            if (k > j) {
+                int ops = flash_erase_range(fd, &info, base + i + j * unit, (k - j) * unit, progress_cb, opaque);
+                if (ops < 0) {
+                    ret = ops;
+                    goto end;
+                }
+                stats->erase_ops += ops;
+            } else {
+                k = j + 1;
+            }
+        }
+
+        if (progress_cb) {
+            progress_cb(opaque, "Writing @%08x\r", base + i);
+        }
+        /* runs of pages that changed, erased pages that stay blank are left */
+        for (j = 0; j < span; j = k) {
+            for (k = j; k < span; k += LITEPCIE_FLASH_PAGE_SIZE) {
+                const uint8_t *new = cur + k;
+                if (erase[k / unit] ? flash_is_erased(new, LITEPCIE_FLASH_PAGE_SIZE)
+                                    : memcmp(old + k, new, LITEPCIE_FLASH_PAGE_SIZE) == 0)
+                    break;
+            }
+            if (k == j) {
+                k = j + LITEPCIE_FLASH_PAGE_SIZE;
+                continue;
+            }
+            if (flash_program_verify(fd, cur + j, base + i + j, k - j, flash_program_size) != 0) {
+                ret = 1;
+                goto end;
+            }
+            stats->pages += (k - j) / LITEPCIE_FLASH_PAGE_SIZE;
         }
     }
 
+end:
+    flash_write_disable(fd);
     if (progress_cb) {
         progress_cb(opaque, "\n");
     }
-
-    return 0;
+    free(old);
+    free(cur);
+    free(erase);
+    return ret;
 }
 
 #endif
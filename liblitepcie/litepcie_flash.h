@@ -13,31 +13,80 @@
 
 #include <stdint.h>
 
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOReturn.h>
 #include "litepcie_ext.h"
+#include "litepcie_flash_spi.h"
 
-#define FLASH_READ_ID_REG 0x9F
+int _litepcie_flash_call(int fd, LitePCIeFlashCallData* m);
+uint8_t litepcie_flash_read(int fd, uint32_t addr);
+/* size bytes from addr on, in large in-driver reads when the driver has them,
+ * 0 on success */
+int litepcie_flash_read_buffer(int fd, uint32_t addr, uint8_t *buf, uint32_t size);
+/* CRC-32 (litepcie_crc32) of size bytes from addr on, summed in the driver
+ * when it can so the data never comes back, 0 on success */
+int litepcie_flash_crc32(int fd, uint32_t addr, uint32_t size, uint32_t *crc);
+#define LITEPCIE_FLASH_ERASE_TYPES 4
 
-#define FLASH_READ    0x03
-#define FLASH_WREN    0x06
-#define FLASH_WRDI    0x04
-#define FLASH_PP      0x02
-#define FLASH_SE      0xD8
-#define FLASH_BE      0xC7
-#define FLASH_RDSR    0x05
-#define FLASH_WRSR    0x01
-/* status */
-#define FLASH_WIP     0x01
+struct litepcie_flash_erase_type {
+    uint32_t size; /* bytes, a power of two */
+    uint8_t cmd;
+};
 
-#define FLASH_SECTOR_SIZE (1 << 16)
+/* what litepcie_flash_probe found out about the part */
+struct litepcie_flash_info {
+    uint32_t jedec_id; /* manufacturer, memory type, capacity */
+    uint32_t size; /* bytes, 0 when unknown */
+    uint8_t sfdp; /* erase types and size came from the SFDP tables */
+    uint32_t erase_count;
+    struct litepcie_flash_erase_type erase[LITEPCIE_FLASH_ERASE_TYPES]; /* smallest first */
+};
 
-void _litepcie_flash_call(int fd, LitePCIeFlashCallData* m);
-uint8_t litepcie_flash_read(int fd, uint32_t addr);
+/* one erase command of a plan, size is the block it clears */
+struct litepcie_flash_erase_op {
+    uint32_t addr;
+    uint32_t size;
+    uint8_t cmd;
+};
+
+/* erase types from SFDP, the JEDEC ID when there is none, 64 KB sectors
+ * when the part is not known either. Probed once per open fd, later calls
+ * return the cached result */
+void litepcie_flash_probe(int fd, struct litepcie_flash_info *info);
+/* cover [base, base + size) with the fewest erases, biggest blocks that are
+ * aligned and fit first, chip erase when the range is the whole part. base
+ * and size must be multiples of the smallest erase size and stay inside the
+ * part when its size is known, -EINVAL otherwise.
+ * Returns the number of ops, which may be more than max_ops (only max_ops
+ * are written) */
+int litepcie_flash_plan_erase(const struct litepcie_flash_info *info, uint32_t base, uint32_t size,
+                              struct litepcie_flash_erase_op *ops, uint32_t max_ops);
+/* smallest erase size of the part, what writes have to be padded to */
 int litepcie_flash_get_erase_block_size(int fd);
+/* base and size must be multiples of the smallest erase size and stay inside
+ * the part, -EINVAL otherwise. 0 on success */
 int litepcie_flash_write(int fd,
                          uint8_t *buf, uint32_t base, uint32_t size,
                          void (*progress_cb)(void *opaque, const char *fmt, ...),
                          void *opaque);
 
+/* what litepcie_flash_update did, blocks are of the smallest erase size */
+struct litepcie_flash_update_stats {
+    uint32_t blocks;
+    uint32_t unchanged; /* already held the new data, left alone */
+    uint32_t erased; /* the rest could be programmed over without an erase */
+    uint32_t erase_ops; /* erase commands the erased blocks took */
+    uint32_t pages;
+};
+
+/* like litepcie_flash_write but reads each sector back first and only erases
+ * and programs what differs. base must be a multiple of the smallest erase
+ * size and the range inside the part (-EINVAL otherwise), a size that ends
+ * inside a block keeps the rest of the block as it was. 0 on success, -1
+ * when a sector could not be read back, nothing from that sector on is
+ * erased or programmed */
+int litepcie_flash_update(int fd,
+                          uint8_t *buf, uint32_t base, uint32_t size,
+                          struct litepcie_flash_update_stats *stats,
+                          void (*progress_cb)(void *opaque, const char *fmt, ...),
+                          void *opaque);
+
 #endif //LITEPCIE_LIB_FLASH_H
@@ -8,18 +8,24 @@
  *
  */
 
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOReturn.h>
-
 #include <time.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include "litepcie_helpers.h"
+#include "litepcie_backend.h"
 #include "litepcie.h"
 
+static const struct litepcie_backend_ops *backends[] = {
+    &litepcie_backend_sim,
+#ifdef __APPLE__
+    &litepcie_backend_iokit,
+#endif
+};
+
+static struct litepcie_device devices[LITEPCIE_MAX_DEVICES];
+
 int64_t get_time_ms(void)
 {
     struct timespec ts;
@@ -27,102 +33,201 @@ int64_t get_time_ms(void)
     return (int64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000U);
 }
 
+struct litepcie_device *litepcie_get_device(int fd)
+{
+    if (fd < 0 || fd >= LITEPCIE_MAX_DEVICES || devices[fd].ops == NULL)
+        return NULL;
+    return &devices[fd];
+}
+
+int litepcie_csr_batch_generic(struct litepcie_device *dev, struct litepcie_csr_op *ops, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        struct litepcie_csr_op *op = &ops[i];
+        int64_t deadline;
+
+        switch (op->type) {
+        case LITEPCIE_CSR_OP_READ:
+            op->value = dev->ops->readl(dev, op->addr);
+            break;
+        case LITEPCIE_CSR_OP_WRITE:
+            dev->ops->writel(dev, op->addr, op->value);
+            break;
+        case LITEPCIE_CSR_OP_RMW:
+            op->value = (dev->ops->readl(dev, op->addr) & ~op->mask) | (op->value & op->mask);
+            dev->ops->writel(dev, op->addr, op->value);
+            break;
+        case LITEPCIE_CSR_OP_POLL:
+            deadline = get_time_ms() + (LITEPCIE_CSR_POLL_TIMEOUT_US + 999) / 1000;
+            for (;;) {
+                uint32_t val = dev->ops->readl(dev, op->addr);
+                if ((val & op->mask) == (op->value & op->mask)) {
+                    op->value = val;
+                    break;
+                }
+                if (get_time_ms() > deadline) {
+                    op->value = val;
+                    return 1;
+                }
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
 uint32_t litepcie_readl(int fd, uint32_t addr) {
-    kern_return_t ret = kIOReturnSuccess;
-
-    uint32_t olen = 1;
-    uint64_t output = 0;
-    uint64_t input = addr;
-    
-    ret = IOConnectCallScalarMethod(fd, LITEPCIE_READ_CSR, &input, 1, &output, &olen);
-    
-    if (ret != kIOReturnSuccess) {
-        printf("LITEPCIE_READ_CSR failed with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev) {
+        printf("litepcie_readl: invalid device %d.\n", fd);
+        return 0;
     }
-    
-    return (uint32_t)output;
+
+    return dev->ops->readl(dev, addr);
 }
 
 void litepcie_writel(int fd, uint32_t addr, uint32_t val) {
-    kern_return_t ret = kIOReturnSuccess;
-
-    uint32_t olen = 0;
-    uint64_t input[2] = { addr, val };
-    ret = IOConnectCallScalarMethod(fd, LITEPCIE_WRITE_CSR, input, 2, NULL, &olen);
-    
-    if (ret != kIOReturnSuccess) {
-        printf("LITEPCIE_WRITE_CSR failed with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev) {
+        printf("litepcie_writel: invalid device %d.\n", fd);
+        return;
     }
+
+    dev->ops->writel(dev, addr, val);
 }
 
-void litepcie_reload(int fd) {
-    kern_return_t ret = kIOReturnSuccess;
-    
-    size_t olen = 0;
-    LitePCIeICAPCallData input = { .addr = 0x0, .data = 0x0 };
-    
-    ret = IOConnectCallStructMethod(fd, LITEPCIE_ICAP, &input, sizeof(LitePCIeICAPCallData), NULL, &olen);
-    
-    if (ret != kIOReturnSuccess) {
-        printf("LITEPCIE_WRITE_CSR failed with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
-    }
+int litepcie_csr_batch(int fd, struct litepcie_csr_op *ops, uint32_t count) {
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev)
+        return -1;
+
+    return dev->ops->csr_batch(dev, ops, count);
 }
 
-int litepcie_open(const char* name, int flags) {
-    static const char* dextIdentifier = "litepcie";
-
-    kern_return_t ret = kIOReturnSuccess;
-    io_iterator_t iterator = IO_OBJECT_NULL;
-    io_service_t service = IO_OBJECT_NULL;
-    static io_connect_t connection = IO_OBJECT_NULL;
-    
-    if (connection != IO_OBJECT_NULL) {
-        printf("already opened service\n");
-        return connection;
-    }
+int litepcie_get_stats(int fd, LitePCIeStats *stats) {
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev)
+        return -1;
+
+    return dev->ops->stats(dev, stats);
+}
+
+int litepcie_get_dma_stats(int fd, uint8_t channel, DMACounts *counts) {
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev)
+        return -1;
+
+    return dev->ops->dma_stats(dev, channel, counts);
+}
 
-    /// - Tag: ClientApp_Connect
-    ret = IOServiceGetMatchingServices(kIOMainPortDefault, IOServiceNameMatching(dextIdentifier), &iterator);
-    if (ret != kIOReturnSuccess) {
-        printf("Unable to find service for identifier with error: 0x%08x.\n", ret);
-        _print_kerr_details(ret);
+void litepcie_csr_batch_init(struct litepcie_csr_batch *batch) {
+    batch->ops = NULL;
+    batch->count = 0;
+    batch->size = 0;
+}
+
+void litepcie_csr_batch_free(struct litepcie_csr_batch *batch) {
+    free(batch->ops);
+    litepcie_csr_batch_init(batch);
+}
+
+static int litepcie_csr_batch_add(struct litepcie_csr_batch *batch, uint32_t type, uint32_t addr, uint32_t value, uint32_t mask) {
+    if (batch->count == batch->size) {
+        uint32_t size = batch->size ? batch->size * 2 : 32;
+        struct litepcie_csr_op *ops = realloc(batch->ops, size * sizeof(*ops));
+        if (!ops)
+            return -1;
+        batch->ops = ops;
+        batch->size = size;
     }
 
-    printf("Searching for dext service...\n");
-    while ((service = IOIteratorNext(iterator)) != IO_OBJECT_NULL) {
-        // Open a connection to this user client as a server to that client, and store the instance in "service"
-        ret = IOServiceOpen(service, mach_task_self_, kIOHIDServerConnectType, &connection);
+    batch->ops[batch->count].type = type;
+    batch->ops[batch->count].addr = addr;
+    batch->ops[batch->count].value = value;
+    batch->ops[batch->count].mask = mask;
+    return batch->count++;
+}
+
+int litepcie_csr_batch_read(struct litepcie_csr_batch *batch, uint32_t addr) {
+    return litepcie_csr_batch_add(batch, LITEPCIE_CSR_OP_READ, addr, 0, 0);
+}
+
+int litepcie_csr_batch_write(struct litepcie_csr_batch *batch, uint32_t addr, uint32_t value) {
+    return litepcie_csr_batch_add(batch, LITEPCIE_CSR_OP_WRITE, addr, value, 0);
+}
+
+int litepcie_csr_batch_rmw(struct litepcie_csr_batch *batch, uint32_t addr, uint32_t mask, uint32_t value) {
+    return litepcie_csr_batch_add(batch, LITEPCIE_CSR_OP_RMW, addr, value, mask);
+}
+
+int litepcie_csr_batch_poll(struct litepcie_csr_batch *batch, uint32_t addr, uint32_t mask, uint32_t value) {
+    return litepcie_csr_batch_add(batch, LITEPCIE_CSR_OP_POLL, addr, value, mask);
+}
+
+int litepcie_csr_batch_submit(int fd, struct litepcie_csr_batch *batch) {
+    return litepcie_csr_batch(fd, batch->ops, batch->count);
+}
+
+uint32_t litepcie_csr_batch_value(const struct litepcie_csr_batch *batch, int index) {
+    if (index < 0 || (uint32_t)index >= batch->count)
+        return 0;
+    return batch->ops[index].value;
+}
 
-        if (ret == kIOReturnSuccess) {
-            printf("\tOpened service.\n");
+void litepcie_reload(int fd) {
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (dev)
+        dev->ops->reload(dev);
+}
+
+int litepcie_open(const char* name, int flags) {
+    const struct litepcie_backend_ops *ops = NULL;
+    int fd;
+
+    for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (backends[i]->probe(name)) {
+            ops = backends[i];
             break;
-        } else {
-            printf("\tFailed opening service with error: 0x%08x.\n", ret);
         }
+    }
+
+    if (ops == NULL) {
+        printf("No backend for device %s.\n", name);
+        return -1;
+    }
 
-        IOObjectRelease(service);
+    for (fd = 0; fd < LITEPCIE_MAX_DEVICES; fd++) {
+        if (devices[fd].ops == NULL)
+            break;
     }
-    IOObjectRelease(iterator);
 
-    if (service == IO_OBJECT_NULL) {
-        printf("Failed to match to device.\n");
-        return EXIT_FAILURE;
+    if (fd == LITEPCIE_MAX_DEVICES) {
+        printf("Too many open devices.\n");
+        return -1;
     }
-    
-    return connection;
-}
 
+    if (ops->open(&devices[fd], name) != 0)
+        return -1;
+    devices[fd].ops = ops;
 
-void litepcie_close(int fd) {
-    
+    return fd;
 }
 
-void _print_kerr_details(kern_return_t ret)
-{
-    printf("\tSystem: 0x%02x\n", err_get_system(ret));
-    printf("\tSubsystem: 0x%03x\n", err_get_sub(ret));
-    printf("\tCode: 0x%04x\n", err_get_code(ret));
+void litepcie_close(int fd) {
+    struct litepcie_device *dev = litepcie_get_device(fd);
+
+    if (!dev)
+        return;
+
+    dev->ops->close(dev);
+    free(dev->flash_info);
+    memset(dev, 0, sizeof(*dev));
 }
@@ -11,22 +11,35 @@
 #ifndef LITEPCIE_LIB_HELPERS_H
 #define LITEPCIE_LIB_HELPERS_H
 
-#include <IOKit/IOKitLib.h>
-#include <IOKit/IOReturn.h>
-#include <IOKit/hidsystem/IOHIDShared.h>
-#include <IOKit/usb/USB.h>
-
 #include <stdio.h>
 #include <stdint.h>
-#include <sys/ioctl.h>
-
 
-void _print_kerr_details(kern_return_t ret);
+#include "litepcie_backend.h"
 
 int64_t get_time_ms(void);
 
 uint32_t litepcie_readl(int fd, uint32_t addr);
 void litepcie_writel(int fd, uint32_t addr, uint32_t val);
+int litepcie_csr_batch(int fd, struct litepcie_csr_op *ops, uint32_t count);
+
+/* CSR batch builder, each add returns the op index (-1 when out of memory)
+ * to fetch its value with litepcie_csr_batch_value() after submitting */
+struct litepcie_csr_batch {
+    struct litepcie_csr_op *ops;
+    uint32_t count, size;
+};
+
+void litepcie_csr_batch_init(struct litepcie_csr_batch *batch);
+void litepcie_csr_batch_free(struct litepcie_csr_batch *batch);
+int litepcie_csr_batch_read(struct litepcie_csr_batch *batch, uint32_t addr);
+int litepcie_csr_batch_write(struct litepcie_csr_batch *batch, uint32_t addr, uint32_t value);
+int litepcie_csr_batch_rmw(struct litepcie_csr_batch *batch, uint32_t addr, uint32_t mask, uint32_t value);
+int litepcie_csr_batch_poll(struct litepcie_csr_batch *batch, uint32_t addr, uint32_t mask, uint32_t value);
+int litepcie_csr_batch_submit(int fd, struct litepcie_csr_batch *batch);
+uint32_t litepcie_csr_batch_value(const struct litepcie_csr_batch *batch, int index);
+
+int litepcie_get_stats(int fd, LitePCIeStats *stats);
+int litepcie_get_dma_stats(int fd, uint8_t channel, DMACounts *counts);
 void litepcie_reload(int fd);
 
 int litepcie_open(const char* name, int flags);
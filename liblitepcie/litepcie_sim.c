@@ -0,0 +1,637 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "litepcie_dma_common.h"
+#include "litepcie_sim.h"
+
+#define SIM_DEFAULT_IDENTIFIER "LitePCIe SoC simulation"
+#define SIM_DEFAULT_FIFO_DEPTH (64 * 1024)
+#define SIM_CHUNK_SIZE         (16 * 1024)
+#define SIM_BUS_BASE           0x10000000ULL
+/* channels csr.h does not describe continue in the free CSR banks */
+#define SIM_DMA_EXTRA_BASE     0x8000
+#define SIM_DMA_BANK_SIZE      0x800
+
+struct sim_region {
+    uint64_t bus_addr;
+    uint8_t *host;
+    size_t size;
+};
+
+struct sim_table {
+    uint32_t config[LITEPCIE_SIM_TABLE_DEPTH];
+    uint64_t address[LITEPCIE_SIM_TABLE_DEPTH];
+    uint32_t head;
+    uint32_t level;
+    uint32_t index;
+    uint32_t loop_count;
+    uint32_t value_config;
+    uint32_t value_lsb;
+    uint8_t enable;
+    uint8_t loop;
+    uint32_t offset; /* bytes done in the head descriptor */
+    uint64_t next_time; /* pacing deadline, ns */
+};
+
+struct sim_channel {
+    struct litepcie_sim *sim;
+    uint32_t index;
+    uint32_t base;
+    uint32_t reader_irq;
+    uint32_t writer_irq;
+    struct sim_table reader; /* host -> device */
+    struct sim_table writer; /* device -> host */
+    uint8_t loopback;
+    uint8_t *fifo;
+    uint32_t fifo_rd, fifo_wr, fifo_level;
+    uint32_t pattern; /* writer data when not in loopback */
+    pthread_t thread;
+    pthread_cond_t kick;
+};
+
+struct litepcie_sim {
+    struct litepcie_sim_config cfg;
+    pthread_mutex_t lock;
+    uint32_t regs[LITEPCIE_SIM_CSR_SIZE / 4];
+    uint32_t msi_enable;
+    uint32_t msi_vector;
+    struct sim_region regions[LITEPCIE_SIM_MAX_REGIONS];
+    uint64_t next_bus_addr;
+    struct sim_channel channel[LITEPCIE_SIM_MAX_CHANNELS];
+    litepcie_sim_irq_handler irq_handler;
+    void *irq_opaque;
+    struct litepcie_sim_stats stats;
+    uint8_t stop;
+};
+
+static uint64_t sim_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sim_sleep_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+    nanosleep(&ts, NULL);
+}
+
+/* Bus address translation, called with the sim lock held. */
+static uint8_t *sim_translate(struct litepcie_sim *sim, uint64_t bus_addr, size_t size)
+{
+    for (int i = 0; i < LITEPCIE_SIM_MAX_REGIONS; i++) {
+        struct sim_region *r = &sim->regions[i];
+        if (r->host == NULL)
+            continue;
+        if (bus_addr >= r->bus_addr && bus_addr + size <= r->bus_addr + r->size)
+            return r->host + (bus_addr - r->bus_addr);
+    }
+    return NULL;
+}
+
+static void sim_table_reset(struct sim_table *t)
+{
+    t->head = 0;
+    t->level = 0;
+    t->index = 0;
+    t->loop_count = 0;
+    t->offset = 0;
+}
+
+static void sim_table_push(struct sim_table *t, uint32_t msb)
+{
+    if (t->level >= LITEPCIE_SIM_TABLE_DEPTH)
+        return;
+    uint32_t slot = (t->head + t->level) % LITEPCIE_SIM_TABLE_DEPTH;
+    t->config[slot] = t->value_config;
+    t->address[slot] = ((uint64_t)msb << 32) | t->value_lsb;
+    t->level += 1;
+}
+
+/* Retire the head descriptor, returns its config word. */
+static uint32_t sim_table_complete(struct sim_table *t)
+{
+    uint32_t config = t->config[t->head];
+    uint64_t address = t->address[t->head];
+
+    t->head = (t->head + 1) % LITEPCIE_SIM_TABLE_DEPTH;
+    if (t->loop) {
+        /* in loop mode the descriptor is re-queued at the tail */
+        uint32_t slot = (t->head + t->level - 1) % LITEPCIE_SIM_TABLE_DEPTH;
+        t->config[slot] = config;
+        t->address[slot] = address;
+        t->index += 1;
+        if (t->index >= t->level) {
+            t->index = 0;
+            t->loop_count = (t->loop_count + 1) & 0xffff;
+        }
+    } else {
+        t->level -= 1;
+        t->index = (t->index + 1) & 0xffff;
+    }
+    t->offset = 0;
+    return config;
+}
+
+static uint32_t sim_fifo_push(struct sim_channel *c, const uint8_t *src, uint32_t len)
+{
+    uint32_t depth = c->sim->cfg.fifo_depth;
+    for (uint32_t done = 0; done < len;) {
+        uint32_t n = len - done;
+        if (n > depth - c->fifo_wr)
+            n = depth - c->fifo_wr;
+        memcpy(c->fifo + c->fifo_wr, src + done, n);
+        c->fifo_wr = (c->fifo_wr + n) % depth;
+        done += n;
+    }
+    c->fifo_level += len;
+    return len;
+}
+
+static uint32_t sim_fifo_pop(struct sim_channel *c, uint8_t *dst, uint32_t len)
+{
+    uint32_t depth = c->sim->cfg.fifo_depth;
+    for (uint32_t done = 0; done < len;) {
+        uint32_t n = len - done;
+        if (n > depth - c->fifo_rd)
+            n = depth - c->fifo_rd;
+        memcpy(dst + done, c->fifo + c->fifo_rd, n);
+        c->fifo_rd = (c->fifo_rd + n) % depth;
+        done += n;
+    }
+    c->fifo_level -= len;
+    return len;
+}
+
+static void sim_fill_pattern(struct sim_channel *c, uint8_t *dst, uint32_t len)
+{
+    uint32_t word;
+    for (uint32_t i = 0; i < len; i += 4) {
+        word = c->pattern++;
+        memcpy(dst + i, &word, (len - i) < 4 ? (len - i) : 4);
+    }
+}
+
+/*
+ * Move one chunk of the head descriptor of a table. Called with the sim lock
+ * held, returns the number of bytes moved and sets *irq when the descriptor
+ * completed with its IRQ enabled.
+ */
+static uint32_t sim_dma_step(struct sim_channel *c, struct sim_table *t, int is_reader, uint32_t *irq)
+{
+    struct litepcie_sim *sim = c->sim;
+    struct litepcie_sim_dma_stats *stats = is_reader ? &sim->stats.reader[c->index] : &sim->stats.writer[c->index];
+    uint32_t config, length, chunk;
+    uint8_t *host;
+
+    if (!t->enable || t->level == 0)
+        return 0;
+
+    config = t->config[t->head];
+    length = config & 0xffffff;
+    chunk = length - t->offset;
+    if (chunk > SIM_CHUNK_SIZE)
+        chunk = SIM_CHUNK_SIZE;
+
+    if (c->loopback) {
+        if (is_reader && chunk > sim->cfg.fifo_depth - c->fifo_level)
+            chunk = sim->cfg.fifo_depth - c->fifo_level;
+        if (!is_reader && chunk > c->fifo_level)
+            chunk = c->fifo_level;
+    }
+
+    if (chunk > 0) {
+        host = sim_translate(sim, t->address[t->head] + t->offset, chunk);
+        if (host == NULL) {
+            /* unmapped bus address, the gateware would raise a bus error */
+            sim->stats.dma_faults += 1;
+        } else if (is_reader) {
+            if (c->loopback)
+                sim_fifo_push(c, host, chunk);
+        } else {
+            if (c->loopback)
+                sim_fifo_pop(c, host, chunk);
+            else
+                sim_fill_pattern(c, host, chunk);
+        }
+        t->offset += chunk;
+        stats->bytes += chunk;
+    }
+
+    if (t->offset >= length) {
+        config = sim_table_complete(t);
+        stats->descriptors += 1;
+        if (!(config & DMA_IRQ_DISABLE)) {
+            stats->irqs += 1;
+            *irq |= 1 << (is_reader ? c->reader_irq : c->writer_irq);
+        }
+    }
+
+    return chunk ? chunk : (length == 0);
+}
+
+/* Latch MSI sources, returns the vector to deliver or 0. Called locked. */
+static uint32_t sim_msi_raise(struct litepcie_sim *sim, uint32_t irq)
+{
+    uint32_t fresh = irq & ~sim->msi_vector;
+
+    sim->msi_vector |= irq;
+    if ((fresh & sim->msi_enable) == 0) {
+        if (irq & sim->msi_enable)
+            sim->stats.msi_coalesced += 1;
+        return 0;
+    }
+    sim->stats.msi_sent += 1;
+    return sim->msi_vector & sim->msi_enable;
+}
+
+static void *sim_engine(void *arg)
+{
+    struct sim_channel *c = arg;
+    struct litepcie_sim *sim = c->sim;
+    struct sim_table *tables[2] = { &c->reader, &c->writer };
+
+    pthread_mutex_lock(&sim->lock);
+    while (!sim->stop) {
+        uint64_t now = sim_time_ns();
+        uint64_t wake = UINT64_MAX;
+        uint32_t irq = 0, vector = 0;
+        int active = 0;
+
+        for (int i = 0; i < 2; i++) {
+            struct sim_table *t = tables[i];
+            uint32_t moved;
+
+            if (!t->enable || t->level == 0)
+                continue;
+            if (sim->cfg.line_rate && t->next_time > now) {
+                active = 1;
+                if (t->next_time < wake)
+                    wake = t->next_time;
+                continue;
+            }
+            moved = sim_dma_step(c, t, t == &c->reader, &irq);
+            if (moved == 0)
+                continue;
+            active = 1;
+            if (sim->cfg.line_rate) {
+                if (t->next_time + 1000000 < now)
+                    t->next_time = now; /* don't burst after a stall */
+                t->next_time += moved * 1000000000ULL / sim->cfg.line_rate;
+            }
+        }
+
+        if (irq)
+            vector = sim_msi_raise(sim, irq);
+
+        if (vector && sim->irq_handler) {
+            litepcie_sim_irq_handler handler = sim->irq_handler;
+            void *opaque = sim->irq_opaque;
+            pthread_mutex_unlock(&sim->lock);
+            handler(opaque, vector);
+            pthread_mutex_lock(&sim->lock);
+        }
+
+        if (!active) {
+            /* idle or stalled, wait for a CSR write to change things */
+            pthread_cond_wait(&c->kick, &sim->lock);
+        } else {
+            /* let CSR accesses from the host in between chunks */
+            pthread_mutex_unlock(&sim->lock);
+            if (wake != UINT64_MAX && !irq)
+                sim_sleep_ns(wake - now);
+            else
+                sched_yield();
+            pthread_mutex_lock(&sim->lock);
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    return NULL;
+}
+
+/* csr.h's block for the channels it has, the extra banks after them */
+static uint32_t sim_dma_default_base(uint32_t channel)
+{
+    uint32_t base, defined = 0;
+
+    if (litepcie_dma_channel_base(channel, &base) == 0)
+        return base;
+    while (litepcie_dma_channel_base(defined, &base) == 0)
+        defined++;
+    return SIM_DMA_EXTRA_BASE + (channel - defined) * SIM_DMA_BANK_SIZE;
+}
+
+static struct sim_channel *sim_find_channel(struct litepcie_sim *sim, uint32_t addr)
+{
+    for (uint32_t i = 0; i < sim->cfg.dma_channels; i++) {
+        struct sim_channel *c = &sim->channel[i];
+        if (addr >= c->base && addr <= c->base + PCIE_DMA_BUFFERING_WRITER_FIFO_LEVEL_ADDR)
+            return c;
+    }
+    return NULL;
+}
+
+static uint32_t sim_dma_readl(struct sim_channel *c, uint32_t reg)
+{
+    struct litepcie_sim *sim = c->sim;
+
+    switch (reg) {
+    case PCIE_DMA_WRITER_ENABLE_OFFSET:
+        return c->writer.enable;
+    case PCIE_DMA_WRITER_TABLE_VALUE_OFFSET:
+        return c->writer.value_config;
+    case PCIE_DMA_WRITER_TABLE_VALUE_OFFSET + 4:
+        return c->writer.value_lsb;
+    case PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET:
+        return c->writer.loop;
+    case PCIE_DMA_WRITER_TABLE_LOOP_STATUS_OFFSET:
+        return (c->writer.loop_count << 16) | (c->writer.index & 0xffff);
+    case PCIE_DMA_WRITER_TABLE_LEVEL_OFFSET:
+        return c->writer.level;
+    case PCIE_DMA_READER_ENABLE_OFFSET:
+        return c->reader.enable;
+    case PCIE_DMA_READER_TABLE_VALUE_OFFSET:
+        return c->reader.value_config;
+    case PCIE_DMA_READER_TABLE_VALUE_OFFSET + 4:
+        return c->reader.value_lsb;
+    case PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET:
+        return c->reader.loop;
+    case PCIE_DMA_READER_TABLE_LOOP_STATUS_OFFSET:
+        return (c->reader.loop_count << 16) | (c->reader.index & 0xffff);
+    case PCIE_DMA_READER_TABLE_LEVEL_OFFSET:
+        return c->reader.level;
+    case PCIE_DMA_LOOPBACK_ENABLE_OFFSET:
+        return c->loopback;
+    case PCIE_DMA_BUFFERING_READER_FIFO_DEPTH_ADDR:
+    case PCIE_DMA_BUFFERING_WRITER_FIFO_DEPTH_ADDR:
+        return sim->cfg.fifo_depth & 0xffffff;
+    case PCIE_DMA_BUFFERING_READER_FIFO_LEVEL_ADDR:
+    case PCIE_DMA_BUFFERING_WRITER_FIFO_LEVEL_ADDR:
+        return c->fifo_level & 0xffffff;
+    default:
+        return 0;
+    }
+}
+
+static void sim_dma_writel(struct sim_channel *c, uint32_t reg, uint32_t val)
+{
+    switch (reg) {
+    case PCIE_DMA_WRITER_ENABLE_OFFSET:
+        c->writer.enable = val & 1;
+        c->writer.offset = 0;
+        break;
+    case PCIE_DMA_WRITER_TABLE_VALUE_OFFSET:
+        c->writer.value_config = val;
+        break;
+    case PCIE_DMA_WRITER_TABLE_VALUE_OFFSET + 4:
+        c->writer.value_lsb = val;
+        break;
+    case PCIE_DMA_WRITER_TABLE_WE_OFFSET:
+        sim_table_push(&c->writer, val);
+        break;
+    case PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET:
+        c->writer.loop = val & 1;
+        break;
+    case PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET:
+        if (val & 1)
+            sim_table_reset(&c->writer);
+        break;
+    case PCIE_DMA_READER_ENABLE_OFFSET:
+        c->reader.enable = val & 1;
+        c->reader.offset = 0;
+        break;
+    case PCIE_DMA_READER_TABLE_VALUE_OFFSET:
+        c->reader.value_config = val;
+        break;
+    case PCIE_DMA_READER_TABLE_VALUE_OFFSET + 4:
+        c->reader.value_lsb = val;
+        break;
+    case PCIE_DMA_READER_TABLE_WE_OFFSET:
+        sim_table_push(&c->reader, val);
+        break;
+    case PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET:
+        c->reader.loop = val & 1;
+        break;
+    case PCIE_DMA_READER_TABLE_FLUSH_OFFSET:
+        if (val & 1)
+            sim_table_reset(&c->reader);
+        break;
+    case PCIE_DMA_LOOPBACK_ENABLE_OFFSET:
+        c->loopback = val & 1;
+        break;
+    default:
+        break;
+    }
+    pthread_cond_signal(&c->kick);
+}
+
+void litepcie_sim_config_default(struct litepcie_sim_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->identifier = SIM_DEFAULT_IDENTIFIER;
+    cfg->dma_channels = DMA_CHANNEL_COUNT;
+    cfg->line_rate = 0;
+    cfg->fifo_depth = SIM_DEFAULT_FIFO_DEPTH;
+}
+
+struct litepcie_sim *litepcie_sim_create(const struct litepcie_sim_config *cfg)
+{
+    struct litepcie_sim *sim;
+    const char *id;
+
+    if (cfg->dma_channels == 0 || cfg->dma_channels > LITEPCIE_SIM_MAX_CHANNELS)
+        return NULL;
+
+    sim = calloc(1, sizeof(*sim));
+    if (!sim)
+        return NULL;
+
+    sim->cfg = *cfg;
+    if (sim->cfg.fifo_depth == 0)
+        sim->cfg.fifo_depth = SIM_DEFAULT_FIFO_DEPTH;
+    sim->next_bus_addr = SIM_BUS_BASE;
+    pthread_mutex_init(&sim->lock, NULL);
+
+    /* identifier_mem holds one character per 32-bit word */
+    id = cfg->identifier ? cfg->identifier : SIM_DEFAULT_IDENTIFIER;
+    for (int i = 0; i < 255 && id[i]; i++)
+        sim->regs[CSR_TO_OFFSET(CSR_IDENTIFIER_MEM_BASE) / 4 + i] = (uint8_t)id[i];
+    sim->regs[CSR_TO_OFFSET(CSR_CTRL_SCRATCH_ADDR) / 4] = 0x12345678;
+
+    for (uint32_t i = 0; i < sim->cfg.dma_channels; i++) {
+        struct sim_channel *c = &sim->channel[i];
+        c->sim = sim;
+        c->index = i;
+        c->base = cfg->dma_base[i] ? cfg->dma_base[i] : sim_dma_default_base(i);
+        c->reader_irq = litepcie_dma_reader_irq(i);
+        c->writer_irq = litepcie_dma_writer_irq(i);
+        c->fifo = calloc(1, sim->cfg.fifo_depth);
+        pthread_cond_init(&c->kick, NULL);
+    }
+
+    for (uint32_t i = 0; i < sim->cfg.dma_channels; i++) {
+        if (sim->channel[i].fifo == NULL
+            || pthread_create(&sim->channel[i].thread, NULL, sim_engine, &sim->channel[i]) != 0) {
+            sim->cfg.dma_channels = i;
+            litepcie_sim_destroy(sim);
+            return NULL;
+        }
+    }
+
+    return sim;
+}
+
+void litepcie_sim_destroy(struct litepcie_sim *sim)
+{
+    if (!sim)
+        return;
+
+    pthread_mutex_lock(&sim->lock);
+    sim->stop = 1;
+    for (uint32_t i = 0; i < sim->cfg.dma_channels; i++)
+        pthread_cond_signal(&sim->channel[i].kick);
+    pthread_mutex_unlock(&sim->lock);
+
+    for (uint32_t i = 0; i < LITEPCIE_SIM_MAX_CHANNELS; i++) {
+        struct sim_channel *c = &sim->channel[i];
+        if (c->sim == NULL)
+            continue;
+        if (i < sim->cfg.dma_channels)
+            pthread_join(c->thread, NULL);
+        pthread_cond_destroy(&c->kick);
+        free(c->fifo);
+    }
+
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+}
+
+uint32_t litepcie_sim_readl(struct litepcie_sim *sim, uint32_t addr)
+{
+    struct sim_channel *c;
+    uint32_t val;
+
+    if (addr >= LITEPCIE_SIM_CSR_SIZE || (addr & 3))
+        return 0;
+
+    pthread_mutex_lock(&sim->lock);
+    if ((c = sim_find_channel(sim, addr)) != NULL)
+        val = sim_dma_readl(c, addr - c->base);
+    else if (addr == CSR_TO_OFFSET(CSR_PCIE_MSI_ENABLE_ADDR))
+        val = sim->msi_enable;
+    else if (addr == CSR_TO_OFFSET(CSR_PCIE_MSI_VECTOR_ADDR))
+        val = sim->msi_vector;
+    else
+        val = sim->regs[addr / 4];
+    pthread_mutex_unlock(&sim->lock);
+
+    return val;
+}
+
+void litepcie_sim_writel(struct litepcie_sim *sim, uint32_t addr, uint32_t val)
+{
+    struct sim_channel *c;
+    uint32_t vector = 0;
+    litepcie_sim_irq_handler handler = NULL;
+    void *opaque = NULL;
+
+    if (addr >= LITEPCIE_SIM_CSR_SIZE || (addr & 3))
+        return;
+
+    pthread_mutex_lock(&sim->lock);
+    if ((c = sim_find_channel(sim, addr)) != NULL) {
+        sim_dma_writel(c, addr - c->base, val);
+    } else if (addr == CSR_TO_OFFSET(CSR_PCIE_MSI_ENABLE_ADDR)) {
+        uint32_t fresh = val & ~sim->msi_enable;
+        sim->msi_enable = val;
+        /* enabling a source that is already pending fires it */
+        if (fresh & sim->msi_vector) {
+            vector = sim->msi_vector & sim->msi_enable;
+            sim->stats.msi_sent += 1;
+        }
+    } else if (addr == CSR_TO_OFFSET(CSR_PCIE_MSI_CLEAR_ADDR)) {
+        sim->msi_vector &= ~val;
+    } else if (addr == CSR_TO_OFFSET(CSR_PCIE_MSI_VECTOR_ADDR)) {
+        /* read-only */
+    } else if (addr >= CSR_TO_OFFSET(CSR_IDENTIFIER_MEM_BASE) && addr < CSR_TO_OFFSET(CSR_IDENTIFIER_MEM_BASE) + 256 * 4) {
+        /* read-only */
+    } else {
+        sim->regs[addr / 4] = val;
+    }
+    handler = sim->irq_handler;
+    opaque = sim->irq_opaque;
+    pthread_mutex_unlock(&sim->lock);
+
+    if (vector && handler)
+        handler(opaque, vector);
+}
+
+int litepcie_sim_dma_map(struct litepcie_sim *sim, void *host, size_t size, uint64_t *bus_addr)
+{
+    int ret = -ENOSPC;
+
+    pthread_mutex_lock(&sim->lock);
+    for (int i = 0; i < LITEPCIE_SIM_MAX_REGIONS; i++) {
+        struct sim_region *r = &sim->regions[i];
+        if (r->host != NULL)
+            continue;
+        r->host = host;
+        r->size = size;
+        r->bus_addr = sim->next_bus_addr;
+        /* keep regions 4 KB aligned and never reuse a bus address */
+        sim->next_bus_addr += (size + 0xfff) & ~(uint64_t)0xfff;
+        *bus_addr = r->bus_addr;
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    return ret;
+}
+
+void litepcie_sim_dma_unmap(struct litepcie_sim *sim, uint64_t bus_addr)
+{
+    pthread_mutex_lock(&sim->lock);
+    for (int i = 0; i < LITEPCIE_SIM_MAX_REGIONS; i++) {
+        if (sim->regions[i].host != NULL && sim->regions[i].bus_addr == bus_addr)
+            memset(&sim->regions[i], 0, sizeof(sim->regions[i]));
+    }
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void litepcie_sim_set_irq_handler(struct litepcie_sim *sim, litepcie_sim_irq_handler handler, void *opaque)
+{
+    pthread_mutex_lock(&sim->lock);
+    sim->irq_handler = handler;
+    sim->irq_opaque = opaque;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+uint32_t litepcie_sim_dma_base(struct litepcie_sim *sim, uint32_t channel)
+{
+    if (channel >= sim->cfg.dma_channels)
+        return 0;
+    return sim->channel[channel].base;
+}
+
+void litepcie_sim_get_stats(struct litepcie_sim *sim, struct litepcie_sim_stats *stats)
+{
+    pthread_mutex_lock(&sim->lock);
+    *stats = sim->stats;
+    pthread_mutex_unlock(&sim->lock);
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ *
+ * LitePCIe library
+ *
+ * This file is part of LitePCIe.
+ *
+ * Copyright (C) 2018-2023 / EnjoyDigital  / florent@enjoy-digital.fr
+ *
+ */
+
+#ifndef LITEPCIE_LIB_SIM_H
+#define LITEPCIE_LIB_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "litepcie.h"
+
+/*
+ * Software model of a LitePCIe endpoint.
+ *
+ * Implements the CSR map from csr.h (scratch, identifier_mem, pcie_dma tables,
+ * loopback, buffering FIFOs and pcie_msi) and one DMA engine thread per
+ * channel that walks the programmed descriptor tables at a configurable line
+ * rate. Descriptor addresses are bus addresses handed out by
+ * litepcie_sim_dma_map(), so host code can run unchanged against it.
+ */
+
+#define LITEPCIE_SIM_MAX_CHANNELS 8
+#define LITEPCIE_SIM_TABLE_DEPTH  256
+#define LITEPCIE_SIM_CSR_SIZE     0x10000
+#define LITEPCIE_SIM_MAX_REGIONS  64
+
+struct litepcie_sim;
+
+typedef void (*litepcie_sim_irq_handler)(void *opaque, uint32_t vector);
+
+struct litepcie_sim_config {
+    const char *identifier; /* identifier_mem contents */
+    uint32_t dma_channels;
+    uint32_t dma_base[LITEPCIE_SIM_MAX_CHANNELS]; /* 0 = default layout */
+    uint64_t line_rate; /* bytes/s per direction, 0 = unthrottled */
+    uint32_t fifo_depth; /* loopback FIFO depth in bytes */
+};
+
+struct litepcie_sim_dma_stats {
+    uint64_t bytes;
+    uint64_t descriptors;
+    uint64_t irqs;
+};
+
+struct litepcie_sim_stats {
+    struct litepcie_sim_dma_stats reader[LITEPCIE_SIM_MAX_CHANNELS];
+    struct litepcie_sim_dma_stats writer[LITEPCIE_SIM_MAX_CHANNELS];
+    uint64_t msi_sent;
+    uint64_t msi_coalesced;
+    uint64_t dma_faults;
+};
+
+void litepcie_sim_config_default(struct litepcie_sim_config *cfg);
+
+struct litepcie_sim *litepcie_sim_create(const struct litepcie_sim_config *cfg);
+void litepcie_sim_destroy(struct litepcie_sim *sim);
+
+uint32_t litepcie_sim_readl(struct litepcie_sim *sim, uint32_t addr);
+void litepcie_sim_writel(struct litepcie_sim *sim, uint32_t addr, uint32_t val);
+
+int litepcie_sim_dma_map(struct litepcie_sim *sim, void *host, size_t size, uint64_t *bus_addr);
+void litepcie_sim_dma_unmap(struct litepcie_sim *sim, uint64_t bus_addr);
+
+void litepcie_sim_set_irq_handler(struct litepcie_sim *sim, litepcie_sim_irq_handler handler, void *opaque);
+
+uint32_t litepcie_sim_dma_base(struct litepcie_sim *sim, uint32_t channel);
+void litepcie_sim_get_stats(struct litepcie_sim *sim, struct litepcie_sim_stats *stats);
+
+#endif /* LITEPCIE_LIB_SIM_H */
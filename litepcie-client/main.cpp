@@ -10,6 +10,7 @@
 #include "csr.h"
 #include "config.h"
 #include "litepcie_ext.h"
+#include "litepcie_dma_progress.h"
 
 
 inline void PrintErrorDetails(kern_return_t ret)
@@ -152,7 +153,12 @@ int main(int argc, const char* argv[])
         uint8_t* writerBuffer = reinterpret_cast<uint8_t*>(writerAddress);
         DMACounts* dmaCounts = reinterpret_cast<DMACounts*>(countAddress);
 
-        printf("counts rd: %llu wr: %llu\n", dmaCounts->hwReaderCountTotal, dmaCounts->hwWriterCountTotal);
+        if (!litepcie_dma_counts_valid(dmaCounts)) {
+            printf("counts page version %u size %u, expected %u size %zu\n", dmaCounts->version, dmaCounts->size, LITEPCIE_DMA_COUNTS_VERSION, sizeof(DMACounts));
+            return EXIT_FAILURE;
+        }
+
+        printf("counts rd: %llu wr: %llu\n", litepcie_dma_progress_count(&dmaCounts->reader), litepcie_dma_progress_count(&dmaCounts->writer));
 
         uint8_t* tmpBuffer = new uint8_t[readerSize];
 
@@ -180,11 +186,11 @@ int main(int argc, const char* argv[])
         double avgTime = 0;
 
         avgTime = 0;
-        uint64_t swReaderCount = dmaCounts->hwReaderCountTotal;
+        uint64_t swReaderCount = litepcie_dma_progress_count(&dmaCounts->reader);
         for (int i = 0; i < trials; i++) {
             uint64_t startTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
             for (int j = 0; j < DMA_BUFFER_COUNT; j++) {
-                while(dmaCounts->hwReaderCountTotal <= swReaderCount);
+                while(litepcie_dma_progress_count(&dmaCounts->reader) <= swReaderCount);
                 memcpy(readerBuffer + ((swReaderCount % DMA_BUFFER_COUNT) * DMA_BUFFER_SIZE),
                        tmpBuffer + ((swReaderCount % DMA_BUFFER_COUNT) * DMA_BUFFER_SIZE),
                        DMA_BUFFER_SIZE);
@@ -197,11 +203,11 @@ int main(int argc, const char* argv[])
         double readerRate = readerSize / (avgTime / 1'000'000'000.0f);
 
         avgTime = 0;
-        uint64_t swWriterCount = dmaCounts->hwWriterCountTotal;
+        uint64_t swWriterCount = litepcie_dma_progress_count(&dmaCounts->writer);
         for (int i = 0; i < trials; i++) {
             uint64_t startTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
             for (int j = 0; j < DMA_BUFFER_COUNT; j++) {
-                while(dmaCounts->hwWriterCountTotal <= swWriterCount);
+                while(litepcie_dma_progress_count(&dmaCounts->writer) <= swWriterCount);
                 memcmp(writerBuffer + ((swWriterCount % DMA_BUFFER_COUNT) * DMA_BUFFER_SIZE),
                        tmpBuffer + ((swWriterCount % DMA_BUFFER_COUNT) * DMA_BUFFER_SIZE),
                        DMA_BUFFER_SIZE);
@@ -64,6 +64,12 @@
 #define DMA_BUFFER_COUNT       256
 #define DMA_BUFFER_SIZE        8192
 #define DMA_BUFFER_TOTAL_SIZE (DMA_BUFFER_COUNT*DMA_BUFFER_SIZE)
+
+/* runtime ring geometry limits, the defaults above are used until changed */
+#define DMA_BUFFER_SIZE_MIN    256
+#define DMA_BUFFER_SIZE_MAX    (1 << 20)
+#define DMA_BUFFER_COUNT_MAX   256 /* hardware table depth */
+#define DMA_RING_SIZE_MAX      (64 << 20)
 //#define DMA_BUFFER_ALIGNED
 
 /* DMA Offsets */
@@ -1,10 +1,9 @@
 #include <time.h>
 
-#include <os/log.h>
-
 #include <DriverKit/DriverKit.h>
 #include <DriverKit/IOLib.h>
 #include <DriverKit/IOMemoryMap.h>
+#include <DriverKit/IOSubMemoryDescriptor.h>
 #include <DriverKit/IOTimerDispatchSource.h>
 #include <DriverKit/IOUserClient.h>
 #include <DriverKit/IOUserServer.h>
@@ -15,30 +14,77 @@
 #include "config.h"
 #include "csr.h"
 #include "litepcie.h"
+#include "litepcie_csr_window.h"
+#include "litepcie_dma_common.h"
+#include "litepcie_dma_ring.h"
+#include "litepcie_flash_spi.h"
 #include "litepcie_int.h"
+#include "litepcie_irq_route.h"
+#include "litepcie_log.h"
+
+#define Log(fmt, ...) LITEPCIE_LOG_INFO("litepcie::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LogError(fmt, ...) LITEPCIE_LOG_ERROR("litepcie::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LogDebug(fmt, ...) LITEPCIE_LOG_DEBUG("litepcie::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LogTrace(fmt, ...) LITEPCIE_LOG_TRACE("litepcie::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 
-#define Log(fmt, ...) os_log(OS_LOG_DEFAULT, "litepcie::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 
+// LitePCIeMSI has vector/clear registers and a single MSI, the multi-vector
+// core raises MSI vector n for IRQ bit n and has neither
+#ifdef CSR_PCIE_MSI_CLEAR_ADDR
+#define LITEPCIE_MSI_MULTI_VECTOR false
+#else
+#define LITEPCIE_MSI_MULTI_VECTOR true
+#endif
 
 struct litepcie_IVars {
     IOPCIDevice* pciDevice;
     IODispatchQueue* defaultDispatchQueue = nullptr;
-    IODispatchQueue* interruptDispatchQueue = nullptr;
-    IOInterruptDispatchSource* interruptSource;
     DMAChannel* channel[DMA_CHANNEL_COUNT];
-    uint64_t interruptCount = 0;
-    uint64_t interruptTimePrevBM = 0;
-    uint64_t readerPrevBM = 0;
-    uint64_t writerPrevBM = 0;
+    IOLock* msiLock = nullptr;
+    uint32_t msiEnable = 0;
+
+    // one flash command at a time across user clients, the last program
+    // has to have cleared WIP by flashReadyDeadline (absolute time, 0 for none)
+    IOLock* flashLock = nullptr;
+    uint64_t flashReadyDeadline = 0;
+
+    // adaptive coalescing releases held off IRQs from here
+    IODispatchQueue* coalesceDispatchQueue = nullptr;
+    IOTimerDispatchSource* coalesceTimer = nullptr;
+    uint64_t coalesceDeadline = 0;
+
+    // one source and queue per routed MSI vector, so a busy channel never
+    // serializes the counter updates of another
+    litepcie_irq_route irqRoute;
+    IODispatchQueue* interruptDispatchQueue[LITEPCIE_IRQ_MAX_SOURCES];
+    IOInterruptDispatchSource* interruptSource[LITEPCIE_IRQ_MAX_SOURCES];
+    uint64_t interruptCount[LITEPCIE_IRQ_MAX_SOURCES];
+    uint64_t interruptMmioReads[LITEPCIE_IRQ_MAX_SOURCES]; // MSI vector reads, status reads are per direction in DMACounts
+    // ExternalMethod calls by selector, bumped from every user client queue
+    uint64_t methodCalls[LITEPCIE_STATS_SELECTORS];
 };
 
-kern_return_t litepcie::InitDMAChannel(int chan_idx)
+static_assert(LITEPCIE_STATS_SOURCES == LITEPCIE_IRQ_MAX_SOURCES, "LitePCIeStats sized for every interrupt source");
+
+static void ReleaseDMARing(DMARing* ring)
 {
-    Log("entered");
+    if (ring->command != nullptr) {
+        ring->command->CompleteDMA(kIODMACommandCompleteDMANoOptions);
+    }
+
+    OSSafeReleaseNULL(ring->command);
+    OSSafeReleaseNULL(ring->buffer);
+    IOSafeDeleteNULL(ring->busAddresses, uint64_t, DMA_BUFFER_COUNT_MAX);
+}
 
+static kern_return_t CreateDMARing(IOPCIDevice* pciDevice, DMARing* ring, uint32_t bufferSize, uint32_t bufferCount, uint32_t bufferPerIrq, uint8_t pattern)
+{
     kern_return_t ret = kIOReturnSuccess;
     uint64_t dmaFlags = kIOMemoryDirectionInOut;
-    uint32_t dmaSegmentCount = 1;
+    uint32_t dmaSegmentCount = LITEPCIE_DMA_MAX_SEGMENTS;
+    uint64_t ringSize = (uint64_t)bufferSize * bufferCount;
+    IOAddressSegment physicalSegments[LITEPCIE_DMA_MAX_SEGMENTS];
+    litepcie_dma_segment segments[LITEPCIE_DMA_MAX_SEGMENTS];
 
     IODMACommandSpecification dmaSpecification;
 
@@ -46,178 +92,466 @@ kern_return_t litepcie::InitDMAChannel(int chan_idx)
 
     dmaSpecification.options = kIODMACommandCreateNoOptions;
     dmaSpecification.maxAddressBits = 32;
-    
-    ivars->channel[chan_idx]->readerEnabled = false;
-    ivars->channel[chan_idx]->writerEnabled = false;
-
-    ivars->channel[chan_idx]->dmaReaderVirtualSegments = IONew(IOAddressSegment*, DMA_BUFFER_COUNT);
-    ivars->channel[chan_idx]->dmaReaderPhysicalSegments = IONew(IOAddressSegment*, DMA_BUFFER_COUNT);
-    ivars->channel[chan_idx]->dmaReaderCommands = IONew(IODMACommand*, DMA_BUFFER_COUNT);
-    ivars->channel[chan_idx]->dmaReaderBuffers = IONew(IOBufferMemoryDescriptor*, DMA_BUFFER_COUNT);
-
-    ivars->channel[chan_idx]->dmaWriterVirtualSegments = IONew(IOAddressSegment*, DMA_BUFFER_COUNT);
-    ivars->channel[chan_idx]->dmaWriterPhysicalSegments = IONew(IOAddressSegment*, DMA_BUFFER_COUNT);
-    ivars->channel[chan_idx]->dmaWriterCommands = IONew(IODMACommand*, DMA_BUFFER_COUNT);
-    ivars->channel[chan_idx]->dmaWriterBuffers = IONew(IOBufferMemoryDescriptor*, DMA_BUFFER_COUNT);
-    
-    IOAddressSegment dmaCountAddress;
-    IOBufferMemoryDescriptor::Create(kIOMemoryDirectionInOut, sizeof(DMACounts), 0, &ivars->channel[chan_idx]->dmaCountsBuffer);
-    ivars->channel[chan_idx]->dmaCountsBuffer->SetLength(sizeof(DMACounts));
-    ivars->channel[chan_idx]->dmaCountsBuffer->GetAddressRange(&dmaCountAddress);
-    ivars->channel[chan_idx]->dmaCounts = reinterpret_cast<DMACounts*>(dmaCountAddress.address);
-    
 
-    for (int i = 0; i < DMA_BUFFER_COUNT; i += 1) {
-        ivars->channel[chan_idx]->dmaReaderVirtualSegments[i] = new IOAddressSegment;
-        ivars->channel[chan_idx]->dmaReaderPhysicalSegments[i] = new IOAddressSegment;
+    ring->bufferSize = bufferSize;
+    ring->bufferCount = bufferCount;
+    ring->bufferPerIrq = bufferPerIrq;
+    ring->busAddresses = IONewZero(uint64_t, DMA_BUFFER_COUNT_MAX);
+    if (ring->busAddresses == nullptr) {
+        return kIOReturnNoMemory;
+    }
 
-        ret = IOBufferMemoryDescriptor::Create(kIOMemoryDirectionInOut, DMA_BUFFER_SIZE, 0, &ivars->channel[chan_idx]->dmaReaderBuffers[i]);
-        if (ret != kIOReturnSuccess) {
-            Log("failed to create dma buffer");
-            return ret;
-        }
+    ret = IOBufferMemoryDescriptor::Create(kIOMemoryDirectionInOut, ringSize, bufferSize, &ring->buffer);
+    if (ret != kIOReturnSuccess) {
+        LogError("failed to create dma buffer");
+        return ret;
+    }
 
-        ivars->channel[chan_idx]->dmaReaderBuffers[i]->SetLength(DMA_BUFFER_SIZE);
-        ivars->channel[chan_idx]->dmaReaderBuffers[i]->GetAddressRange(ivars->channel[chan_idx]->dmaReaderVirtualSegments[i]);
+    ring->buffer->SetLength(ringSize);
+    ring->buffer->GetAddressRange(&ring->virtualSegment);
 
-        IODMACommand::Create(ivars->pciDevice, kIODMACommandCreateNoOptions, &dmaSpecification, &ivars->channel[chan_idx]->dmaReaderCommands[i]);
+    ret = IODMACommand::Create(pciDevice, kIODMACommandCreateNoOptions, &dmaSpecification, &ring->command);
+    if (ret != kIOReturnSuccess) {
+        LogError("failed to create dma command with error: 0x%08x", ret);
+        return ret;
+    }
 
-        dmaSegmentCount = 1;
-        dmaFlags = kIOMemoryDirectionInOut;
+    ret = ring->command->PrepareForDMA(kIODMACommandPrepareForDMANoOptions,
+        ring->buffer,
+        0,
+        ringSize,
+        &dmaFlags,
+        &dmaSegmentCount,
+        physicalSegments);
+    if (ret != kIOReturnSuccess) {
+        LogError("failed to prepare dma with error: 0x%08x", ret);
+        return ret;
+    }
 
-        ret = ivars->channel[chan_idx]->dmaReaderCommands[i]->PrepareForDMA(kIODMACommandPrepareForDMANoOptions,
-            ivars->channel[chan_idx]->dmaReaderBuffers[i],
-            0,
-            0,
-            &dmaFlags,
-            &dmaSegmentCount,
-            ivars->channel[chan_idx]->dmaReaderPhysicalSegments[i]);
-        ivars->channel[chan_idx]->dmaReaderBuffers[i]->SetLength(DMA_BUFFER_SIZE);
+    for (uint32_t i = 0; i < dmaSegmentCount; i += 1) {
+        segments[i].address = physicalSegments[i].address;
+        segments[i].length = physicalSegments[i].length;
+    }
 
-        for (int j = 0; j < DMA_BUFFER_SIZE; j += 1) {
-            reinterpret_cast<uint8_t*>(ivars->channel[chan_idx]->dmaReaderVirtualSegments[i]->address)[j] = i + 1;
-        }
+    if (litepcie_dma_ring_layout(segments, dmaSegmentCount, bufferSize, bufferCount, ring->busAddresses) != 0) {
+        LogError("dma buffer straddles a segment boundary (%u segments)", dmaSegmentCount);
+        return kIOReturnNoResources;
+    }
 
-        if (ret != kIOReturnSuccess) {
-            Log("failed to prepare dma with error: 0x%08x", ret);
-            return ret;
-        }
+    for (uint32_t i = 0; i < bufferCount; i += 1) {
+        memset(reinterpret_cast<uint8_t*>(ring->virtualSegment.address) + (uint64_t)i * bufferSize, pattern + i, bufferSize);
     }
 
-    for (int i = 0; i < DMA_BUFFER_COUNT; i += 1) {
-        ivars->channel[chan_idx]->dmaWriterVirtualSegments[i] = new IOAddressSegment;
-        ivars->channel[chan_idx]->dmaWriterPhysicalSegments[i] = new IOAddressSegment;
+    return ret;
+}
 
-        ret = IOBufferMemoryDescriptor::Create(kIOMemoryDirectionInOut, DMA_BUFFER_SIZE, 0, &ivars->channel[chan_idx]->dmaWriterBuffers[i]);
-        if (ret != kIOReturnSuccess) {
-            Log("failed to create dma buffer");
-            return ret;
-        }
+// BAR0 offset of a register in the channel's own DMA CSR block
+static inline uint64_t DMARegister(DMAChannel* channel, uint32_t offset)
+{
+    return CSR_TO_OFFSET(channel->baseAddress) + offset;
+}
+
+static uint64_t AbsoluteToNanoseconds(uint64_t time)
+{
+    static mach_timebase_info_data_t info;
+    if (info.denom == 0) {
+        mach_timebase_info(&info);
+    }
+    return time * info.numer / info.denom;
+}
 
-        ivars->channel[chan_idx]->dmaWriterBuffers[i]->SetLength(DMA_BUFFER_SIZE);
-        ivars->channel[chan_idx]->dmaWriterBuffers[i]->GetAddressRange(ivars->channel[chan_idx]->dmaWriterVirtualSegments[i]);
+static uint64_t NanosecondsToAbsolute(uint64_t ns)
+{
+    static mach_timebase_info_data_t info;
+    if (info.denom == 0) {
+        mach_timebase_info(&info);
+    }
+    return ns * info.denom / info.numer;
+}
 
-        IODMACommand::Create(ivars->pciDevice, kIODMACommandCreateNoOptions, &dmaSpecification, &ivars->channel[chan_idx]->dmaWriterCommands[i]);
+// MSI enable is shared by every channel and written from the interrupt
+// queues and the coalescing timer, accumulate under the lock
+static void UpdateMSIEnable(litepcie_IVars* ivars, uint32_t set, uint32_t clear)
+{
+    IOLockLock(ivars->msiLock);
+    ivars->msiEnable = (ivars->msiEnable | set) & ~clear;
+    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_ENABLE_ADDR), ivars->msiEnable);
+    IOLockUnlock(ivars->msiLock);
+}
+
+static void ArmCoalesceTimer(litepcie_IVars* ivars, uint64_t deadline)
+{
+    IOLockLock(ivars->msiLock);
+    if (ivars->coalesceDeadline == 0 || deadline < ivars->coalesceDeadline) {
+        ivars->coalesceDeadline = deadline;
+        ivars->coalesceTimer->WakeAtTime(kIOTimerClockMachAbsoluteTime, deadline, 0);
+    }
+    IOLockUnlock(ivars->msiLock);
+}
 
-        dmaSegmentCount = 1;
-        dmaFlags = kIOMemoryDirectionInOut;
+// read the loop status of one direction and fold it into its progress block,
+// called with the ring lock held and the progress sequence open
+static uint64_t ServiceDMADirection(IOPCIDevice* pciDevice, DMAChannel* channel, bool is_reader, uint64_t time, uint64_t* delta)
+{
+    DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+    DMAProgress* progress = ring->progress;
+    DMALoopStatus status;
+    uint64_t hwcount, total;
+
+    pciDevice->MemoryRead32(0, DMARegister(channel, is_reader ? PCIE_DMA_READER_TABLE_LOOP_STATUS_OFFSET : PCIE_DMA_WRITER_TABLE_LOOP_STATUS_OFFSET), &status.raw);
+    hwcount = litepcie_dma_loop_status_count(status.raw, ring->bufferCount);
+    *delta = litepcie_dma_count_delta(ring->hwCountPrev, hwcount, ring->bufferCount);
+    total = progress->countTotal + *delta;
+    litepcie_dma_stats_service(ring->stats, *delta, ring->bufferSize, ring->bufferCount, ring->hwCountPrev > hwcount);
+    if (litepcie_dma_host_overrun(ring->host, total, ring->bufferCount, is_reader)) {
+        ring->stats->heldOverruns += 1;
+    }
+    ring->hwCountPrev = hwcount;
+
+    litepcie_dma_progress_set_count(progress, total);
+    progress->lastIrqTime = AbsoluteToNanoseconds(time);
+    progress->irq.mmioReads += 1;
+
+    // two more reads, so only every LITEPCIE_DMA_LEVELS_INTERVAL_NS
+    if (litepcie_dma_levels_due(ring->levels, progress->lastIrqTime)) {
+        uint32_t fifoStatus = 0, tableLevel = 0;
+        pciDevice->MemoryRead32(0, DMARegister(channel, is_reader ? PCIE_DMA_BUFFERING_READER_FIFO_LEVEL_ADDR : PCIE_DMA_BUFFERING_WRITER_FIFO_LEVEL_ADDR), &fifoStatus);
+        pciDevice->MemoryRead32(0, DMARegister(channel, is_reader ? PCIE_DMA_READER_TABLE_LEVEL_OFFSET : PCIE_DMA_WRITER_TABLE_LEVEL_OFFSET), &tableLevel);
+        litepcie_dma_levels_sample(ring->levels, fifoStatus, tableLevel, progress->lastIrqTime);
+        progress->irq.mmioReads += 2;
+    }
 
-        ret = ivars->channel[chan_idx]->dmaWriterCommands[i]->PrepareForDMA(kIODMACommandPrepareForDMANoOptions,
-            ivars->channel[chan_idx]->dmaWriterBuffers[i],
-            0,
-            0,
-            &dmaFlags,
-            &dmaSegmentCount,
-            ivars->channel[chan_idx]->dmaWriterPhysicalSegments[i]);
-        ivars->channel[chan_idx]->dmaWriterBuffers[i]->SetLength(DMA_BUFFER_SIZE);
+    return total;
+}
 
-        for (int j = 0; j < DMA_BUFFER_SIZE; j += 1) {
-            reinterpret_cast<uint8_t*>(ivars->channel[chan_idx]->dmaWriterVirtualSegments[i]->address)[j] = i + 2;
-        }
+// only called with the direction stopped, so there is no interrupt side writer to race
+static void PublishDMAGeometry(DMARing* ring)
+{
+    litepcie_dma_progress_begin(ring->progress);
+    ring->progress->geometry.bufferSize = ring->bufferSize;
+    ring->progress->geometry.bufferCount = ring->bufferCount;
+    ring->progress->geometry.bufferPerIrq = ring->bufferPerIrq;
+    litepcie_dma_progress_end(ring->progress);
+}
+
+// hands back the ring's waiter if total satisfies it, called with the ring lock held
+static bool TakeDMAWaiter(DMARing* ring, uint64_t total, bool force, IOUserClient** client, OSAction** action)
+{
+    if (ring->waitAction == nullptr || (!force && total < ring->waitCount)) {
+        return false;
+    }
 
+    *client = ring->waitClient;
+    *action = ring->waitAction;
+    ring->waitClient = nullptr;
+    ring->waitAction = nullptr;
+    return true;
+}
+
+static void CompleteDMAWaiter(IOUserClient* client, OSAction* action, kern_return_t status, uint64_t total, uint64_t count)
+{
+    uint64_t asyncData[2] = { total, count };
+
+    client->AsyncCompletion(action, status, asyncData, 2);
+    action->release();
+    client->release();
+}
+
+// a cached table picks up at the descriptor the engine stopped on, the count
+// carries on from there so countTotal keeps naming the next buffer
+static void ResetDMAProgress(DMARing* ring, uint32_t fifoControl)
+{
+    if (ring->tableRewound) {
+        litepcie_dma_progress_begin(ring->progress);
+        litepcie_dma_progress_set_count(ring->progress, 0);
+        ring->progress->lastIrqTime = 0;
+        litepcie_dma_progress_end(ring->progress);
+        ring->hwCountPrev = 0;
+        ring->tableRewound = false;
+    }
+    ring->irqTimePrev = 0;
+    litepcie_dma_levels_reset(ring->levels, fifoControl);
+}
+
+kern_return_t litepcie::InitDMAChannel(int chan_idx)
+{
+    LogTrace("entered");
+
+    kern_return_t ret = kIOReturnSuccess;
+    DMAChannel* channel = ivars->channel[chan_idx];
+
+    channel->readerEnabled = false;
+    channel->writerEnabled = false;
+
+    channel->reader.lock = IOLockAlloc();
+    channel->writer.lock = IOLockAlloc();
+    if (channel->reader.lock == nullptr || channel->writer.lock == nullptr) {
+        LogError("failed to allocate ring locks");
+        return kIOReturnNoMemory;
+    }
+    litepcie_dma_coalesce_init(&channel->reader.coalesce, LITEPCIE_COALESCE_FIXED, 0);
+    litepcie_dma_coalesce_init(&channel->writer.coalesce, LITEPCIE_COALESCE_FIXED, 0);
+
+    IOAddressSegment dmaCountAddress;
+    ret = IOBufferMemoryDescriptor::Create(kIOMemoryDirectionInOut, sizeof(DMACounts), 0, &channel->dmaCountsBuffer);
+    if (ret != kIOReturnSuccess) {
+        LogError("failed to create counts buffer: 0x%08x", ret);
+        return ret;
+    }
+    channel->dmaCountsBuffer->SetLength(sizeof(DMACounts));
+    channel->dmaCountsBuffer->GetAddressRange(&dmaCountAddress);
+    channel->dmaCounts = reinterpret_cast<DMACounts*>(dmaCountAddress.address);
+    memset(channel->dmaCounts, 0, sizeof(DMACounts));
+    channel->dmaCounts->version = LITEPCIE_DMA_COUNTS_VERSION;
+    channel->dmaCounts->size = sizeof(DMACounts);
+    channel->reader.progress = &channel->dmaCounts->reader;
+    channel->writer.progress = &channel->dmaCounts->writer;
+    channel->reader.stats = &channel->dmaCounts->readerStats;
+    channel->writer.stats = &channel->dmaCounts->writerStats;
+    channel->reader.levels = &channel->dmaCounts->readerLevels;
+    channel->writer.levels = &channel->dmaCounts->writerLevels;
+
+    IOAddressSegment dmaHostAddress;
+    ret = IOBufferMemoryDescriptor::Create(kIOMemoryDirectionInOut, sizeof(DMAHost), 0, &channel->dmaHostBuffer);
+    if (ret != kIOReturnSuccess) {
+        LogError("failed to create host cursor buffer: 0x%08x", ret);
+        return ret;
+    }
+    channel->dmaHostBuffer->SetLength(sizeof(DMAHost));
+    channel->dmaHostBuffer->GetAddressRange(&dmaHostAddress);
+    channel->dmaHost = reinterpret_cast<DMAHost*>(dmaHostAddress.address);
+    memset(channel->dmaHost, 0, sizeof(DMAHost));
+    channel->dmaHost->version = LITEPCIE_DMA_HOST_VERSION;
+    channel->dmaHost->size = sizeof(DMAHost);
+    channel->reader.host = &channel->dmaHost->reader;
+    channel->writer.host = &channel->dmaHost->writer;
+
+    ret = CreateDMARing(ivars->pciDevice, &channel->reader, DMA_BUFFER_SIZE, DMA_BUFFER_COUNT, DMA_BUFFER_PER_IRQ, 1);
+    if (ret != kIOReturnSuccess) {
+        return ret;
+    }
+
+    ret = CreateDMARing(ivars->pciDevice, &channel->writer, DMA_BUFFER_SIZE, DMA_BUFFER_COUNT, DMA_BUFFER_PER_IRQ, 2);
+    if (ret != kIOReturnSuccess) {
+        return ret;
+    }
+
+    PublishDMAGeometry(&channel->reader);
+    PublishDMAGeometry(&channel->writer);
+
+    UpdateMSIEnable(ivars, (1 << channel->readerInterrupt) | (1 << channel->writerInterrupt), 0);
+
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie::SetDMAGeometry(int chan_idx, bool is_reader, uint32_t bufferSize, uint32_t bufferCount, uint32_t bufferPerIrq)
+{
+    LogTrace("entered");
+
+    kern_return_t ret = kIOReturnSuccess;
+    DMAChannel* channel = ivars->channel[chan_idx];
+    DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+
+    if (!litepcie_dma_geometry_valid(bufferSize, bufferCount, bufferPerIrq)) {
+        LogError("invalid geometry size %u count %u per irq %u", bufferSize, bufferCount, bufferPerIrq);
+        return kIOReturnBadArgument;
+    }
+
+    if (is_reader ? channel->readerEnabled : channel->writerEnabled) {
+        LogError("channel %i busy", chan_idx);
+        return kIOReturnBusy;
+    }
+
+    IOLockLock(ring->lock);
+    if (ring->bufferSize == bufferSize && ring->bufferCount == bufferCount) {
+        // same ring, only the IRQ stride changes
+        ring->bufferPerIrq = bufferPerIrq;
+    } else if (ring->mapClients != 0) {
+        LogError("channel %i ring mapped by %u other clients", chan_idx, ring->mapClients);
+        IOLockUnlock(ring->lock);
+        return kIOReturnBusy;
+    } else {
+        ring->tableValid = false;
+        ReleaseDMARing(ring);
+        ret = CreateDMARing(ivars->pciDevice, ring, bufferSize, bufferCount, bufferPerIrq, is_reader ? 1 : 2);
         if (ret != kIOReturnSuccess) {
-            Log("failed to prepare dma with error: 0x%08x", ret);
-            return ret;
+            kern_return_t fallback;
+
+            ReleaseDMARing(ring);
+            // fall back to the defaults so the channel stays usable
+            fallback = CreateDMARing(ivars->pciDevice, ring, DMA_BUFFER_SIZE, DMA_BUFFER_COUNT, DMA_BUFFER_PER_IRQ, is_reader ? 1 : 2);
+            if (fallback != kIOReturnSuccess) {
+                LogError("channel %i has no dma ring: 0x%08x", chan_idx, fallback);
+                // an empty geometry tells clients, a null command keeps the engine off it
+                ReleaseDMARing(ring);
+                ring->bufferSize = 0;
+                ring->bufferCount = 0;
+                ring->bufferPerIrq = 0;
+            }
         }
     }
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_ENABLE_ADDR), (1 << ivars->channel[chan_idx]->readerInterrupt) | (1 << ivars->channel[chan_idx]->writerInterrupt));
+    PublishDMAGeometry(ring);
+    IOLockUnlock(ring->lock);
 
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
+kern_return_t litepcie::SetDMACoalesce(int chan_idx, bool is_reader, uint32_t mode, uint32_t bufferPerIrq, uint32_t latencyUs)
+{
+    LogTrace("entered");
+
+    DMAChannel* channel = ivars->channel[chan_idx];
+    DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+
+    if (!litepcie_dma_coalesce_valid(mode, latencyUs) || bufferPerIrq > ring->bufferCount) {
+        LogError("invalid coalescing mode %u per irq %u latency %u us", mode, bufferPerIrq, latencyUs);
+        return kIOReturnBadArgument;
+    }
+
+    // the stride is baked into the table, applied on the next start
+    if (is_reader ? channel->readerEnabled : channel->writerEnabled) {
+        LogError("channel %i busy", chan_idx);
+        return kIOReturnBusy;
+    }
+
+    if (bufferPerIrq != 0) {
+        ring->bufferPerIrq = bufferPerIrq;
+        PublishDMAGeometry(ring);
+    }
+    litepcie_dma_coalesce_init(&ring->coalesce, mode, latencyUs);
+
+    LogTrace("finished");
+    return kIOReturnSuccess;
+}
+
 kern_return_t litepcie::SetupDMAReaderChannel(int chan_idx)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_ENABLE_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_RESET_ADDR), 1);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_LOOP_PROG_N_ADDR), 0);
+    DMAChannel* channel = ivars->channel[chan_idx];
+    DMARing* ring = &channel->reader;
+    uint32_t stride = litepcie_dma_coalesce_stride(&ring->coalesce, ring->bufferPerIrq);
+
+    // a failed SetDMAGeometry left nothing to point the table at
+    if (ring->command == nullptr) {
+        LogError("channel %i has no reader ring", chan_idx);
+        return kIOReturnNotReady;
+    }
 
-    for (int i = 0; i < DMA_BUFFER_COUNT; i += 1) {
+    // 3 writes per descriptor, only when the table changed. Reusing it relies
+    // on the gateware keeping a looping table while ENABLE is low, check that
+    // it still holds every descriptor rather than trusting the version
+    if (ring->tableValid && ring->tableStride == stride) {
+        uint32_t level = 0;
+        ivars->pciDevice->MemoryRead32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_LEVEL_OFFSET), &level);
+        if (level == ring->bufferCount) {
+            LogTrace("table cached");
+            return ret;
+        }
+        Log("reader table not kept across stop (level %u of %u), rewriting", level, ring->bufferCount);
+    }
+
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_ENABLE_OFFSET), 0);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_FLUSH_OFFSET), 1);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET), 0);
+
+    for (uint32_t i = 0; i < ring->bufferCount; i += 1) {
         DMADescriptor desc;
-        uint64_t readerAddress = ivars->channel[chan_idx]->dmaReaderPhysicalSegments[i]->address;
+        uint64_t readerAddress = ring->busAddresses[i];
         uint32_t lsb = (readerAddress >> 0) & 0xFFFF'FFFF;
         uint32_t msb = (readerAddress >> 32) & 0xFFFF'FFFF;
         desc.lsb = lsb;
         desc.config.reg.last = 1;
-        desc.config.reg.length = DMA_BUFFER_SIZE;
-        desc.config.reg.disableIRQ = (((i + 1) % DMA_BUFFER_PER_IRQ) == 0) ? 0 : 1; // set bit on when buffer idx of increments of DMA_BUFFER_PER_IRQ
+        desc.config.reg.length = ring->bufferSize;
+        desc.config.reg.disableIRQ = litepcie_dma_desc_irq(i, stride) ? 0 : 1; // set bit on when buffer idx of increments of bufferPerIrq
 
-        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_VALUE_ADDR), desc.config.raw);
-        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_VALUE_ADDR) + 4, lsb);
-        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_WE_ADDR), msb);
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_VALUE_OFFSET), desc.config.raw);
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_VALUE_OFFSET) + 4, lsb);
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_WE_OFFSET), msb);
 
         //        Log("SetupDMAReaderChannel() %i addr 0x%llx lsb 0x%x msb 0x%x", i, readerAddress, lsb, msb);
         //        IOSleep(10);
     }
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_LOOP_PROG_N_ADDR), 1);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET), 1);
+
+    ring->tableValid = true;
+    ring->tableRewound = true;
+    ring->tableStride = stride;
 
     //    uint32_t level = 0;
-    //    ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_LEVEL_ADDR), &level);
+    //    ivars->pciDevice->MemoryRead32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_LEVEL_OFFSET), &level);
     //    Log("level 0x%x", level);
 
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie::SetupDMAWriterChannel(int chan_idx)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_ENABLE_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_RESET_ADDR), 1);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_LOOP_PROG_N_ADDR), 0);
+    DMAChannel* channel = ivars->channel[chan_idx];
+    DMARing* ring = &channel->writer;
+    uint32_t stride = litepcie_dma_coalesce_stride(&ring->coalesce, ring->bufferPerIrq);
+
+    // a failed SetDMAGeometry left nothing to point the table at
+    if (ring->command == nullptr) {
+        LogError("channel %i has no writer ring", chan_idx);
+        return kIOReturnNotReady;
+    }
+
+    // 3 writes per descriptor, only when the table changed. Reusing it relies
+    // on the gateware keeping a looping table while ENABLE is low, check that
+    // it still holds every descriptor rather than trusting the version
+    if (ring->tableValid && ring->tableStride == stride) {
+        uint32_t level = 0;
+        ivars->pciDevice->MemoryRead32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_LEVEL_OFFSET), &level);
+        if (level == ring->bufferCount) {
+            LogTrace("table cached");
+            return ret;
+        }
+        Log("writer table not kept across stop (level %u of %u), rewriting", level, ring->bufferCount);
+    }
+
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_ENABLE_OFFSET), 0);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET), 1);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET), 0);
 
-    for (int i = 0; i < DMA_BUFFER_COUNT; i += 1) {
+    for (uint32_t i = 0; i < ring->bufferCount; i += 1) {
         DMADescriptor desc;
-        uint64_t writerAddress = ivars->channel[chan_idx]->dmaWriterPhysicalSegments[i]->address;
+        uint64_t writerAddress = ring->busAddresses[i];
         uint32_t lsb = (writerAddress >> 0) & 0xFFFF'FFFF;
         uint32_t msb = (writerAddress >> 32) & 0xFFFF'FFFF;
         desc.lsb = lsb;
         desc.config.reg.last = 1;
-        desc.config.reg.length = DMA_BUFFER_SIZE;
-        desc.config.reg.disableIRQ = (((i + 1) % DMA_BUFFER_PER_IRQ) == 0) ? 0 : 1; // set bit on when buffer idx of increments of DMA_BUFFER_PER_IRQ
+        desc.config.reg.length = ring->bufferSize;
+        desc.config.reg.disableIRQ = litepcie_dma_desc_irq(i, stride) ? 0 : 1; // set bit on when buffer idx of increments of bufferPerIrq
 
-        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_VALUE_ADDR), desc.config.raw);
-        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_VALUE_ADDR) + 4, lsb);
-        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_WE_ADDR), msb);
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_VALUE_OFFSET), desc.config.raw);
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_VALUE_OFFSET) + 4, lsb);
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_WE_OFFSET), msb);
 
         //        Log("SetupDMAWriterChannel() %i addr 0x%llx lsb 0x%x msb 0x%x", i, writerAddress, lsb, msb);
         //        IOSleep(10);
     }
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_LOOP_PROG_N_ADDR), 1);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET), 1);
+
+    ring->tableValid = true;
+    ring->tableRewound = true;
+    ring->tableStride = stride;
 
     //    uint32_t level = 0;
-    //    ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_LEVEL_ADDR), &level);
+    //    ivars->pciDevice->MemoryRead32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_LEVEL_OFFSET), &level);
     //    Log("SetupDMAWriterChannel() level 0x%x", level);
 
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
@@ -233,205 +567,674 @@ bool litepcie::IsDMAWriterChannelEnabled(int chan_idx)
 
 kern_return_t litepcie::StartDMAReaderChannel(int chan_idx, bool loop)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->channel[chan_idx]->dmaCounts->hwReaderCountTotal = 0;
-    ivars->channel[chan_idx]->dmaCounts->hwReaderCountPrev = 0;
+    DMAChannel* channel = ivars->channel[chan_idx];
+    uint32_t fifoControl = 0;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_LOOP_PROG_N_ADDR), loop ? 1 : 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_ENABLE_ADDR), 1);
-    
-    ivars->channel[chan_idx]->readerEnabled = true;
+    ivars->pciDevice->MemoryRead32(0, DMARegister(channel, PCIE_DMA_BUFFERING_READER_FIFO_DEPTH_ADDR), &fifoControl);
+    ResetDMAProgress(&channel->reader, fifoControl);
+    litepcie_dma_coalesce_restart(&channel->reader.coalesce);
+
+    // without the loop the engine consumes the table
+    channel->reader.tableValid = loop;
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_TABLE_LOOP_PROG_N_OFFSET), loop ? 1 : 0);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_ENABLE_OFFSET), 1);
+
+    channel->readerEnabled = true;
+    channel->readerPaused = false;
 
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie::StartDMAWriterChannel(int chan_idx, bool loop)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->channel[chan_idx]->dmaCounts->hwWriterCountTotal = 0;
-    ivars->channel[chan_idx]->dmaCounts->hwWriterCountPrev = 0;
+    DMAChannel* channel = ivars->channel[chan_idx];
+    uint32_t fifoControl = 0;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_LOOP_PROG_N_ADDR), loop ? 1 : 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_ENABLE_ADDR), 1);
-    
-    ivars->channel[chan_idx]->writerEnabled = true;
+    ivars->pciDevice->MemoryRead32(0, DMARegister(channel, PCIE_DMA_BUFFERING_WRITER_FIFO_DEPTH_ADDR), &fifoControl);
+    ResetDMAProgress(&channel->writer, fifoControl);
+    litepcie_dma_coalesce_restart(&channel->writer.coalesce);
+
+    // without the loop the engine consumes the table
+    channel->writer.tableValid = loop;
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_TABLE_LOOP_PROG_N_OFFSET), loop ? 1 : 0);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_ENABLE_OFFSET), 1);
 
-    Log("finished");
+    channel->writerEnabled = true;
+    channel->writerPaused = false;
+
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie::StopDMAReaderChannel(int chan_idx)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_TABLE_LOOP_PROG_N_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(PCIE_DMA_READER_TABLE_FLUSH_OFFSET), 1);
+    DMAChannel* channel = ivars->channel[chan_idx];
 
-    IOSleep(1);
+    // gating the engine leaves the looping table intact for the next start,
+    // SetupDMAReaderChannel flushes it when it has to be rewritten or
+    // the gateware dropped it. A restart on the kept table resumes at the
+    // descriptor after the last one completed, not at buffer 0
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_ENABLE_OFFSET), 0);
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_ENABLE_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(PCIE_DMA_READER_TABLE_FLUSH_OFFSET), 1);
-    
-    ivars->channel[chan_idx]->readerEnabled = false;
+    channel->readerEnabled = false;
+    channel->readerPaused = false;
 
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie::StopDMAWriterChannel(int chan_idx)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_TABLE_LOOP_PROG_N_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET), 1);
+    DMAChannel* channel = ivars->channel[chan_idx];
 
-    IOSleep(1);
+    // gating the engine leaves the looping table intact for the next start,
+    // SetupDMAWriterChannel flushes it when it has to be rewritten or
+    // the gateware dropped it. A restart on the kept table resumes at the
+    // descriptor after the last one completed, not at buffer 0
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_ENABLE_OFFSET), 0);
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_ENABLE_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(PCIE_DMA_WRITER_TABLE_FLUSH_OFFSET), 1);
-    
-    ivars->channel[chan_idx]->writerEnabled = false;
+    channel->writerEnabled = false;
+    channel->writerPaused = false;
 
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie::StopDMAChannel(int chan_idx)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_READER_ENABLE_ADDR), 0);
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_WRITER_ENABLE_ADDR), 0);
-    
-    ivars->channel[chan_idx]->readerEnabled = false;
-    ivars->channel[chan_idx]->writerEnabled = false;
+    DMAChannel* channel = ivars->channel[chan_idx];
+
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_READER_ENABLE_OFFSET), 0);
+    ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, PCIE_DMA_WRITER_ENABLE_OFFSET), 0);
 
-    Log("finished");
+    channel->readerEnabled = false;
+    channel->writerEnabled = false;
+    channel->readerPaused = false;
+    channel->writerPaused = false;
+
+    LogTrace("finished");
     return ret;
 }
 
-void litepcie::CleanupDMAChannel(int chan_idx)
+kern_return_t litepcie::PauseDMAChannel(int chan_idx, bool is_reader, bool pause)
 {
-    Log("entered");
-    StopDMAChannel(chan_idx);
-    //    StopDMAReaderChannel(chan_idx);
-    //    StopDMAWriterChannel(chan_idx);
+    LogTrace("entered");
+
+    DMAChannel* channel = ivars->channel[chan_idx];
+    bool* paused = is_reader ? &channel->readerPaused : &channel->writerPaused;
+
+    if (!(is_reader ? channel->readerEnabled : channel->writerEnabled)) {
+        LogError("channel %i not enabled", chan_idx);
+        return kIOReturnNotReady;
+    }
 
-    Log("deleting misc descriptor objects");
-    for (int i = 0; i < DMA_BUFFER_COUNT; i += 1) {
-        ivars->channel[chan_idx]->dmaWriterCommands[i]->CompleteDMA(kIODMACommandCompleteDMANoOptions);
-        ivars->channel[chan_idx]->dmaReaderCommands[i]->CompleteDMA(kIODMACommandCompleteDMANoOptions);
+    // one write either way, no flush, no reset of the counts
+    if (*paused != pause) {
+        ivars->pciDevice->MemoryWrite32(0, DMARegister(channel, is_reader ? PCIE_DMA_READER_ENABLE_OFFSET : PCIE_DMA_WRITER_ENABLE_OFFSET), pause ? 0 : 1);
+        *paused = pause;
+    }
 
-        delete ivars->channel[chan_idx]->dmaWriterVirtualSegments[i];
-        delete ivars->channel[chan_idx]->dmaWriterPhysicalSegments[i];
-        delete ivars->channel[chan_idx]->dmaReaderVirtualSegments[i];
-        delete ivars->channel[chan_idx]->dmaReaderPhysicalSegments[i];
+    LogTrace("finished");
+    return kIOReturnSuccess;
+}
 
-        OSSafeReleaseNULL(ivars->channel[chan_idx]->dmaWriterCommands[i]);
-        OSSafeReleaseNULL(ivars->channel[chan_idx]->dmaReaderCommands[i]);
+kern_return_t litepcie::SetDMAWaiter(int chan_idx, bool is_reader, uint64_t count, IOUserClient* client, OSAction* action)
+{
+    DMAChannel* channel = ivars->channel[chan_idx];
+    DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+    IOUserClient* oldClient = nullptr;
+    OSAction* oldAction = nullptr;
+    uint64_t oldCount = 0, total;
+    bool aborted, done;
+
+    client->retain();
+    action->retain();
+
+    IOLockLock(ring->lock);
+    oldCount = ring->waitCount;
+    aborted = TakeDMAWaiter(ring, 0, true, &oldClient, &oldAction);
+    total = litepcie_dma_progress_count(ring->progress);
+    done = total >= count;
+    if (!done) {
+        ring->waitClient = client;
+        ring->waitAction = action;
+        ring->waitCount = count;
+    }
+    IOLockUnlock(ring->lock);
+
+    if (aborted) {
+        CompleteDMAWaiter(oldClient, oldAction, kIOReturnAborted, total, oldCount);
+    }
 
-        OSSafeReleaseNULL(ivars->channel[chan_idx]->dmaWriterBuffers[i]);
-        OSSafeReleaseNULL(ivars->channel[chan_idx]->dmaReaderBuffers[i]);
+    // already there, don't make the client wait for the next IRQ
+    if (done) {
+        CompleteDMAWaiter(client, action, kIOReturnSuccess, total, count);
     }
 
-    Log("deleting misc descriptor arrays");
-    IODelete(ivars->channel[chan_idx]->dmaWriterCommands, IODMACommand*, DMA_BUFFER_COUNT);
-    IODelete(ivars->channel[chan_idx]->dmaWriterBuffers, IOBufferMemoryDescriptor*, DMA_BUFFER_COUNT);
-    IODelete(ivars->channel[chan_idx]->dmaWriterVirtualSegments, IOAddressSegment*, DMA_BUFFER_COUNT);
-    IODelete(ivars->channel[chan_idx]->dmaWriterPhysicalSegments, IOAddressSegment*, DMA_BUFFER_COUNT);
+    return kIOReturnSuccess;
+}
 
-    IODelete(ivars->channel[chan_idx]->dmaReaderCommands, IODMACommand*, DMA_BUFFER_COUNT);
-    IODelete(ivars->channel[chan_idx]->dmaReaderBuffers, IOBufferMemoryDescriptor*, DMA_BUFFER_COUNT);
-    IODelete(ivars->channel[chan_idx]->dmaReaderVirtualSegments, IOAddressSegment*, DMA_BUFFER_COUNT);
-    IODelete(ivars->channel[chan_idx]->dmaReaderPhysicalSegments, IOAddressSegment*, DMA_BUFFER_COUNT);
+void litepcie::CancelDMAWaiters(IOUserClient* client)
+{
+    for (int i = 0; i < DMA_CHANNEL_COUNT; i += 1) {
+        DMAChannel* channel = ivars->channel[i];
+        if (channel == nullptr) {
+            continue;
+        }
+
+        for (int is_reader = 0; is_reader < 2; is_reader += 1) {
+            DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+            IOUserClient* waitClient = nullptr;
+            OSAction* waitAction = nullptr;
+            uint64_t count = 0;
+            bool aborted = false;
+
+            if (ring->lock == nullptr) {
+                continue;
+            }
+
+            IOLockLock(ring->lock);
+            if (client == nullptr || ring->waitClient == client) {
+                count = ring->waitCount;
+                aborted = TakeDMAWaiter(ring, 0, true, &waitClient, &waitAction);
+            }
+            IOLockUnlock(ring->lock);
+
+            if (aborted) {
+                CompleteDMAWaiter(waitClient, waitAction, kIOReturnAborted, litepcie_dma_progress_count(ring->progress), count);
+            }
+        }
+    }
+}
+
+void litepcie::CleanupDMAChannel(int chan_idx)
+{
+    LogTrace("entered");
+    DMAChannel* channel = ivars->channel[chan_idx];
+
+    StopDMAChannel(chan_idx);
+    //    StopDMAReaderChannel(chan_idx);
+    //    StopDMAWriterChannel(chan_idx);
+
+    LogDebug("releasing dma rings");
+    ReleaseDMARing(&channel->writer);
+    ReleaseDMARing(&channel->reader);
+    if (channel->writer.lock != nullptr) {
+        IOLockFree(channel->writer.lock);
+        channel->writer.lock = nullptr;
+    }
+    if (channel->reader.lock != nullptr) {
+        IOLockFree(channel->reader.lock);
+        channel->reader.lock = nullptr;
+    }
+    OSSafeReleaseNULL(channel->dmaCountsBuffer);
+    OSSafeReleaseNULL(channel->dmaHostBuffer);
 
     IOSleep(100);
 
-    Log("finished");
+    ivars->channel[chan_idx] = nullptr;
+    delete channel;
+
+    LogTrace("finished");
 }
 
 kern_return_t litepcie::CreateReaderBufferDescriptor(int chan_idx, IOMemoryDescriptor** buffer)
 {
-    kern_return_t ret = kIOReturnError;
-    Log("entered");
+    LogTrace("entered");
 
-    IOMemoryDescriptor* tmp_buffers[32];
+    DMARing* ring = &ivars->channel[chan_idx]->reader;
 
-    // this is dumb, due to a bug with large buffers we have to create a large pool of temporary buffers for the descriptor
-    for (int i = 0; i < DMA_BUFFER_COUNT / 32; i += 1) {
-        IOBufferMemoryDescriptor::CreateWithMemoryDescriptors(kIOMemoryDirectionInOut, 32, (IOMemoryDescriptor**)(&ivars->channel[chan_idx]->dmaReaderBuffers[i * 32]), (IOMemoryDescriptor**)&tmp_buffers[i]);
+    IOLockLock(ring->lock);
+    if (ring->buffer == nullptr) {
+        IOLockUnlock(ring->lock);
+        return kIOReturnNotReady;
     }
 
-    if (__builtin_available(driverkit 20.0, *)) {
-        ret = IOBufferMemoryDescriptor::CreateWithMemoryDescriptors(kIOMemoryDirectionInOut, DMA_BUFFER_COUNT / 32, (IOMemoryDescriptor**)tmp_buffers, buffer);
-    } else {
-        // Fallback on earlier versions not possible
-    }
+    // the whole ring is one buffer, hand it out as is
+    ring->buffer->retain();
+    *buffer = ring->buffer;
+    ring->mapClients += 1;
+    IOLockUnlock(ring->lock);
 
-    Log("finished");
-    return ret;
+    LogTrace("finished");
+    return kIOReturnSuccess;
 }
 
 kern_return_t litepcie::CreateWriterBufferDescriptor(int chan_idx, IOMemoryDescriptor** buffer)
 {
-    kern_return_t ret = kIOReturnError;
-    Log("entered");
+    LogTrace("entered");
 
-    IOMemoryDescriptor* tmp_buffers[32];
+    DMARing* ring = &ivars->channel[chan_idx]->writer;
 
-    // this is dumb, due to a bug with large buffers we have to create a large pool of temporary buffers for the descriptor
-    for (int i = 0; i < DMA_BUFFER_COUNT / 32; i += 1) {
-        IOBufferMemoryDescriptor::CreateWithMemoryDescriptors(kIOMemoryDirectionInOut, 32, (IOMemoryDescriptor**)(&ivars->channel[chan_idx]->dmaWriterBuffers[i * 32]), (IOMemoryDescriptor**)&tmp_buffers[i]);
+    IOLockLock(ring->lock);
+    if (ring->buffer == nullptr) {
+        IOLockUnlock(ring->lock);
+        return kIOReturnNotReady;
     }
 
-    if (__builtin_available(driverkit 20.0, *)) {
-        ret = IOBufferMemoryDescriptor::CreateWithMemoryDescriptors(kIOMemoryDirectionInOut, DMA_BUFFER_COUNT / 32, (IOMemoryDescriptor**)tmp_buffers, buffer);
-    } else {
-        // Fallback on earlier versions not possible
+    // the whole ring is one buffer, hand it out as is
+    ring->buffer->retain();
+    *buffer = ring->buffer;
+    ring->mapClients += 1;
+    IOLockUnlock(ring->lock);
+
+    LogTrace("finished");
+    return kIOReturnSuccess;
+}
+
+// a user client dropped its descriptor of the ring
+void litepcie::ReleaseDMABufferDescriptor(int chan_idx, bool is_reader)
+{
+    DMAChannel* channel = ivars->channel[chan_idx];
+
+    if (channel == nullptr) {
+        return;
     }
 
-    Log("finished");
-    return ret;
+    DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+
+    IOLockLock(ring->lock);
+    if (ring->mapClients != 0) {
+        ring->mapClients -= 1;
+    }
+    IOLockUnlock(ring->lock);
 }
 
 kern_return_t litepcie::GetDmaCountDescriptor(int chan_idx, IOMemoryDescriptor** buffer)
 {
     kern_return_t ret = kIOReturnError;
-    Log("entered");
+    LogTrace("entered");
     
     ret = IOBufferMemoryDescriptor::CreateWithMemoryDescriptors(kIOMemoryDirectionInOut, 1, (IOMemoryDescriptor**)&ivars->channel[chan_idx]->dmaCountsBuffer, buffer);
     
-    Log("finished");
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie::GetDmaHostDescriptor(int chan_idx, IOMemoryDescriptor** buffer)
+{
+    kern_return_t ret = kIOReturnError;
+    LogTrace("entered");
+
+    ret = IOBufferMemoryDescriptor::CreateWithMemoryDescriptors(kIOMemoryDirectionInOut, 1, (IOMemoryDescriptor**)&ivars->channel[chan_idx]->dmaHostBuffer, buffer);
+
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie::CopyCsrDescriptor(uint32_t window, IOMemoryDescriptor** memory)
+{
+    kern_return_t ret = kIOReturnSuccess;
+    IOMemoryDescriptor* bar = nullptr;
+    IOSubMemoryDescriptor* sub = nullptr;
+    uint64_t barLength = 0;
+    uint32_t offset;
+    uint32_t length;
+    LogTrace("entered");
+
+    if (window >= LITEPCIE_CSR_WINDOW_COUNT) {
+        LogError("csr window %u out of range", window);
+        return kIOReturnBadArgument;
+    }
+
+    ret = ivars->pciDevice->_CopyDeviceMemoryWithIndex(0, &bar, this);
+    if (ret != kIOReturnSuccess || bar == nullptr) {
+        LogError("_CopyDeviceMemoryWithIndex failed: 0x%x", ret);
+        return ret != kIOReturnSuccess ? ret : kIOReturnNoMemory;
+    }
+
+    if (window == LITEPCIE_CSR_WINDOW_BAR) {
+        *memory = bar;
+        goto Exit;
+    }
+
+    if (litepcie_csr_windows[window].size == 0) {
+        LogError("csr window %u not in this SoC", window);
+        ret = kIOReturnUnsupported;
+        goto Exit;
+    }
+
+    // whole pages only, the client finds the block at base & (align - 1)
+    offset = litepcie_csr_window_map_offset(litepcie_csr_windows[window].base);
+    length = litepcie_csr_window_map_length(litepcie_csr_windows[window].base, litepcie_csr_windows[window].size);
+    bar->GetLength(&barLength);
+    if (offset + length > barLength) {
+        LogError("csr window %u beyond BAR0 (0x%llx)", window, barLength);
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = IOSubMemoryDescriptor::Create(kIOMemoryDirectionInOut, bar, offset, length, &sub);
+    if (ret != kIOReturnSuccess) {
+        LogError("IOSubMemoryDescriptor::Create failed: 0x%x", ret);
+        goto Exit;
+    }
+    *memory = sub;
+
+Exit:
+    if (window != LITEPCIE_CSR_WINDOW_BAR || ret != kIOReturnSuccess)
+        OSSafeReleaseNULL(bar);
+    LogTrace("finished");
+    return ret;
+}
+
+void litepcie::CountExternalMethod(uint64_t selector)
+{
+    if (selector < LITEPCIE_STATS_SELECTORS) {
+        __atomic_fetch_add(&ivars->methodCalls[selector], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void litepcie::CopyStats(LitePCIeStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->version = LITEPCIE_STATS_VERSION;
+    stats->size = sizeof(*stats);
+    stats->time = AbsoluteToNanoseconds(mach_absolute_time());
+    stats->sources = ivars->irqRoute.sources;
+
+    // written by their own queues, a torn snapshot across counters is fine
+    for (uint32_t i = 0; i < LITEPCIE_STATS_SELECTORS; i++) {
+        stats->calls[i] = __atomic_load_n(&ivars->methodCalls[i], __ATOMIC_RELAXED);
+    }
+    for (uint32_t i = 0; i < LITEPCIE_STATS_SOURCES; i++) {
+        stats->interrupts[i] = __atomic_load_n(&ivars->interruptCount[i], __ATOMIC_RELAXED);
+        stats->vectorReads[i] = __atomic_load_n(&ivars->interruptMmioReads[i], __ATOMIC_RELAXED);
+    }
+}
+
+kern_return_t litepcie::CopyDMACounts(int chan_idx, DMACounts* counts)
+{
+    if (chan_idx < 0 || chan_idx >= DMA_CHANNEL_COUNT || ivars->channel[chan_idx] == nullptr) {
+        return kIOReturnBadArgument;
+    }
+
+    litepcie_dma_counts_read(ivars->channel[chan_idx]->dmaCounts, counts);
+    return kIOReturnSuccess;
+}
+
+#ifdef CSR_FLASH_SPI_MOSI_ADDR
+static void FlashSpiLoad(IOPCIDevice* pciDevice, uint64_t mosi)
+{
+    pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_FLASH_SPI_MOSI_ADDR), (uint32_t)(mosi >> 32));
+    pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_FLASH_SPI_MOSI_ADDR) + 4, (uint32_t)mosi);
+}
+
+// shifts out whatever MOSI holds
+static kern_return_t FlashSpiShift(IOPCIDevice* pciDevice, uint32_t bits, uint64_t* miso)
+{
+    uint32_t status = 0, lsb, msb;
+
+    pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_FLASH_SPI_CONTROL_ADDR), SPI_CTRL_START | (bits * SPI_CTRL_LENGTH));
+    for (int i = 0; i < SPI_TIMEOUT; i += 1) {
+        pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_FLASH_SPI_STATUS_ADDR), &status);
+        if (status & SPI_STATUS_DONE) {
+            break;
+        }
+        IODelay(1);
+    }
+    if (!(status & SPI_STATUS_DONE)) {
+        return kIOReturnTimeout;
+    }
+
+    if (miso != nullptr) {
+        pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_FLASH_SPI_MISO_ADDR), &msb);
+        pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_FLASH_SPI_MISO_ADDR) + 4, &lsb);
+        *miso = ((uint64_t)msb << 32) | lsb;
+    }
+    return kIOReturnSuccess;
+}
+
+static kern_return_t FlashSpiTransfer(IOPCIDevice* pciDevice, uint32_t bits, uint64_t mosi, uint64_t* miso)
+{
+    FlashSpiLoad(pciDevice, mosi);
+    return FlashSpiShift(pciDevice, bits, miso);
+}
+
+#ifdef CSR_FLASH_CS_N_OUT_ADDR
+static void FlashSpiSelect(IOPCIDevice* pciDevice, bool select)
+{
+    pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_FLASH_CS_N_OUT_ADDR), select ? 0 : 1);
+}
+
+// a whole command under one chip select: the header transfer, then data in or out
+static kern_return_t FlashSpiCommand(IOPCIDevice* pciDevice, uint32_t headerBits, uint64_t header,
+                                     const uint8_t* out, uint8_t* in, uint32_t size)
+{
+    kern_return_t ret;
+    uint64_t miso = 0;
+
+    FlashSpiSelect(pciDevice, true);
+    ret = FlashSpiTransfer(pciDevice, headerBits, header, nullptr);
+    for (uint32_t done = 0; ret == kIOReturnSuccess && done < size;) {
+        uint32_t count = size - done < LITEPCIE_FLASH_SPI_MAX_BYTES ? size - done : LITEPCIE_FLASH_SPI_MAX_BYTES;
+        // reads clock out zeros, MOSI only has to be cleared of the header once
+        if (out != nullptr || done == 0) {
+            FlashSpiLoad(pciDevice, out ? litepcie_flash_spi_pack(out + done, count) : 0);
+        }
+        ret = FlashSpiShift(pciDevice, count * 8, in ? &miso : nullptr);
+        if (in != nullptr) {
+            litepcie_flash_spi_unpack(miso, in + done, count);
+        }
+        done += count;
+    }
+    FlashSpiSelect(pciDevice, false);
+    return ret;
+}
+
+// polls of a millisecond or more sleep, shorter ones spin
+static kern_return_t FlashWaitReady(IOPCIDevice* pciDevice, uint64_t deadline, uint32_t pollUs)
+{
+    kern_return_t ret;
+    uint8_t status;
+
+    for (;;) {
+        ret = FlashSpiCommand(pciDevice, 8, litepcie_flash_spi_cmd(FLASH_RDSR, 0), nullptr, &status, 1);
+        if (ret != kIOReturnSuccess || !(status & FLASH_WIP)) {
+            return ret;
+        }
+        if (mach_absolute_time() > deadline) {
+            return kIOReturnTimeout;
+        }
+        if (pollUs >= 1000) {
+            IOSleep(pollUs / 1000);
+        } else {
+            IODelay(pollUs);
+        }
+    }
+}
+
+// commands start once the program before them is done, flash lock held
+static kern_return_t FlashSettle(litepcie_IVars* ivars)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    if (ivars->flashReadyDeadline != 0) {
+        ret = FlashWaitReady(ivars->pciDevice, ivars->flashReadyDeadline, 1);
+        ivars->flashReadyDeadline = 0;
+    }
     return ret;
 }
+#endif
+#endif
+
+kern_return_t litepcie::FlashTransfer(uint32_t bits, uint64_t mosi, uint64_t* miso)
+{
+#ifdef CSR_FLASH_SPI_MOSI_ADDR
+    kern_return_t ret;
+
+    IOLockLock(ivars->flashLock);
+    ret = FlashSpiTransfer(ivars->pciDevice, bits, mosi, miso);
+    IOLockUnlock(ivars->flashLock);
+    if (ret != kIOReturnSuccess) {
+        LogError("SPI transfer timed out");
+    }
+    return ret;
+#else
+    return kIOReturnUnsupported;
+#endif
+}
+
+kern_return_t litepcie::FlashProgram(uint32_t addr, const uint8_t* data, uint32_t size)
+{
+#if defined(CSR_FLASH_SPI_MOSI_ADDR) && defined(CSR_FLASH_CS_N_OUT_ADDR)
+    kern_return_t ret = kIOReturnSuccess;
+
+    if (size == 0 || size > LITEPCIE_FLASH_PROGRAM_MAX) {
+        return kIOReturnBadArgument;
+    }
+
+    IOLockLock(ivars->flashLock);
+    for (uint32_t done = 0; ret == kIOReturnSuccess && done < size;) {
+        uint32_t count = LITEPCIE_FLASH_PAGE_SIZE - ((addr + done) % LITEPCIE_FLASH_PAGE_SIZE);
+        if (count > size - done) {
+            count = size - done;
+        }
+
+        // the previous page programs while this one was copied in and queued
+        ret = FlashSettle(ivars);
+        if (ret == kIOReturnSuccess) {
+            ret = FlashSpiCommand(ivars->pciDevice, 8, litepcie_flash_spi_cmd(FLASH_WREN, 0), nullptr, nullptr, 0);
+        }
+        if (ret == kIOReturnSuccess) {
+            ret = FlashSpiCommand(ivars->pciDevice, 32, litepcie_flash_spi_cmd(FLASH_PP, addr + done), data + done, nullptr, count);
+            ivars->flashReadyDeadline = mach_absolute_time() + NanosecondsToAbsolute(LITEPCIE_FLASH_PROGRAM_TIMEOUT_US * 1000ULL);
+        }
+        done += count;
+    }
+    IOLockUnlock(ivars->flashLock);
+    if (ret != kIOReturnSuccess) {
+        LogError("program at 0x%x failed: 0x%x", addr, ret);
+    }
+    return ret;
+#else
+    return kIOReturnUnsupported;
+#endif
+}
+
+kern_return_t litepcie::FlashErase(uint32_t addr, uint8_t cmd)
+{
+#if defined(CSR_FLASH_SPI_MOSI_ADDR) && defined(CSR_FLASH_CS_N_OUT_ADDR)
+    kern_return_t ret;
+    uint64_t timeoutUs = cmd == FLASH_BE ? LITEPCIE_FLASH_CHIP_ERASE_TIMEOUT_US : LITEPCIE_FLASH_ERASE_TIMEOUT_US;
+    uint32_t pollUs = cmd == FLASH_BE ? FLASH_CHIP_ERASE_POLL_US : FLASH_ERASE_POLL_US;
+
+    if (litepcie_flash_erase_size(cmd) == 0) {
+        return kIOReturnBadArgument;
+    }
+
+    IOLockLock(ivars->flashLock);
+    ret = FlashSettle(ivars);
+    if (ret == kIOReturnSuccess) {
+        ret = FlashSpiCommand(ivars->pciDevice, 8, litepcie_flash_spi_cmd(FLASH_WREN, 0), nullptr, nullptr, 0);
+    }
+    if (ret == kIOReturnSuccess) {
+        ret = FlashSpiCommand(ivars->pciDevice, cmd == FLASH_BE ? 8 : 32, litepcie_flash_spi_cmd(cmd, addr), nullptr, nullptr, 0);
+    }
+    // milliseconds to minutes, sleep between polls instead of spinning
+    if (ret == kIOReturnSuccess) {
+        ret = FlashWaitReady(ivars->pciDevice, mach_absolute_time() + NanosecondsToAbsolute(timeoutUs * 1000), pollUs);
+    }
+    IOLockUnlock(ivars->flashLock);
+    if (ret != kIOReturnSuccess) {
+        LogError("erase 0x%x at 0x%x failed: 0x%x", cmd, addr, ret);
+    }
+    return ret;
+#else
+    return kIOReturnUnsupported;
+#endif
+}
+
+kern_return_t litepcie::FlashRead(uint32_t addr, uint8_t* data, uint32_t size)
+{
+#if defined(CSR_FLASH_SPI_MOSI_ADDR) && defined(CSR_FLASH_CS_N_OUT_ADDR)
+    kern_return_t ret;
+
+    IOLockLock(ivars->flashLock);
+    ret = FlashSettle(ivars);
+    if (ret == kIOReturnSuccess) {
+        ret = FlashSpiCommand(ivars->pciDevice, 40, litepcie_flash_spi_cmd(FLASH_FAST_READ, addr), nullptr, data, size);
+    }
+    IOLockUnlock(ivars->flashLock);
+    if (ret != kIOReturnSuccess) {
+        LogError("read at 0x%x failed: 0x%x", addr, ret);
+    }
+    return ret;
+#else
+    return kIOReturnUnsupported;
+#endif
+}
+
+kern_return_t litepcie::FlashCrc32(uint32_t addr, uint32_t size, uint32_t* crc)
+{
+#if defined(CSR_FLASH_SPI_MOSI_ADDR) && defined(CSR_FLASH_CS_N_OUT_ADDR)
+    kern_return_t ret;
+    uint8_t chunk[FLASH_CRC_CHUNK];
+    uint32_t sum = *crc;
+
+    if (size > LITEPCIE_FLASH_READ_MAX) {
+        return kIOReturnBadArgument;
+    }
+
+    // summed as it comes in, a fast read per chunk
+    IOLockLock(ivars->flashLock);
+    ret = FlashSettle(ivars);
+    for (uint32_t done = 0; ret == kIOReturnSuccess && done < size;) {
+        uint32_t count = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+        ret = FlashSpiCommand(ivars->pciDevice, 40, litepcie_flash_spi_cmd(FLASH_FAST_READ, addr + done), nullptr, chunk, count);
+        if (ret != kIOReturnSuccess) {
+            break;
+        }
+        sum = litepcie_crc32(sum, chunk, count);
+        done += count;
+    }
+    IOLockUnlock(ivars->flashLock);
+    if (ret != kIOReturnSuccess) {
+        LogError("CRC at 0x%x failed: 0x%x", addr, ret);
+        return ret;
+    }
+    *crc = sum;
+    return ret;
+#else
+    return kIOReturnUnsupported;
+#endif
+}
 
 bool litepcie::init(void)
 {
     bool result = false;
 
-    Log("entered");
+    LogTrace("entered");
 
     result = super::init();
     if (result != true) {
-        Log("super::init failed.");
+        LogError("super::init failed.");
         goto Exit;
     }
 
     ivars = IONewZero(litepcie_IVars, 1);
     if (ivars == nullptr) {
-        Log("failed to allocate memory for ivars");
+        LogError("failed to allocate memory for ivars");
         goto Exit;
     }
 
-    Log("finished.");
+    LogTrace("finished.");
     return true;
 
 Exit:
@@ -445,22 +1248,23 @@ IMPL(litepcie, Start)
     uint32_t buf[64] = { 0 };
 
     uint64_t interruptType = 0;
-    uint32_t msiInterruptIndex = 0;
-
-    OSAction* interruptOccuredAction;
+    int interruptIndex = 0;
+    int msiInterruptIndex[LITEPCIE_IRQ_MAX_SOURCES] = { 0 };
+    uint32_t msiVectorCount = 0;
+    OSAction* coalesceTimerAction = nullptr;
 
-    Log("entered");
+    LogTrace("entered");
 
     ret = super::Start(provider, SUPERDISPATCH);
     if (ret != kIOReturnSuccess) {
-        Log("super::Start failed with error: 0x%08x", ret);
+        LogError("super::Start failed with error: 0x%08x", ret);
         goto Exit;
     }
 
     // try to cast the provider object to a PCI device because thats what it should be
     ivars->pciDevice = OSDynamicCast(IOPCIDevice, provider);
     if (ivars->pciDevice == NULL) {
-        Log("failed to cast provider PCI device");
+        LogError("failed to cast provider PCI device");
         Stop(provider);
         ret = kIOReturnNoDevice;
         goto Exit;
@@ -471,7 +1275,7 @@ IMPL(litepcie, Start)
     // open the provider pci device
     ret = ivars->pciDevice->Open(this, 0);
     if (ret != kIOReturnSuccess) {
-        Log("provider PCI device could not be opened with error: 0x%08x", ret);
+        LogError("provider PCI device could not be opened with error: 0x%08x", ret);
         Stop(provider);
         goto Exit;
     }
@@ -509,54 +1313,130 @@ IMPL(litepcie, Start)
     ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_LEDS_BASE), buf + 3);
     Log("led: %x", buf[3]);
 
-    while ((ret = IOInterruptDispatchSource::GetInterruptType(ivars->pciDevice, msiInterruptIndex, &interruptType)) == kIOReturnSuccess) {
-        Log("checking interrupt: %i type: %llx", msiInterruptIndex, interruptType);
-        if ((interruptType & kIOInterruptTypePCIMessaged) != 0) {
-            break;
+    ivars->msiLock = IOLockAlloc();
+    if (ivars->msiLock == nullptr) {
+        LogError("failed to allocate msi lock");
+        Stop(provider);
+        ret = kIOReturnNoMemory;
+        goto Exit;
+    }
+
+    ivars->flashLock = IOLockAlloc();
+    if (ivars->flashLock == nullptr) {
+        LogError("failed to allocate flash lock");
+        Stop(provider);
+        ret = kIOReturnNoMemory;
+        goto Exit;
+    }
+
+    // collect the MSI/MSI-X vectors the host granted us
+    while (msiVectorCount < LITEPCIE_IRQ_MAX_SOURCES
+        && IOInterruptDispatchSource::GetInterruptType(ivars->pciDevice, interruptIndex, &interruptType) == kIOReturnSuccess) {
+        LogDebug("checking interrupt: %i type: %llx", interruptIndex, interruptType);
+        if ((interruptType & (kIOInterruptTypePCIMessaged | kIOInterruptTypePCIMessagedX)) != 0) {
+            msiInterruptIndex[msiVectorCount] = interruptIndex;
+            msiVectorCount += 1;
         }
-        msiInterruptIndex += 1;
+        interruptIndex += 1;
     }
 
+    if (litepcie_irq_route_build(&ivars->irqRoute, DMA_CHANNEL_COUNT, msiVectorCount, LITEPCIE_MSI_MULTI_VECTOR) != 0) {
+        LogError("failed to route %u msi vectors to %u channels", msiVectorCount, DMA_CHANNEL_COUNT);
+        Stop(provider);
+        ret = kIOReturnNoInterrupt;
+        goto Exit;
+    }
+    Log("%u msi vectors, %u interrupt sources (%s)", msiVectorCount, ivars->irqRoute.sources, ivars->irqRoute.shared ? "shared" : "per channel");
+
     ret = CopyDispatchQueue(kIOServiceDefaultQueueName, &(ivars->defaultDispatchQueue));
     if (ret != kIOReturnSuccess) {
-        Log("failed to copy queue with error: 0x%08x", ret);
+        LogError("failed to copy queue with error: 0x%08x", ret);
         Stop(provider);
         goto Exit;
     }
 
-    ret = IODispatchQueue::Create("interruptDispatchQueue", 0, 0, &ivars->interruptDispatchQueue);
+    ret = IODispatchQueue::Create("coalesceDispatchQueue", 0, 0, &ivars->coalesceDispatchQueue);
     if (ret != kIOReturnSuccess) {
-        Log("failed to create queue with error: 0x%08x", ret);
+        LogError("failed to create coalescing queue with error: 0x%08x", ret);
         Stop(provider);
         goto Exit;
     }
 
-    ret = IOInterruptDispatchSource::Create(ivars->pciDevice, msiInterruptIndex, ivars->interruptDispatchQueue, &(ivars->interruptSource));
+    ret = IOTimerDispatchSource::Create(ivars->coalesceDispatchQueue, &ivars->coalesceTimer);
     if (ret != kIOReturnSuccess) {
-        Log("failed to create interrupt dispatch source");
+        LogError("failed to create coalescing timer");
         Stop(provider);
         goto Exit;
     }
 
-    ret = CreateActionInterruptOccurred(sizeof(void*), &interruptOccuredAction);
+    ret = CreateActionCoalesceTimerOccurred(0, &coalesceTimerAction);
     if (ret != kIOReturnSuccess) {
-        Log("failed to create interrupt action");
+        LogError("failed to create coalescing timer action");
         Stop(provider);
         goto Exit;
     }
 
-    ret = ivars->interruptSource->SetHandler(interruptOccuredAction);
+    ret = ivars->coalesceTimer->SetHandler(coalesceTimerAction);
+    OSSafeReleaseNULL(coalesceTimerAction);
     if (ret != kIOReturnSuccess) {
-        Log("failed to set interrupt handler");
+        LogError("failed to set coalescing timer handler");
         Stop(provider);
-        return false;
+        goto Exit;
     }
 
-    ret = ivars->interruptSource->SetEnable(true);
+    ret = ivars->coalesceTimer->SetEnable(true);
     if (ret != kIOReturnSuccess) {
-        Log("failed to enable interrupt source");
+        LogError("failed to enable coalescing timer");
         Stop(provider);
-        return false;
+        goto Exit;
+    }
+
+    for (uint32_t i = 0; i < ivars->irqRoute.sources; i += 1) {
+        IODispatchQueueName queueName;
+        OSAction* interruptOccuredAction = nullptr;
+
+        if (ivars->irqRoute.mask[i] == 0) {
+            continue;
+        }
+
+        snprintf(queueName, sizeof(queueName), "interruptDispatchQueue%u", i);
+        ret = IODispatchQueue::Create(queueName, 0, 0, &ivars->interruptDispatchQueue[i]);
+        if (ret != kIOReturnSuccess) {
+            LogError("failed to create queue %u with error: 0x%08x", i, ret);
+            Stop(provider);
+            goto Exit;
+        }
+
+        ret = IOInterruptDispatchSource::Create(ivars->pciDevice, msiInterruptIndex[i], ivars->interruptDispatchQueue[i], &ivars->interruptSource[i]);
+        if (ret != kIOReturnSuccess) {
+            LogError("failed to create interrupt dispatch source %u", i);
+            Stop(provider);
+            goto Exit;
+        }
+
+        // the action reference tells the handler which source fired
+        ret = CreateActionInterruptOccurred(sizeof(uint32_t), &interruptOccuredAction);
+        if (ret != kIOReturnSuccess) {
+            LogError("failed to create interrupt action");
+            Stop(provider);
+            goto Exit;
+        }
+        *reinterpret_cast<uint32_t*>(interruptOccuredAction->GetReference()) = i;
+
+        ret = ivars->interruptSource[i]->SetHandler(interruptOccuredAction);
+        OSSafeReleaseNULL(interruptOccuredAction);
+        if (ret != kIOReturnSuccess) {
+            LogError("failed to set interrupt handler");
+            Stop(provider);
+            goto Exit;
+        }
+
+        ret = ivars->interruptSource[i]->SetEnable(true);
+        if (ret != kIOReturnSuccess) {
+            LogError("failed to enable interrupt source");
+            Stop(provider);
+            goto Exit;
+        }
     }
 
     IOSleep(10);
@@ -564,69 +1444,73 @@ IMPL(litepcie, Start)
     ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_DMA0_LOOPBACK_ENABLE_ADDR), 1);
 
 #ifdef CSR_PCIE_DMA0_BASE
-    ivars->channel[0] = new DMAChannel;
+    ivars->channel[0] = new DMAChannel();
     ivars->channel[0]->baseAddress = CSR_PCIE_DMA0_BASE;
     ivars->channel[0]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
     ivars->channel[0]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(0);
 #endif
     
 #ifdef CSR_PCIE_DMA1_BASE
-    ivars->channel[1] = new DMAChannel;
-    ivars->channel[1]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[1]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[1]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(1);
+    ivars->channel[1] = new DMAChannel();
+    ivars->channel[1]->baseAddress = CSR_PCIE_DMA1_BASE;
+    ivars->channel[1]->writerInterrupt = PCIE_DMA1_WRITER_INTERRUPT;
+    ivars->channel[1]->readerInterrupt = PCIE_DMA1_READER_INTERRUPT;
 #endif
     
 #ifdef CSR_PCIE_DMA2_BASE
-    ivars->channel[2] = new DMAChannel;
-    ivars->channel[2]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[2]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[2]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(2);
+    ivars->channel[2] = new DMAChannel();
+    ivars->channel[2]->baseAddress = CSR_PCIE_DMA2_BASE;
+    ivars->channel[2]->writerInterrupt = PCIE_DMA2_WRITER_INTERRUPT;
+    ivars->channel[2]->readerInterrupt = PCIE_DMA2_READER_INTERRUPT;
 #endif
     
 #ifdef CSR_PCIE_DMA3_BASE
-    ivars->channel[3] = new DMAChannel;
-    ivars->channel[3]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[3]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[3]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(3);
+    ivars->channel[3] = new DMAChannel();
+    ivars->channel[3]->baseAddress = CSR_PCIE_DMA3_BASE;
+    ivars->channel[3]->writerInterrupt = PCIE_DMA3_WRITER_INTERRUPT;
+    ivars->channel[3]->readerInterrupt = PCIE_DMA3_READER_INTERRUPT;
 #endif
     
 #ifdef CSR_PCIE_DMA4_BASE
-    ivars->channel[4] = new DMAChannel;
-    ivars->channel[4]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[4]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[4]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(4);
+    ivars->channel[4] = new DMAChannel();
+    ivars->channel[4]->baseAddress = CSR_PCIE_DMA4_BASE;
+    ivars->channel[4]->writerInterrupt = PCIE_DMA4_WRITER_INTERRUPT;
+    ivars->channel[4]->readerInterrupt = PCIE_DMA4_READER_INTERRUPT;
 #endif
     
 #ifdef CSR_PCIE_DMA5_BASE
-    ivars->channel[5] = new DMAChannel;
-    ivars->channel[5]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[5]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[5]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(5);
+    ivars->channel[5] = new DMAChannel();
+    ivars->channel[5]->baseAddress = CSR_PCIE_DMA5_BASE;
+    ivars->channel[5]->writerInterrupt = PCIE_DMA5_WRITER_INTERRUPT;
+    ivars->channel[5]->readerInterrupt = PCIE_DMA5_READER_INTERRUPT;
 #endif
     
 #ifdef CSR_PCIE_DMA6_BASE
-    ivars->channel[6] = new DMAChannel;
-    ivars->channel[6]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[6]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[6]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(6);
+    ivars->channel[6] = new DMAChannel();
+    ivars->channel[6]->baseAddress = CSR_PCIE_DMA6_BASE;
+    ivars->channel[6]->writerInterrupt = PCIE_DMA6_WRITER_INTERRUPT;
+    ivars->channel[6]->readerInterrupt = PCIE_DMA6_READER_INTERRUPT;
 #endif
     
 #ifdef CSR_PCIE_DMA7_BASE
-    ivars->channel[7] = new DMAChannel;
-    ivars->channel[7]->baseAddress = CSR_PCIE_DMA0_BASE;
-    ivars->channel[7]->writerInterrupt = PCIE_DMA0_WRITER_INTERRUPT;
-    ivars->channel[7]->readerInterrupt = PCIE_DMA0_READER_INTERRUPT;
-    InitDMAChannel(7);
+    ivars->channel[7] = new DMAChannel();
+    ivars->channel[7]->baseAddress = CSR_PCIE_DMA7_BASE;
+    ivars->channel[7]->writerInterrupt = PCIE_DMA7_WRITER_INTERRUPT;
+    ivars->channel[7]->readerInterrupt = PCIE_DMA7_READER_INTERRUPT;
 #endif
 
+    for (int i = 0; i < DMA_CHANNEL_COUNT; i += 1) {
+        if (ivars->channel[i] == nullptr) {
+            continue;
+        }
+        ret = InitDMAChannel(i);
+        if (ret != kIOReturnSuccess) {
+            LogError("failed to init dma channel %d with error: 0x%08x", i, ret);
+            Stop(provider);
+            goto Exit;
+        }
+    }
+
 //    SetupDMAWriterChannel(0);
 //    SetupDMAReaderChannel(0);
 //
@@ -636,91 +1520,172 @@ IMPL(litepcie, Start)
     // register service so we can be access by client app
     ret = RegisterService();
     if (ret != kIOReturnSuccess) {
-        Log("failed to register service with error: 0x%08x", ret);
+        LogError("failed to register service with error: 0x%08x", ret);
         goto Exit;
     }
 
 Exit:
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 void IMPL(litepcie, InterruptOccurred)
 {
-    bool printLog = (ivars->interruptCount % 4096) == 0;
+    uint32_t source = *reinterpret_cast<uint32_t*>(action->GetReference());
 
-    if (printLog)
-        Log("entered");
-    uint32_t vector = 0, clear = 0;
-    
-    uint64_t hwcount = 0;
+    LogTrace("entered source %u", source);
+    uint32_t pending = ivars->irqRoute.mask[source], clear = 0, hold = 0, bit = 0;
+    uint64_t holdoffDeadline = 0;
+
+    const litepcie_irq_target* target;
+
+    if (ivars->irqRoute.shared) {
+#ifdef CSR_PCIE_MSI_VECTOR_ADDR
+        uint32_t vector = 0;
+        ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_VECTOR_ADDR), &vector);
+        ivars->interruptMmioReads[source] += 1;
+        LogTrace("vector: %x", vector);
+        pending &= vector;
+#endif
+        // a multi-vector core squeezed onto one vector has no vector register,
+        // every routed direction gets checked then
+    }
 
-    DMALoopStatus rstatus, wstatus;
+    // only the directions that raised their vector bit have news, skip the
+    // loop status reads for the rest
+    while ((target = litepcie_irq_route_next(&ivars->irqRoute, &pending, &bit)) != nullptr) {
+        DMAChannel* channel = ivars->channel[target->channel];
+        if (channel == nullptr) {
+            continue;
+        }
 
-    ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_VECTOR_ADDR), &vector);
-    if (printLog)
-        Log("vector: %x", vector);
+        bool is_reader = target->is_reader;
+        DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+        DMAIrqCounts* irq = &ring->progress->irq;
+        IOUserClient* waitClient = nullptr;
+        OSAction* waitAction = nullptr;
+        uint64_t total, delta, waitCount, irqNs;
+        bool wake;
 
-    for (int i = 0; i < DMA_CHANNEL_COUNT; i += 1) {
+        clear |= (1 << bit);
 
-        if (vector & (1 << ivars->channel[i]->readerInterrupt)) {
-            clear |= (1 << ivars->channel[i]->readerInterrupt);
+        // channel on its way down
+        if (ring->lock == nullptr) {
+            continue;
         }
-        
-        ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(ivars->channel[i]->baseAddress) + PCIE_DMA_READER_TABLE_LOOP_STATUS_OFFSET, &rstatus.raw);
-        hwcount = rstatus.reg.index * DMA_BUFFER_COUNT + rstatus.reg.count;
 
-        if (ivars->channel[i]->dmaCounts->hwReaderCountPrev > hwcount) {
-            ivars->channel[i]->dmaCounts->hwReaderCountTotal += (DMA_BUFFER_COUNT * (0xFFFF + 1) - ivars->channel[i]->dmaCounts->hwReaderCountPrev) + hwcount; // status wraparound
-        } else {
-            ivars->channel[i]->dmaCounts->hwReaderCountTotal += (hwcount - ivars->channel[i]->dmaCounts->hwReaderCountPrev);
+        IOLockLock(ring->lock);
+        litepcie_dma_progress_begin(ring->progress);
+        total = ServiceDMADirection(ivars->pciDevice, channel, is_reader, time, &delta);
+        irq->irqs += 1;
+        irqNs = AbsoluteToNanoseconds(time);
+
+        // fast stream, keep this direction quiet for a latency target
+        if (ring->coalesce.mode == LITEPCIE_COALESCE_ADAPTIVE) {
+            litepcie_dma_coalesce_sample(&ring->coalesce, irqNs, total);
+            uint64_t holdoff = litepcie_dma_coalesce_holdoff_ns(&ring->coalesce, ring->bufferCount, ring->tableStride);
+            if (holdoff != 0 && !ring->heldOff) {
+                ring->heldOff = true;
+                ring->holdoffDeadline = time + NanosecondsToAbsolute(holdoff);
+                if (holdoffDeadline == 0 || ring->holdoffDeadline < holdoffDeadline) {
+                    holdoffDeadline = ring->holdoffDeadline;
+                }
+                irq->holdoffs += 1;
+                hold |= (1 << bit);
+            }
+        }
+        litepcie_dma_progress_end(ring->progress);
+        litepcie_dma_stats_irq(ring->stats, ring->irqTimePrev, irqNs, AbsoluteToNanoseconds(mach_absolute_time()),
+                               delta, ring->tableStride);
+        ring->irqTimePrev = irqNs;
+        waitCount = ring->waitCount;
+        wake = TakeDMAWaiter(ring, total, false, &waitClient, &waitAction);
+        IOLockUnlock(ring->lock);
+
+        if (wake) {
+            CompleteDMAWaiter(waitClient, waitAction, kIOReturnSuccess, total, waitCount);
         }
 
-        ivars->channel[i]->dmaCounts->hwReaderCountPrev = hwcount;
+        LogTrace("chan %i %s hwcount: %lli", target->channel, is_reader ? "rd" : "wr", total);
+    }
 
-        if (vector & (1 << ivars->channel[i]->writerInterrupt)) {
-            clear |= (1 << ivars->channel[i]->writerInterrupt);
-        }
-        
-        ivars->pciDevice->MemoryRead32(0, CSR_TO_OFFSET(ivars->channel[i]->baseAddress) + PCIE_DMA_WRITER_TABLE_LOOP_STATUS_OFFSET, &wstatus.raw);
-        hwcount = wstatus.reg.index * DMA_BUFFER_COUNT + wstatus.reg.count;
+    if (hold != 0) {
+        UpdateMSIEnable(ivars, 0, hold);
+        ArmCoalesceTimer(ivars, holdoffDeadline);
+    }
 
-        if (ivars->channel[i]->dmaCounts->hwWriterCountPrev > hwcount) {
-            ivars->channel[i]->dmaCounts->hwWriterCountTotal += (DMA_BUFFER_COUNT * (0xFFFF + 1) - ivars->channel[i]->dmaCounts->hwWriterCountPrev) + hwcount; // status wraparound
-        } else {
-            ivars->channel[i]->dmaCounts->hwWriterCountTotal += (hwcount - ivars->channel[i]->dmaCounts->hwWriterCountPrev);
+#ifdef CSR_PCIE_MSI_CLEAR_ADDR
+    if (ivars->irqRoute.shared) {
+        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_CLEAR_ADDR), clear); // clear interrupts
+    }
+#endif
+
+    ivars->interruptCount[source] += count;
+    LogTrace("finished");
+}
+
+void IMPL(litepcie, CoalesceTimerOccurred)
+{
+    uint64_t now = mach_absolute_time();
+    uint64_t next = 0;
+    uint32_t release = 0;
+
+    IOLockLock(ivars->msiLock);
+    ivars->coalesceDeadline = 0;
+    IOLockUnlock(ivars->msiLock);
+
+    for (int i = 0; i < DMA_CHANNEL_COUNT; i += 1) {
+        DMAChannel* channel = ivars->channel[i];
+        if (channel == nullptr) {
+            continue;
         }
 
-        ivars->channel[i]->dmaCounts->hwWriterCountPrev = hwcount;
+        for (int is_reader = 0; is_reader < 2; is_reader += 1) {
+            DMARing* ring = is_reader ? &channel->reader : &channel->writer;
+            IOUserClient* waitClient = nullptr;
+            OSAction* waitAction = nullptr;
+            uint64_t waitCount = 0, total = 0, delta = 0;
+            bool wake = false;
 
-        if (printLog) {
-            mach_timebase_info_data_t info;
-            mach_timebase_info(&info);
-            double delta_ns = ((time - ivars->interruptTimePrevBM) * info.numer / info.denom);
-            double delta_s = delta_ns / 1'000'000'000.0;
-            double readerRate = (DMA_BUFFER_SIZE * (ivars->channel[i]->dmaCounts->hwReaderCountTotal - ivars->readerPrevBM)) / delta_s;
-            double writerRate = (DMA_BUFFER_SIZE * (ivars->channel[i]->dmaCounts->hwWriterCountTotal - ivars->writerPrevBM)) / delta_s;
+            if (ring->lock == nullptr) {
+                continue;
+            }
 
-            Log("chan %i hwcounts rd: %lli wr: %lli", i, ivars->channel[i]->dmaCounts->hwReaderCountTotal, ivars->channel[i]->dmaCounts->hwWriterCountTotal);
-            Log("delta time: %0.3f ns %llu ns", delta_ns, time);
-            Log("reader MB/s: %0.3f", readerRate / 1'000'000.0);
-            Log("writer MB/s: %0.3f", writerRate / 1'000'000.0);
-            Log(" total MB/s: %0.3f", (readerRate + writerRate) / 1'000'000.0);
+            IOLockLock(ring->lock);
+            if (ring->heldOff) {
+                if (ring->holdoffDeadline <= now) {
+                    // completions during the holdoff may not have latched, catch up by hand
+                    litepcie_dma_progress_begin(ring->progress);
+                    total = ServiceDMADirection(ivars->pciDevice, channel, is_reader, now, &delta);
+                    litepcie_dma_progress_end(ring->progress);
+                    litepcie_dma_coalesce_released(&ring->coalesce, AbsoluteToNanoseconds(now),
+                                                   AbsoluteToNanoseconds(ring->holdoffDeadline), total);
+                    waitCount = ring->waitCount;
+                    wake = TakeDMAWaiter(ring, total, false, &waitClient, &waitAction);
+                    ring->heldOff = false;
+                    release |= 1 << (is_reader ? channel->readerInterrupt : channel->writerInterrupt);
+                } else if (next == 0 || ring->holdoffDeadline < next) {
+                    next = ring->holdoffDeadline;
+                }
+            }
+            IOLockUnlock(ring->lock);
 
-            ivars->interruptTimePrevBM = time;
-            ivars->readerPrevBM = ivars->channel[i]->dmaCounts->hwReaderCountTotal;
-            ivars->writerPrevBM = ivars->channel[i]->dmaCounts->hwWriterCountTotal;
+            if (wake) {
+                CompleteDMAWaiter(waitClient, waitAction, kIOReturnSuccess, total, waitCount);
+            }
         }
     }
 
-    ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_CLEAR_ADDR), clear); // clear interrupts
-
-    if (printLog)
-        Log("count: %lli", ivars->interruptCount);
-    if (printLog)
-        Log("finished");
+    if (release != 0) {
+#ifdef CSR_PCIE_MSI_CLEAR_ADDR
+        ivars->pciDevice->MemoryWrite32(0, CSR_TO_OFFSET(CSR_PCIE_MSI_CLEAR_ADDR), release);
+#endif
+        UpdateMSIEnable(ivars, release, 0);
+    }
 
-    ivars->interruptCount += count;
+    if (next != 0) {
+        ArmCoalesceTimer(ivars, next);
+    }
 }
 
 kern_return_t
@@ -729,17 +1694,53 @@ IMPL(litepcie, Stop)
     kern_return_t ret = kIOReturnSuccess;
     __block _Atomic uint32_t cancelCount = 0;
 
-    Log("entered");
+    LogTrace("entered");
+
+    // nothing will complete them from here on
+    CancelDMAWaiters(nullptr);
+
+    // the handlers take the ring locks and touch the rings, silence them
+    // before the channels go away
+    for (uint32_t i = 0; i < LITEPCIE_IRQ_MAX_SOURCES; i += 1) {
+        if (ivars->interruptSource[i] != nullptr) {
+            ivars->interruptSource[i]->SetEnable(false);
+            ivars->interruptSource[i]->Cancel(^{});
+        }
+    }
+
+    if (ivars->coalesceTimer != nullptr) {
+        ivars->coalesceTimer->SetEnable(false);
+        ivars->coalesceTimer->Cancel(^{});
+    }
+
+    // and wait out a handler that was already running
+    for (uint32_t i = 0; i < LITEPCIE_IRQ_MAX_SOURCES; i += 1) {
+        if (ivars->interruptDispatchQueue[i] != nullptr) {
+            ivars->interruptDispatchQueue[i]->DispatchSync(^{});
+        }
+    }
 
-    StopDMAChannel(0);
+    if (ivars->coalesceDispatchQueue != nullptr) {
+        ivars->coalesceDispatchQueue->DispatchSync(^{});
+    }
 
-    CleanupDMAChannel(0);
+    for (int i = 0; i < DMA_CHANNEL_COUNT; i += 1) {
+        if (ivars->channel[i] != nullptr) {
+            CleanupDMAChannel(i);
+        }
+    }
 
     if (ivars->defaultDispatchQueue != nullptr) {
         ++cancelCount;
     }
 
-    if (ivars->interruptDispatchQueue != nullptr) {
+    for (uint32_t i = 0; i < LITEPCIE_IRQ_MAX_SOURCES; i += 1) {
+        if (ivars->interruptDispatchQueue[i] != nullptr) {
+            ++cancelCount;
+        }
+    }
+
+    if (ivars->coalesceDispatchQueue != nullptr) {
         ++cancelCount;
     }
 
@@ -747,10 +1748,10 @@ IMPL(litepcie, Stop)
     if (cancelCount == 0) {
         ret = Stop(provider, SUPERDISPATCH);
         if (ret != kIOReturnSuccess) {
-            Log("super::Stop failed with error: 0x%08x.", ret);
+            LogError("super::Stop failed with error: 0x%08x.", ret);
         }
 
-        Log("Finished.");
+        LogTrace("Finished.");
 
         return ret;
     }
@@ -766,10 +1767,10 @@ IMPL(litepcie, Stop)
 
             kern_return_t status = Stop(provider, SUPERDISPATCH);
             if (status != kIOReturnSuccess) {
-                Log("super::Stop failed with error: 0x%08x.", status);
+                LogError("super::Stop failed with error: 0x%08x.", status);
             }
 
-            Log("finished.");
+            LogTrace("finished.");
 
             this->release();
             provider->release();
@@ -780,8 +1781,14 @@ IMPL(litepcie, Stop)
         ivars->defaultDispatchQueue->Cancel(finalize);
     }
 
-    if (ivars->interruptDispatchQueue != nullptr) {
-        ivars->interruptDispatchQueue->Cancel(finalize);
+    for (uint32_t i = 0; i < LITEPCIE_IRQ_MAX_SOURCES; i += 1) {
+        if (ivars->interruptDispatchQueue[i] != nullptr) {
+            ivars->interruptDispatchQueue[i]->Cancel(finalize);
+        }
+    }
+
+    if (ivars->coalesceDispatchQueue != nullptr) {
+        ivars->coalesceDispatchQueue->Cancel(finalize);
     }
 
     // closes the pci device
@@ -791,22 +1798,33 @@ IMPL(litepcie, Stop)
         ivars->pciDevice->Close(this, 0);
     }
 
-    Log("finished");
+    LogTrace("finished");
 
     return ret;
 }
 
 void litepcie::free(void)
 {
-    Log("entered");
+    LogTrace("entered");
 
     OSSafeReleaseNULL(ivars->defaultDispatchQueue);
-    OSSafeReleaseNULL(ivars->interruptDispatchQueue);
+    for (uint32_t i = 0; i < LITEPCIE_IRQ_MAX_SOURCES; i += 1) {
+        OSSafeReleaseNULL(ivars->interruptSource[i]);
+        OSSafeReleaseNULL(ivars->interruptDispatchQueue[i]);
+    }
+    OSSafeReleaseNULL(ivars->coalesceTimer);
+    OSSafeReleaseNULL(ivars->coalesceDispatchQueue);
+    if (ivars->msiLock != nullptr) {
+        IOLockFree(ivars->msiLock);
+    }
+    if (ivars->flashLock != nullptr) {
+        IOLockFree(ivars->flashLock);
+    }
     IOSafeDeleteNULL(ivars, litepcie_IVars, 1);
 
     super::free();
 
-    Log("finished");
+    LogTrace("finished");
 }
 
 kern_return_t
@@ -815,25 +1833,25 @@ IMPL(litepcie, NewUserClient)
     kern_return_t ret = kIOReturnSuccess;
     IOService* client = nullptr;
 
-    Log("entered");
+    LogTrace("entered");
 
     // create new client object
     ret = Create(this, "UserClientProperties", &client);
     if (ret != kIOReturnSuccess) {
-        Log("failed to create UserClientProperties with error: 0x%08x", ret);
+        LogError("failed to create UserClientProperties with error: 0x%08x", ret);
         goto Exit;
     }
 
     // try to cast client object to an IOUserClient
     *userClient = OSDynamicCast(IOUserClient, client);
     if (*userClient == NULL) {
-        Log("failed to cast new client");
+        LogError("failed to cast new client");
         client->release();
         ret = kIOReturnError;
         goto Exit;
     }
 
-    Log("finished");
+    LogTrace("finished");
 
 Exit:
     return ret;
@@ -0,0 +1,59 @@
+#ifndef litepcie_csr_window_h
+#define litepcie_csr_window_h
+
+#include <stdint.h>
+
+#include "csr.h"
+#include "litepcie_ext.h"
+
+/*
+ * CSR windows a client can map straight into its address space with
+ * LITEPCIE_CSR_MEMORY, shared by the dext and liblitepcie.
+ *
+ * Mappings are made in whole LITEPCIE_CSR_WINDOW_ALIGN pages, so a window
+ * starts (base & (LITEPCIE_CSR_WINDOW_ALIGN - 1)) bytes into what the client
+ * gets back and neighbouring blocks in the same page are reachable too. The
+ * whitelist limits what a client asks for, not what it can touch.
+ */
+
+#define LITEPCIE_CSR_BLOCK_SIZE 0x800 /* LiteX CSR region stride */
+
+struct litepcie_csr_window {
+    uint32_t base; /* BAR0 offset */
+    uint32_t size; /* 0 for the whole BAR, or a block this SoC doesn't have */
+};
+
+/* indexed by LitePCIeCsrWindow */
+static const struct litepcie_csr_window litepcie_csr_windows[LITEPCIE_CSR_WINDOW_COUNT] = {
+    { 0, 0 },
+#ifdef CSR_ADC_BASE
+    { CSR_TO_OFFSET(CSR_ADC_BASE), LITEPCIE_CSR_BLOCK_SIZE },
+#else
+    { 0, 0 },
+#endif
+#ifdef CSR_FRONTEND_BASE
+    { CSR_TO_OFFSET(CSR_FRONTEND_BASE), LITEPCIE_CSR_BLOCK_SIZE },
+#else
+    { 0, 0 },
+#endif
+#ifdef CSR_LEDS_BASE
+    { CSR_TO_OFFSET(CSR_LEDS_BASE), LITEPCIE_CSR_BLOCK_SIZE },
+#else
+    { 0, 0 },
+#endif
+};
+
+static inline uint32_t litepcie_csr_window_map_offset(uint32_t base)
+{
+    return base & ~(uint32_t)(LITEPCIE_CSR_WINDOW_ALIGN - 1);
+}
+
+static inline uint32_t litepcie_csr_window_map_length(uint32_t base, uint32_t size)
+{
+    uint32_t end = base + size;
+
+    end = (end + LITEPCIE_CSR_WINDOW_ALIGN - 1) & ~(uint32_t)(LITEPCIE_CSR_WINDOW_ALIGN - 1);
+    return end - litepcie_csr_window_map_offset(base);
+}
+
+#endif /* litepcie_csr_window_h */
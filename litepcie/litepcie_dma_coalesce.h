@@ -0,0 +1,160 @@
+#ifndef litepcie_dma_coalesce_h
+#define litepcie_dma_coalesce_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "litepcie_ext.h"
+
+/*
+ * DMA interrupt coalescing policy, shared by the dext and the simulator backend.
+ *
+ * A looping descriptor table only accepts new entries in program mode, so the
+ * IRQ stride can't change under a running engine. Adaptive mode picks it when
+ * the table is written: the configured one while it lands within the latency
+ * target, an IRQ on every descriptor for streams slower than that. Once at
+ * least two strides land per latency target, it also masks the direction's
+ * MSI after servicing it, for the latency target at most. Slow streams see
+ * every buffer at IRQ latency, fast ones take fewer IRQs than the stride alone
+ * would give them.
+ */
+
+#define LITEPCIE_COALESCE_LATENCY_DEFAULT_US 500
+#define LITEPCIE_COALESCE_LATENCY_MAX_US     100000
+#define LITEPCIE_COALESCE_RATE_SHIFT         3 /* EWMA weight 1/8 */
+#define LITEPCIE_COALESCE_LEAD_SHIFT         2 /* half of the TX lead, the library queues half the ring */
+#define LITEPCIE_COALESCE_WAKE_MIN_US        100 /* least time allowed for the host to wake up */
+
+struct litepcie_dma_coalesce {
+    uint32_t mode; /* LitePCIeCoalesceMode */
+    uint32_t latency_us;
+    uint64_t rate; /* buffers/s, EWMA */
+    uint64_t peak_rate; /* buffers/s, fastest interval, only comes down across holdoffs */
+    uint64_t last_ns;
+    uint64_t last_count;
+    bool held; /* a holdoff ended since the last sample */
+    bool peak_known; /* peak_rate was measured across a holdoff in this run */
+    uint64_t wake_ns; /* how late holdoffs were released, decaying peak */
+};
+
+static inline bool litepcie_dma_coalesce_valid(uint32_t mode, uint32_t latency_us)
+{
+    if (mode != LITEPCIE_COALESCE_FIXED && mode != LITEPCIE_COALESCE_ADAPTIVE)
+        return false;
+    return latency_us <= LITEPCIE_COALESCE_LATENCY_MAX_US;
+}
+
+static inline void litepcie_dma_coalesce_init(struct litepcie_dma_coalesce *c, uint32_t mode, uint32_t latency_us)
+{
+    c->mode = mode;
+    c->latency_us = latency_us ? latency_us : LITEPCIE_COALESCE_LATENCY_DEFAULT_US;
+    c->rate = 0;
+    c->peak_rate = 0;
+    c->last_ns = 0;
+    c->last_count = 0;
+    c->held = false;
+    c->peak_known = false;
+    c->wake_ns = 0;
+}
+
+/* a new run of the direction, the rate and wakeup latency seen so far stay */
+static inline void litepcie_dma_coalesce_restart(struct litepcie_dma_coalesce *c)
+{
+    c->peak_rate = 0;
+    c->last_ns = 0;
+    c->last_count = 0;
+    c->held = false;
+    c->peak_known = false;
+}
+
+/*
+ * Descriptor IRQ stride to program into the table. Adaptive mode keeps the
+ * configured one unless a previous run measured a rate at which it takes
+ * longer than the latency target to fill.
+ */
+static inline uint32_t litepcie_dma_coalesce_stride(const struct litepcie_dma_coalesce *c, uint32_t buffer_per_irq)
+{
+    if (c->mode != LITEPCIE_COALESCE_ADAPTIVE || c->rate == 0)
+        return buffer_per_irq;
+    return (uint64_t)buffer_per_irq * 1000000ULL <= c->rate * c->latency_us ? buffer_per_irq : 1;
+}
+
+/*
+ * Feed the buffer total seen when servicing the direction. The first IRQ
+ * after a holdoff comes a buffer after the catch-up, so intervals shorter
+ * than a quarter of the latency target are folded into the next one rather
+ * than averaged in on their own.
+ */
+static inline void litepcie_dma_coalesce_sample(struct litepcie_dma_coalesce *c, uint64_t now_ns, uint64_t count)
+{
+    if (c->last_ns != 0 && now_ns - c->last_ns < (uint64_t)c->latency_us * 1000 / 4)
+        return;
+    if (c->last_ns != 0 && now_ns > c->last_ns && count >= c->last_count) {
+        uint64_t rate = (count - c->last_count) * 1000000000ULL / (now_ns - c->last_ns);
+        if (c->rate == 0)
+            c->rate = rate;
+        else
+            c->rate = c->rate - (c->rate >> LITEPCIE_COALESCE_RATE_SHIFT) + (rate >> LITEPCIE_COALESCE_RATE_SHIFT);
+        if (c->held) {
+            if (c->peak_known)
+                c->peak_rate -= c->peak_rate >> LITEPCIE_COALESCE_RATE_SHIFT;
+            c->peak_known = true;
+        }
+        if (rate > c->peak_rate)
+            c->peak_rate = rate;
+        c->held = false;
+    }
+    c->last_ns = now_ns;
+    c->last_count = count;
+}
+
+/*
+ * A holdoff due at deadline_ns was released at now_ns, with the buffer total
+ * caught up to count. The interval across it is the only one allowed to bring
+ * the peak rate down: a device may well run faster while the host sleeps than
+ * while it is watched.
+ */
+static inline void litepcie_dma_coalesce_released(struct litepcie_dma_coalesce *c, uint64_t now_ns, uint64_t deadline_ns,
+                                                  uint64_t count)
+{
+    uint64_t late = now_ns > deadline_ns ? now_ns - deadline_ns : 0;
+
+    c->wake_ns -= c->wake_ns >> LITEPCIE_COALESCE_RATE_SHIFT;
+    if (late > c->wake_ns)
+        c->wake_ns = late;
+    c->held = true;
+    litepcie_dma_coalesce_sample(c, now_ns, count);
+}
+
+/*
+ * How long to keep the direction's MSI masked after servicing it, 0 for not
+ * at all. The host hears of nothing that completes meanwhile, and only
+ * refills TX once the release has woken it up: the window plus both wakeups
+ * has to fit in half of what is queued ahead of the device (half the ring by
+ * default, RX gets the same slack). Each wakeup is counted as the latest
+ * release seen lately, and never less than LITEPCIE_COALESCE_WAKE_MIN_US.
+ * Until a holdoff has measured the peak rate, holdoffs last no longer than
+ * that minimum wakeup.
+ */
+static inline uint64_t litepcie_dma_coalesce_holdoff_ns(const struct litepcie_dma_coalesce *c, uint32_t buffer_count,
+                                                        uint32_t stride)
+{
+    uint64_t rate, holdoff, window, wake;
+
+    if (c->mode != LITEPCIE_COALESCE_ADAPTIVE)
+        return 0;
+    /* fewer than two strides per latency target, every IRQ is needed */
+    if (c->rate * c->latency_us < 2 * (uint64_t)stride * 1000000ULL)
+        return 0;
+    rate = c->peak_rate > c->rate ? c->peak_rate : c->rate;
+    window = (uint64_t)(buffer_count >> LITEPCIE_COALESCE_LEAD_SHIFT) * 1000000000ULL / rate;
+    wake = c->wake_ns > LITEPCIE_COALESCE_WAKE_MIN_US * 1000ULL ? c->wake_ns : LITEPCIE_COALESCE_WAKE_MIN_US * 1000ULL;
+    if (window <= 2 * wake)
+        return 0;
+    holdoff = (uint64_t)c->latency_us * 1000;
+    if (!c->peak_known && holdoff > LITEPCIE_COALESCE_WAKE_MIN_US * 1000ULL)
+        holdoff = LITEPCIE_COALESCE_WAKE_MIN_US * 1000ULL;
+    return window - 2 * wake < holdoff ? window - 2 * wake : holdoff;
+}
+
+#endif /* litepcie_dma_coalesce_h */
@@ -0,0 +1,175 @@
+#ifndef litepcie_dma_common_h
+#define litepcie_dma_common_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "csr.h"
+
+/*
+ * DMA table helpers shared by the dext and the user-space backends, so the
+ * simulator driver programs and accounts tables the same way the dext does.
+ */
+
+/* CSR block of a DMA channel, as an offset from CSR_BASE. -1 for channels
+ * csr.h does not describe */
+static inline int litepcie_dma_channel_base(uint32_t channel, uint32_t *base)
+{
+    static const uint32_t bases[] = {
+#ifdef CSR_PCIE_DMA0_BASE
+        CSR_PCIE_DMA0_BASE,
+#endif
+#ifdef CSR_PCIE_DMA1_BASE
+        CSR_PCIE_DMA1_BASE,
+#endif
+#ifdef CSR_PCIE_DMA2_BASE
+        CSR_PCIE_DMA2_BASE,
+#endif
+#ifdef CSR_PCIE_DMA3_BASE
+        CSR_PCIE_DMA3_BASE,
+#endif
+#ifdef CSR_PCIE_DMA4_BASE
+        CSR_PCIE_DMA4_BASE,
+#endif
+#ifdef CSR_PCIE_DMA5_BASE
+        CSR_PCIE_DMA5_BASE,
+#endif
+#ifdef CSR_PCIE_DMA6_BASE
+        CSR_PCIE_DMA6_BASE,
+#endif
+#ifdef CSR_PCIE_DMA7_BASE
+        CSR_PCIE_DMA7_BASE,
+#endif
+    };
+    uint32_t defined = sizeof(bases) / sizeof(bases[0]);
+
+    if (channel >= defined)
+        return -1;
+    *base = (uint32_t)(bases[channel] - CSR_BASE);
+    return 0;
+}
+
+/* MSI vector bits, channels without a soc.h entry follow the reader/writer pair layout */
+static inline uint32_t litepcie_dma_reader_irq(uint32_t channel)
+{
+    switch (channel) {
+#ifdef PCIE_DMA0_READER_INTERRUPT
+    case 0:
+        return PCIE_DMA0_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA1_READER_INTERRUPT
+    case 1:
+        return PCIE_DMA1_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA2_READER_INTERRUPT
+    case 2:
+        return PCIE_DMA2_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA3_READER_INTERRUPT
+    case 3:
+        return PCIE_DMA3_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA4_READER_INTERRUPT
+    case 4:
+        return PCIE_DMA4_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA5_READER_INTERRUPT
+    case 5:
+        return PCIE_DMA5_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA6_READER_INTERRUPT
+    case 6:
+        return PCIE_DMA6_READER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA7_READER_INTERRUPT
+    case 7:
+        return PCIE_DMA7_READER_INTERRUPT;
+#endif
+    default:
+        return 2 * channel + PCIE_DMA0_READER_INTERRUPT;
+    }
+}
+
+static inline uint32_t litepcie_dma_writer_irq(uint32_t channel)
+{
+    switch (channel) {
+#ifdef PCIE_DMA0_WRITER_INTERRUPT
+    case 0:
+        return PCIE_DMA0_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA1_WRITER_INTERRUPT
+    case 1:
+        return PCIE_DMA1_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA2_WRITER_INTERRUPT
+    case 2:
+        return PCIE_DMA2_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA3_WRITER_INTERRUPT
+    case 3:
+        return PCIE_DMA3_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA4_WRITER_INTERRUPT
+    case 4:
+        return PCIE_DMA4_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA5_WRITER_INTERRUPT
+    case 5:
+        return PCIE_DMA5_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA6_WRITER_INTERRUPT
+    case 6:
+        return PCIE_DMA6_WRITER_INTERRUPT;
+#endif
+#ifdef PCIE_DMA7_WRITER_INTERRUPT
+    case 7:
+        return PCIE_DMA7_WRITER_INTERRUPT;
+#endif
+    default:
+        return 2 * channel + PCIE_DMA0_WRITER_INTERRUPT;
+    }
+}
+
+/* loop status: buffer index in the low half, loop count in the high half */
+#define LITEPCIE_DMA_LOOP_STATUS_WRAP 0x10000
+
+static inline uint64_t litepcie_dma_loop_status_count(uint32_t status, uint32_t buffer_count)
+{
+    return (uint64_t)(status >> 16) * buffer_count + (status & 0xffff);
+}
+
+/* buffers completed between two loop status samples, handles the loop counter wrap */
+static inline uint64_t litepcie_dma_count_delta(uint64_t prev, uint64_t now, uint32_t buffer_count)
+{
+    if (prev > now)
+        return ((uint64_t)buffer_count * LITEPCIE_DMA_LOOP_STATUS_WRAP - prev) + now;
+    return now - prev;
+}
+
+static inline uint32_t litepcie_dma_desc_config(uint32_t length, bool irq)
+{
+    return (length & 0xffffff) | (irq ? 0 : DMA_IRQ_DISABLE) | DMA_LAST_DISABLE;
+}
+
+/* IRQ on every buffer_per_irq-th descriptor */
+static inline bool litepcie_dma_desc_irq(uint32_t index, uint32_t buffer_per_irq)
+{
+    return ((index + 1) % buffer_per_irq) == 0;
+}
+
+static inline bool litepcie_dma_geometry_valid(uint32_t buffer_size, uint32_t buffer_count, uint32_t buffer_per_irq)
+{
+    if (buffer_size < DMA_BUFFER_SIZE_MIN || buffer_size > DMA_BUFFER_SIZE_MAX)
+        return false;
+    /* power of two so buffers never straddle a page of an aligned ring */
+    if ((buffer_size & (buffer_size - 1)) != 0)
+        return false;
+    if (buffer_count < 2 || buffer_count > DMA_BUFFER_COUNT_MAX)
+        return false;
+    if (buffer_per_irq < 1 || buffer_per_irq > buffer_count)
+        return false;
+    return (uint64_t)buffer_size * buffer_count <= DMA_RING_SIZE_MAX;
+}
+
+#endif /* litepcie_dma_common_h */
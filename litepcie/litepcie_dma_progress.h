@@ -0,0 +1,219 @@
+#ifndef litepcie_dma_progress_h
+#define litepcie_dma_progress_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "litepcie_ext.h"
+
+/*
+ * Access to the shared DMAProgress blocks of the counts page.
+ *
+ * There is a single writer per direction (the interrupt path, serialized by
+ * the ring lock in the dext and the backend lock in the simulator) and any
+ * number of readers on other cores. The writer brackets its updates with
+ * begin/end, which make the sequence odd while fields are in flux, readers
+ * retry until they saw the same even sequence on both sides of their copy.
+ * countTotal is additionally published with a release store so the hot path
+ * can acquire-load it without taking a snapshot.
+ */
+
+static inline void litepcie_dma_progress_begin(DMAProgress *p)
+{
+    __atomic_store_n(&p->sequence, p->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void litepcie_dma_progress_end(DMAProgress *p)
+{
+    __atomic_store_n(&p->sequence, p->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* writer side, between begin and end */
+static inline void litepcie_dma_progress_set_count(DMAProgress *p, uint64_t count)
+{
+    __atomic_store_n(&p->countTotal, count, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t litepcie_dma_progress_count(const DMAProgress *p)
+{
+    return __atomic_load_n(&p->countTotal, __ATOMIC_ACQUIRE);
+}
+
+/* consistent copy of a whole direction, spins while the writer is mid update */
+static inline void litepcie_dma_progress_read(const DMAProgress *p, DMAProgress *out)
+{
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&p->sequence, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        out->countTotal = __atomic_load_n(&p->countTotal, __ATOMIC_RELAXED);
+        out->lastIrqTime = __atomic_load_n(&p->lastIrqTime, __ATOMIC_RELAXED);
+        out->irq.irqs = __atomic_load_n(&p->irq.irqs, __ATOMIC_RELAXED);
+        out->irq.mmioReads = __atomic_load_n(&p->irq.mmioReads, __ATOMIC_RELAXED);
+        out->irq.holdoffs = __atomic_load_n(&p->irq.holdoffs, __ATOMIC_RELAXED);
+        out->geometry.bufferSize = __atomic_load_n(&p->geometry.bufferSize, __ATOMIC_RELAXED);
+        out->geometry.bufferCount = __atomic_load_n(&p->geometry.bufferCount, __ATOMIC_RELAXED);
+        out->geometry.bufferPerIrq = __atomic_load_n(&p->geometry.bufferPerIrq, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&p->sequence, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+    out->sequence = seq;
+    out->reserved = 0;
+}
+
+/*
+ * DMAStats, same single writer. Counters are bumped without the sequence,
+ * readers copy them one at a time.
+ */
+
+/* histogram bucket of a duration, see LITEPCIE_DMA_HIST_BUCKETS */
+static inline uint32_t litepcie_dma_hist_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    uint32_t bucket;
+
+    if (us == 0)
+        return 0;
+    bucket = 64 - __builtin_clzll(us);
+    return bucket < LITEPCIE_DMA_HIST_BUCKETS ? bucket : LITEPCIE_DMA_HIST_BUCKETS - 1;
+}
+
+/* every time the direction is serviced, delta buffers since the last time */
+static inline void litepcie_dma_stats_service(DMAStats *s, uint64_t delta, uint32_t buffer_size, uint32_t buffer_count,
+                                              bool wrapped)
+{
+    s->bytes += delta * buffer_size;
+    if (wrapped)
+        s->wraps += 1;
+    /* a whole ring in one go, RX overwrote buffers before the host heard of them, TX replayed stale ones */
+    if (delta >= buffer_count)
+        s->lapped += 1;
+}
+
+/* interrupt path only, prev_ns is the previous IRQ of the direction or 0 */
+static inline void litepcie_dma_stats_irq(DMAStats *s, uint64_t prev_ns, uint64_t irq_ns, uint64_t done_ns,
+                                          uint64_t delta, uint32_t stride)
+{
+    if (prev_ns != 0 && irq_ns >= prev_ns)
+        s->irqInterval[litepcie_dma_hist_bucket(irq_ns - prev_ns)] += 1;
+    if (done_ns >= irq_ns)
+        s->irqHandler[litepcie_dma_hist_bucket(done_ns - irq_ns)] += 1;
+    /* a whole stride more than this IRQ accounts for, another one never made it */
+    if (delta >= 2 * (uint64_t)stride)
+        s->missedIrqs += 1;
+}
+
+static inline void litepcie_dma_stats_read(const DMAStats *s, DMAStats *out)
+{
+    out->bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    out->wraps = __atomic_load_n(&s->wraps, __ATOMIC_RELAXED);
+    out->missedIrqs = __atomic_load_n(&s->missedIrqs, __ATOMIC_RELAXED);
+    out->lapped = __atomic_load_n(&s->lapped, __ATOMIC_RELAXED);
+    out->heldOverruns = __atomic_load_n(&s->heldOverruns, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < LITEPCIE_DMA_HIST_BUCKETS; i++) {
+        out->irqInterval[i] = __atomic_load_n(&s->irqInterval[i], __ATOMIC_RELAXED);
+        out->irqHandler[i] = __atomic_load_n(&s->irqHandler[i], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Zero-copy ownership check against the client's DMAHost cursor, total is
+ * the direction's new countTotal. The device -> host engine is on the oldest
+ * held slot again a whole ring later, the host -> device one takes it as soon
+ * as it gets there.
+ */
+static inline bool litepcie_dma_host_overrun(const DMAHostCursor *c, uint64_t total, uint32_t buffer_count, bool is_reader)
+{
+    uint64_t acquired = __atomic_load_n(&c->acquired, __ATOMIC_ACQUIRE);
+    uint64_t released = __atomic_load_n(&c->released, __ATOMIC_ACQUIRE);
+
+    if (acquired <= released)
+        return false;
+    return is_reader ? total > released : total >= released + buffer_count;
+}
+
+static inline bool litepcie_dma_host_valid(const DMAHost *host)
+{
+    return host->version == LITEPCIE_DMA_HOST_VERSION && host->size == sizeof(DMAHost);
+}
+
+/*
+ * DMALevels, same single writer again. The raw values are the buffering
+ * FIFO control/status registers (24 bit depth and level fields) and the
+ * table LEVEL register.
+ */
+
+#define LITEPCIE_DMA_FIFO_FIELD_MASK 0xffffff
+
+/* at enable, with the direction stopped */
+static inline void litepcie_dma_levels_reset(DMALevels *l, uint32_t fifo_control)
+{
+    l->samples = 0;
+    l->lastSampleTime = 0;
+    l->fifoNearFull = 0;
+    l->fifoDepth = fifo_control & LITEPCIE_DMA_FIFO_FIELD_MASK;
+    l->fifoLevel = 0;
+    l->fifoHigh = 0;
+    l->tableLevel = 0;
+    l->tableLow = 0;
+}
+
+static inline bool litepcie_dma_levels_due(const DMALevels *l, uint64_t ns)
+{
+    return l->samples == 0 || ns - l->lastSampleTime >= LITEPCIE_DMA_LEVELS_INTERVAL_NS;
+}
+
+static inline void litepcie_dma_levels_sample(DMALevels *l, uint32_t fifo_status, uint32_t table_level, uint64_t ns)
+{
+    uint32_t level = fifo_status & LITEPCIE_DMA_FIFO_FIELD_MASK;
+
+    l->fifoLevel = level;
+    if (level > l->fifoHigh)
+        l->fifoHigh = level;
+    if (l->fifoDepth != 0 && LITEPCIE_DMA_FIFO_NEAR_FULL(level, l->fifoDepth))
+        l->fifoNearFull += 1;
+    l->tableLevel = table_level;
+    if (l->samples == 0 || table_level < l->tableLow)
+        l->tableLow = table_level;
+    l->lastSampleTime = ns;
+    __atomic_store_n(&l->samples, l->samples + 1, __ATOMIC_RELEASE);
+}
+
+static inline void litepcie_dma_levels_read(const DMALevels *l, DMALevels *out)
+{
+    out->samples = __atomic_load_n(&l->samples, __ATOMIC_ACQUIRE);
+    out->lastSampleTime = __atomic_load_n(&l->lastSampleTime, __ATOMIC_RELAXED);
+    out->fifoNearFull = __atomic_load_n(&l->fifoNearFull, __ATOMIC_RELAXED);
+    out->fifoDepth = __atomic_load_n(&l->fifoDepth, __ATOMIC_RELAXED);
+    out->fifoLevel = __atomic_load_n(&l->fifoLevel, __ATOMIC_RELAXED);
+    out->fifoHigh = __atomic_load_n(&l->fifoHigh, __ATOMIC_RELAXED);
+    out->tableLevel = __atomic_load_n(&l->tableLevel, __ATOMIC_RELAXED);
+    out->tableLow = __atomic_load_n(&l->tableLow, __ATOMIC_RELAXED);
+    out->reserved = 0;
+}
+
+/* whole page for clients that don't map it */
+static inline void litepcie_dma_counts_read(const DMACounts *counts, DMACounts *out)
+{
+    out->version = counts->version;
+    out->size = counts->size;
+    litepcie_dma_progress_read(&counts->reader, &out->reader);
+    litepcie_dma_progress_read(&counts->writer, &out->writer);
+    litepcie_dma_stats_read(&counts->readerStats, &out->readerStats);
+    litepcie_dma_stats_read(&counts->writerStats, &out->writerStats);
+    litepcie_dma_levels_read(&counts->readerLevels, &out->readerLevels);
+    litepcie_dma_levels_read(&counts->writerLevels, &out->writerLevels);
+}
+
+static inline bool litepcie_dma_counts_valid(const DMACounts *counts)
+{
+    return counts->version == LITEPCIE_DMA_COUNTS_VERSION && counts->size == sizeof(DMACounts);
+}
+
+#endif /* litepcie_dma_progress_h */
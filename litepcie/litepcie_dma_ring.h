@@ -0,0 +1,54 @@
+#ifndef litepcie_dma_ring_h
+#define litepcie_dma_ring_h
+
+#include <stdint.h>
+
+/*
+ * DMA ring layout.
+ *
+ * Each channel direction uses one buffer region prepared for DMA once. The
+ * region may come back from the DMA mapper as several bus segments, this
+ * resolves the bus address of each ring buffer from its offset in the region.
+ * A buffer must not straddle two segments since a table descriptor can only
+ * hold one address.
+ */
+
+#define LITEPCIE_DMA_MAX_SEGMENTS 32
+
+struct litepcie_dma_segment {
+    uint64_t address;
+    uint64_t length;
+};
+
+/* returns 0 and the bus address of [offset, offset + length) or -1 */
+static inline int litepcie_dma_ring_address(const struct litepcie_dma_segment* segments, uint32_t count,
+    uint64_t offset, uint64_t length, uint64_t* address)
+{
+    uint64_t start = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (offset < start + segments[i].length) {
+            if (offset + length > start + segments[i].length)
+                return -1;
+            *address = segments[i].address + (offset - start);
+            return 0;
+        }
+        start += segments[i].length;
+    }
+
+    return -1;
+}
+
+/* fill addresses[] for buffer_count buffers of buffer_size bytes, returns 0 or -1 */
+static inline int litepcie_dma_ring_layout(const struct litepcie_dma_segment* segments, uint32_t count,
+    uint32_t buffer_size, uint32_t buffer_count, uint64_t* addresses)
+{
+    for (uint32_t i = 0; i < buffer_count; i++) {
+        if (litepcie_dma_ring_address(segments, count, (uint64_t)i * buffer_size, buffer_size, &addresses[i]) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+#endif /* litepcie_dma_ring_h */
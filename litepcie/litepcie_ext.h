@@ -2,6 +2,7 @@
 #define litepcie_ext_h
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "csr.h"
 
@@ -14,34 +15,284 @@ enum LitePCIeMessageType {
     LITEPCIE_WRITE_CSR,
     LITEPCIE_ICAP,
     LITEPCIE_FLASH,
+    LITEPCIE_CONFIG_DMA_GEOMETRY,
+    LITEPCIE_CONFIG_DMA_COALESCE,
+    LITEPCIE_DMA_WAIT, /* async, completes once the direction's countTotal reaches count */
+    LITEPCIE_CSR_BATCH, /* LitePCIeCsrOp[] in, LitePCIeCsrBatchResult out */
+    LITEPCIE_GET_STATS, /* LitePCIeStats out */
+    LITEPCIE_GET_DMA_STATS, /* channel in, DMACounts snapshot out */
+    LITEPCIE_CONFIG_DMA_PAUSE, /* gate an enabled direction, table and counts stay put */
+    LITEPCIE_FLASH_PROGRAM, /* LitePCIeFlashProgramData in, WREN + page program per page */
+    LITEPCIE_FLASH_READ, /* LitePCIeFlashReadData in, the bytes out */
+    LITEPCIE_FLASH_ERASE, /* LitePCIeFlashEraseData in, WREN + erase */
+    LITEPCIE_FLASH_CRC, /* LitePCIeFlashCrcData in and out, the bytes stay in the driver */
+};
+
+enum LitePCIeCsrOpType {
+    LITEPCIE_CSR_OP_READ,
+    LITEPCIE_CSR_OP_WRITE,
+    LITEPCIE_CSR_OP_RMW, /* csr = (csr & ~mask) | (value & mask) */
+    LITEPCIE_CSR_OP_POLL, /* until (csr & mask) == value, or LITEPCIE_CSR_POLL_TIMEOUT_US */
 };
 
 enum LitePCIeMemoryType {
     LITEPCIE_DMA_READER = 0x00010000,
     LITEPCIE_DMA_WRITER = 0x00020000,
     LITEPCIE_DMA_COUNTS = 0x00040000,
+    LITEPCIE_CSR_MEMORY = 0x00080000, /* low bits pick a LitePCIeCsrWindow */
+    LITEPCIE_DMA_HOST = 0x00100000, /* DMAHost, the one page the client writes */
+};
+
+/* what LITEPCIE_CSR_MEMORY maps, windows are rounded out to LITEPCIE_CSR_WINDOW_ALIGN */
+enum LitePCIeCsrWindow {
+    LITEPCIE_CSR_WINDOW_BAR, /* all of BAR0 */
+    LITEPCIE_CSR_WINDOW_ADC,
+    LITEPCIE_CSR_WINDOW_FRONTEND,
+    LITEPCIE_CSR_WINDOW_LEDS,
+    LITEPCIE_CSR_WINDOW_COUNT,
+};
+
+#define LITEPCIE_CSR_WINDOW_ALIGN 0x4000 /* largest page size a client can run with */
+
+enum LitePCIeCoalesceMode {
+    LITEPCIE_COALESCE_FIXED, /* IRQ every buffer_per_irq descriptors */
+    LITEPCIE_COALESCE_ADAPTIVE, /* stride or every descriptor, held off by rate against a latency target */
 };
 
-#define LITEPCIE_DMA_MEMORY(type, dma_channel) ((uint64_t)(type & dma_channel))
+#define LITEPCIE_DMA_MEMORY(type, dma_channel) ((uint64_t)((type) | (dma_channel)))
+
+#define LITEPCIE_DMA_COUNTS_VERSION 5
+#define LITEPCIE_DMA_COUNTS_LINE 128 /* Apple silicon cache line, a pair of x86 ones */
+
+typedef struct DMAGeometry {
+    uint32_t bufferSize;
+    uint32_t bufferCount;
+    uint32_t bufferPerIrq;
+} DMAGeometry;
+
+typedef struct DMAIrqCounts {
+    uint64_t irqs; /* interrupts that carried this direction's vector bit */
+    uint64_t mmioReads; /* register reads spent servicing them, MSI vector read excluded */
+    uint64_t holdoffs; /* times adaptive coalescing masked the IRQ */
+} DMAIrqCounts;
 
+/*
+ * Progress of one DMA direction, alone on its cache line(s) so consumers
+ * spinning on one direction don't bounce the line the interrupt path is
+ * writing for the other. countTotal is stored with release semantics and can
+ * be polled on its own, everything else is only consistent when read under
+ * the sequence (see litepcie_dma_progress.h).
+ */
+typedef struct DMAProgress {
+    uint64_t countTotal; /* buffers completed since the direction was enabled */
+    uint32_t sequence; /* odd while the driver is updating this direction */
+    uint32_t reserved;
+    uint64_t lastIrqTime; /* ns, CLOCK_UPTIME_RAW for the dext, the backend clock otherwise */
+    DMAIrqCounts irq;
+    DMAGeometry geometry;
+} __attribute__((aligned(LITEPCIE_DMA_COUNTS_LINE))) DMAProgress;
+
+/* bucket 0 is below 1 us, bucket n covers [2^(n-1), 2^n) us, the last one is open ended */
+#define LITEPCIE_DMA_HIST_BUCKETS 24
+
+/*
+ * Statistics of one DMA direction, cumulative since the driver started.
+ * Written by the same path as DMAProgress but outside its sequence: every
+ * counter is exact on its own, a copy may just straddle an interrupt.
+ */
+typedef struct DMAStats {
+    uint64_t bytes; /* bufferSize for every completed buffer */
+    uint64_t wraps; /* loop status loop counter wraparounds */
+    uint64_t missedIrqs; /* IRQs that found more than one IRQ stride done, a vector went missing */
+    uint64_t lapped; /* services that found a whole ring done, the engine went over buffers nobody saw */
+    uint64_t heldOverruns; /* services that found the engine on a slot user space still held (DMAHost) */
+    uint64_t irqInterval[LITEPCIE_DMA_HIST_BUCKETS]; /* time between two IRQs of the direction */
+    uint64_t irqHandler[LITEPCIE_DMA_HIST_BUCKETS]; /* IRQ timestamp to direction serviced */
+} __attribute__((aligned(LITEPCIE_DMA_COUNTS_LINE))) DMAStats;
+
+/* the interrupt path samples levels at most this often */
+#define LITEPCIE_DMA_LEVELS_INTERVAL_NS 1000000
+/* a buffering FIFO is near full from 7/8 of its depth */
+#define LITEPCIE_DMA_FIFO_NEAR_FULL(level, depth) ((uint64_t)(level) * 8 >= (uint64_t)(depth) * 7)
+
+/*
+ * Occupancy of one DMA direction's buffering FIFO (in its data words) and
+ * descriptor table, sampled by the interrupt path. Marks and events restart
+ * when the direction is enabled, a depth of 0 means the core has no
+ * buffering FIFO.
+ */
+typedef struct DMALevels {
+    uint64_t samples;
+    uint64_t lastSampleTime; /* ns, same clock as lastIrqTime */
+    uint64_t fifoNearFull; /* samples that found the FIFO near full */
+    uint32_t fifoDepth;
+    uint32_t fifoLevel; /* last sample */
+    uint32_t fifoHigh; /* high-water mark */
+    uint32_t tableLevel; /* descriptors queued, last sample */
+    uint32_t tableLow; /* low-water mark */
+    uint32_t reserved;
+} __attribute__((aligned(LITEPCIE_DMA_COUNTS_LINE))) DMALevels;
+
+/* read-only shared page mapped with LITEPCIE_DMA_COUNTS */
 typedef struct DMACounts {
-    uint64_t hwReaderCountTotal;
-    uint64_t hwReaderCountPrev;
-    uint64_t hwWriterCountTotal;
-    uint64_t hwWriterCountPrev;
-} __attribute__((packed)) DMACounts;
+    uint32_t version; /* LITEPCIE_DMA_COUNTS_VERSION */
+    uint32_t size; /* sizeof(DMACounts) on the driver side */
+    DMAProgress reader; /* host -> device */
+    DMAProgress writer; /* device -> host */
+    DMAStats readerStats;
+    DMAStats writerStats;
+    DMALevels readerLevels;
+    DMALevels writerLevels;
+} DMACounts;
 
+#define LITEPCIE_DMA_HOST_VERSION 1
+
+/*
+ * Zero-copy ownership of one DMA direction, published by the client in
+ * countTotal numbering: user space holds buffers [released, acquired), RX
+ * ones it is reading, TX ones it is filling. The client stores released
+ * first and the driver loads acquired first, so a pair torn by an update
+ * can only look less held than it is.
+ */
+typedef struct DMAHostCursor {
+    uint64_t acquired;
+    uint64_t released;
+} __attribute__((aligned(LITEPCIE_DMA_COUNTS_LINE))) DMAHostCursor;
+
+/* read-write page mapped with LITEPCIE_DMA_HOST, version and size set by the driver */
+typedef struct DMAHost {
+    uint32_t version; /* LITEPCIE_DMA_HOST_VERSION */
+    uint32_t size; /* sizeof(DMAHost) on the driver side */
+    DMAHostCursor reader; /* host -> device */
+    DMAHostCursor writer; /* device -> host */
+} DMAHost;
+
+/*
+ * Enabling a direction whose ring and IRQ stride are unchanged since its last
+ * stop reuses the table the gateware kept, the engine resumes at the
+ * descriptor after the last completed one and countTotal carries on from
+ * there. Otherwise, or when the table was not kept, it is rewritten and the
+ * engine starts at buffer 0 with countTotal 0.
+ */
 typedef struct LitePCIeConfigDmaChannelData {
     uint32_t channel;
     bool enable;
 } __attribute__((packed)) LitePCIeConfigDmaChannelData;
 
+/* a new size or count reallocates the ring, kIOReturnBusy while another
+ * client has it mapped */
+typedef struct LitePCIeConfigDmaGeometryData {
+    uint32_t channel;
+    bool is_reader;
+    uint32_t buffer_size; /* bytes, power of two */
+    uint32_t buffer_count; /* table entries */
+    uint32_t buffer_per_irq; /* IRQ stride in buffers */
+} __attribute__((packed)) LitePCIeConfigDmaGeometryData;
+
+typedef struct LitePCIeConfigDmaCoalesceData {
+    uint32_t channel;
+    bool is_reader;
+    uint32_t mode; /* LitePCIeCoalesceMode */
+    uint32_t buffer_per_irq; /* descriptor IRQ stride, 0 keeps the current one */
+    uint32_t latency_us; /* adaptive mode delivery latency target, 0 for the default */
+} __attribute__((packed)) LitePCIeConfigDmaCoalesceData;
+
+/*
+ * A paused direction keeps its table, its counts and any waiter, the engine
+ * starts the buffer it was on over when it is resumed.
+ */
+typedef struct LitePCIeConfigDmaPauseData {
+    uint32_t channel;
+    bool is_reader;
+    bool pause;
+} __attribute__((packed)) LitePCIeConfigDmaPauseData;
+
+/*
+ * Completion arguments: [0] countTotal when it fired, [1] the count waited
+ * for. One waiter per direction, a new one aborts (kIOReturnAborted) the
+ * previous.
+ */
+typedef struct LitePCIeDmaWaitData {
+    uint32_t channel;
+    bool is_reader;
+    uint64_t count;
+} __attribute__((packed)) LitePCIeDmaWaitData;
+
+#define LITEPCIE_CSR_BATCH_MAX 128 /* ops per call, keeps both structs inline */
+#define LITEPCIE_CSR_POLL_TIMEOUT_US 100000
+
+typedef struct LitePCIeCsrOp {
+    uint32_t type; /* LitePCIeCsrOpType */
+    uint32_t addr;
+    uint32_t value;
+    uint32_t mask;
+} __attribute__((packed)) LitePCIeCsrOp;
+
+typedef struct LitePCIeCsrBatchResult {
+    uint32_t completed; /* ops run, short of the count when a poll timed out */
+    uint32_t value[LITEPCIE_CSR_BATCH_MAX]; /* register value each op left behind */
+} __attribute__((packed)) LitePCIeCsrBatchResult;
+
+#define LITEPCIE_STATS_VERSION 1
+#define LITEPCIE_STATS_SELECTORS 32 /* room for LitePCIeMessageType to grow */
+#define LITEPCIE_STATS_SOURCES 32 /* LITEPCIE_IRQ_MAX_SOURCES */
+
+/* driver counters, the per direction ones live in DMACounts */
+typedef struct LitePCIeStats {
+    uint32_t version; /* LITEPCIE_STATS_VERSION */
+    uint32_t size; /* sizeof(LitePCIeStats) on the driver side */
+    uint64_t time; /* ns, CLOCK_UPTIME_RAW for the dext, the backend clock otherwise */
+    uint32_t sources; /* interrupt sources in use */
+    uint32_t reserved;
+    uint64_t calls[LITEPCIE_STATS_SELECTORS]; /* ExternalMethod calls by selector */
+    uint64_t interrupts[LITEPCIE_STATS_SOURCES]; /* by interrupt source */
+    uint64_t vectorReads[LITEPCIE_STATS_SOURCES];
+} LitePCIeStats;
+
 typedef struct LitePCIeFlashCallData {
     uint32_t tx_len; /* 8 to 40 */
     uint64_t tx_data; /* 8 to 40 bits */
     uint64_t rx_data; /* 40 bits */
 } __attribute__((packed)) LitePCIeFlashCallData;
 
+#define LITEPCIE_FLASH_PAGE_SIZE 256
+#define LITEPCIE_FLASH_PROGRAM_MAX (8 * LITEPCIE_FLASH_PAGE_SIZE) /* per call, keeps the struct inline */
+#define LITEPCIE_FLASH_READ_MAX (1 << 20) /* per call, larger outputs come as a client buffer descriptor */
+#define LITEPCIE_FLASH_PROGRAM_TIMEOUT_US 100000 /* page program, datasheets give a few ms at most */
+#define LITEPCIE_FLASH_ERASE_TIMEOUT_US 4000000 /* up to a 64 KB sector */
+#define LITEPCIE_FLASH_CHIP_ERASE_TIMEOUT_US 250000000 /* 3 byte addressing stops at 128 Mbit parts, up to 250 s */
+
+/*
+ * Flash commands wait for the previous one to clear WIP before they start,
+ * not after. A program call returns as soon as its last page is on the way,
+ * the client stages the next pages while it programs, and the read it
+ * verifies with waits for it first.
+ */
+
+/* size bytes from addr on, split at page boundaries */
+typedef struct LitePCIeFlashProgramData {
+    uint32_t addr;
+    uint32_t size;
+    uint8_t data[LITEPCIE_FLASH_PROGRAM_MAX];
+} __attribute__((packed)) LitePCIeFlashProgramData;
+
+typedef struct LitePCIeFlashReadData {
+    uint32_t addr;
+    uint32_t size; /* up to LITEPCIE_FLASH_READ_MAX, the output is exactly this long */
+} __attribute__((packed)) LitePCIeFlashReadData;
+
+/* CRC-32 (zlib) of size bytes from addr on, up to LITEPCIE_FLASH_READ_MAX */
+typedef struct LitePCIeFlashCrcData {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t crc; /* in: of the data before, 0 to start, out: including this range */
+} __attribute__((packed)) LitePCIeFlashCrcData;
+
+typedef struct LitePCIeFlashEraseData {
+    uint32_t addr; /* anywhere in the block */
+    uint8_t cmd; /* FLASH_SE_4K, FLASH_SE_32K, FLASH_SE or FLASH_BE */
+} __attribute__((packed)) LitePCIeFlashEraseData;
+
 typedef struct LitePCIeICAPCallData {
     uint8_t addr;
     uint32_t data;
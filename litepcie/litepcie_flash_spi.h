@@ -0,0 +1,100 @@
+#ifndef litepcie_flash_spi_h
+#define litepcie_flash_spi_h
+
+#include <stdint.h>
+
+/*
+ * SPI flash commands and the framing of the flash SPI core, shared by the
+ * dext and liblitepcie.
+ *
+ * The core shifts up to 40 bits per transfer. MOSI goes out MSB first from
+ * bit 39 down, MISO comes back LSB aligned. With chip select held low by
+ * software (CSR_FLASH_CS_N_OUT) consecutive transfers form one command.
+ * There is a single MOSI and a single MISO line, so the dual and quad
+ * output reads (0x3B/0x6B) are out of reach, FLASH_FAST_READ is the fastest
+ * read it can do.
+ */
+
+#define FLASH_READ_ID_REG 0x9F
+
+#define FLASH_READ    0x03
+#define FLASH_FAST_READ 0x0B /* a dummy byte after the address, full SPI clock */
+#define FLASH_WREN    0x06
+#define FLASH_WRDI    0x04
+#define FLASH_PP      0x02
+#define FLASH_SE      0xD8
+#define FLASH_SE_4K   0x20
+#define FLASH_SE_32K  0x52
+#define FLASH_BE      0xC7
+#define FLASH_RDSR    0x05
+#define FLASH_RDSFDP  0x5A
+#define FLASH_WRSR    0x01
+/* status */
+#define FLASH_WIP     0x01
+
+#define FLASH_SECTOR_SIZE (1 << 16)
+
+/* the erase commands the driver runs and their usual block size (SFDP has the
+ * actual one), 0 for anything else */
+static inline uint32_t litepcie_flash_erase_size(uint8_t cmd)
+{
+    switch (cmd) {
+    case FLASH_SE_4K:
+        return 4 << 10;
+    case FLASH_SE_32K:
+        return 32 << 10;
+    case FLASH_SE:
+        return 64 << 10;
+    case FLASH_BE:
+        return UINT32_MAX; /* whole chip */
+    default:
+        return 0;
+    }
+}
+
+#define LITEPCIE_FLASH_SPI_MAX_BITS  40
+#define LITEPCIE_FLASH_SPI_MAX_BYTES (LITEPCIE_FLASH_SPI_MAX_BITS / 8)
+
+/* command byte and 24 bit address, a 32 bit transfer, or 40 bits with the
+ * (zero) dummy byte of FLASH_FAST_READ and FLASH_RDSFDP */
+static inline uint64_t litepcie_flash_spi_cmd(uint8_t cmd, uint32_t addr)
+{
+    return ((uint64_t)cmd << 32) | ((uint64_t)(addr & 0xffffff) << 8);
+}
+
+/* up to LITEPCIE_FLASH_SPI_MAX_BYTES bytes, first one out first */
+static inline uint64_t litepcie_flash_spi_pack(const uint8_t *data, uint32_t count)
+{
+    uint64_t mosi = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+        mosi |= (uint64_t)data[i] << (32 - 8 * i);
+    return mosi;
+}
+
+static inline void litepcie_flash_spi_unpack(uint64_t miso, uint8_t *data, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        data[i] = (uint8_t)(miso >> (8 * (count - 1 - i)));
+}
+
+/* CRC-32 as zlib computes it, crc is 0 to start or the result of the data
+ * before, so ranges can be summed in pieces. A nibble at a time, a 16 entry
+ * table stays cheap in the dext and still keeps up with the SPI clock */
+static inline uint32_t litepcie_crc32(uint32_t crc, const uint8_t *data, uint32_t size)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    crc = ~crc;
+    for (uint32_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+        crc = (crc >> 4) ^ table[crc & 0xf];
+    }
+    return ~crc;
+}
+
+#endif /* litepcie_flash_spi_h */
@@ -2,11 +2,16 @@
 #define structs_h
 
 #include "litepcie_ext.h"
+#include "litepcie_dma_coalesce.h"
+#include "litepcie_dma_progress.h"
 
 #define SPI_TIMEOUT 100000 /* in us */
 #define SPI_CTRL_START 0x1
 #define SPI_CTRL_LENGTH (1<<8)
 #define SPI_STATUS_DONE 0x1
+#define FLASH_ERASE_POLL_US 1000 /* sleeps, see FlashWaitReady */
+#define FLASH_CHIP_ERASE_POLL_US 100000
+#define FLASH_CRC_CHUNK 1024 /* bytes per fast read of a CRC, on the stack */
 
 struct DMADescriptor {
     union {
@@ -29,27 +34,74 @@ union DMALoopStatus {
     uint32_t raw;
 };
 
+struct DMARing {
+    IODMACommand* command;
+    IOBufferMemoryDescriptor* buffer;
+    IOAddressSegment virtualSegment;
+    uint64_t* busAddresses;
+
+    uint32_t bufferSize;
+    uint32_t bufferCount;
+    uint32_t bufferPerIrq;
+
+    // this direction's block in the shared counts page, and the last loop
+    // status count folded into it
+    DMAProgress* progress;
+    uint64_t hwCountPrev;
+
+    // statistics block next to it, and the previous IRQ for the interval histogram
+    DMAStats* stats;
+    uint64_t irqTimePrev; // ns
+
+    // FIFO and table levels, sampled from the IRQ path
+    DMALevels* levels;
+
+    // slots the client holds, checked against every service
+    const DMAHostCursor* host;
+
+    // the hardware table still holds this ring's descriptors with this IRQ
+    // stride, stopping only gates the engine so a restart can skip rewriting
+    // it. Rewound once it was rewritten and the engine starts over at buffer 0
+    bool tableValid;
+    bool tableRewound;
+    uint32_t tableStride;
+
+    // adaptive coalescing, lock serializes the IRQ handler and the holdoff timer
+    litepcie_dma_coalesce coalesce;
+    IOLock* lock;
+    bool heldOff;
+    uint64_t holdoffDeadline; // mach absolute time
+
+    // user client waiting for countTotal to reach waitCount, guarded by lock
+    IOUserClient* waitClient;
+    OSAction* waitAction;
+    uint64_t waitCount;
+
+    // user clients holding a descriptor of the ring, it is not reallocated
+    // under them. Guarded by lock
+    uint32_t mapClients;
+};
+
 struct DMAChannel {
     uint64_t baseAddress;
     
     IOBufferMemoryDescriptor* dmaCountsBuffer;
     DMACounts* dmaCounts;
 
+    // zero-copy cursors, written by the client
+    IOBufferMemoryDescriptor* dmaHostBuffer;
+    DMAHost* dmaHost;
+
     uint32_t readerInterrupt;
     uint32_t writerInterrupt;
     
     bool readerEnabled;
     bool writerEnabled;
+    bool readerPaused;
+    bool writerPaused;
 
-    IODMACommand** dmaReaderCommands;
-    IOBufferMemoryDescriptor** dmaReaderBuffers;
-    IOAddressSegment** dmaReaderVirtualSegments;
-    IOAddressSegment** dmaReaderPhysicalSegments;
-
-    IODMACommand** dmaWriterCommands;
-    IOBufferMemoryDescriptor** dmaWriterBuffers;
-    IOAddressSegment** dmaWriterVirtualSegments;
-    IOAddressSegment** dmaWriterPhysicalSegments;
+    DMARing reader;
+    DMARing writer;
 };
 
 #endif /* structs_h */
@@ -0,0 +1,101 @@
+#ifndef litepcie_irq_route_h
+#define litepcie_irq_route_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "litepcie_dma_common.h"
+
+/*
+ * MSI vector routing.
+ *
+ * Maps the interrupt sources the host granted onto the DMA channel IRQ bits.
+ * With a multi-vector MSI core and enough vectors every IRQ bit gets its own
+ * source (MSI vector n carries IRQ bit n) and the handler knows what fired
+ * without touching the device. Otherwise everything shares source 0 and the
+ * handler has to decode the MSI vector register.
+ */
+
+#define LITEPCIE_IRQ_MAX_SOURCES 32
+
+struct litepcie_irq_target {
+    uint8_t channel;
+    uint8_t is_reader;
+    uint8_t valid;
+};
+
+struct litepcie_irq_route {
+    uint32_t sources;
+    bool shared; /* one source for every bit, decode the vector register */
+    uint32_t mask[LITEPCIE_IRQ_MAX_SOURCES]; /* IRQ bits serviced by each source */
+    struct litepcie_irq_target target[32]; /* IRQ bit -> channel direction */
+};
+
+/* vectors is how many interrupt sources the host granted, returns -1 if the channels can't be routed */
+static inline int litepcie_irq_route_build(struct litepcie_irq_route *route, uint32_t channels, uint32_t vectors, bool multi_vector)
+{
+    uint32_t all = 0, top = 0;
+
+    route->sources = 0;
+    route->shared = true;
+    for (uint32_t i = 0; i < LITEPCIE_IRQ_MAX_SOURCES; i++)
+        route->mask[i] = 0;
+    for (uint32_t i = 0; i < 32; i++)
+        route->target[i].valid = 0;
+
+    if (vectors == 0)
+        return -1;
+
+    for (uint32_t ch = 0; ch < channels; ch++) {
+        uint32_t r = litepcie_dma_reader_irq(ch);
+        uint32_t w = litepcie_dma_writer_irq(ch);
+
+        if (r >= 32 || w >= 32 || route->target[r].valid || route->target[w].valid)
+            return -1;
+
+        route->target[r].channel = ch;
+        route->target[r].is_reader = 1;
+        route->target[r].valid = 1;
+        route->target[w].channel = ch;
+        route->target[w].is_reader = 0;
+        route->target[w].valid = 1;
+
+        all |= (1u << r) | (1u << w);
+        if (r + 1 > top)
+            top = r + 1;
+        if (w + 1 > top)
+            top = w + 1;
+    }
+
+    if (multi_vector && vectors >= top && top <= LITEPCIE_IRQ_MAX_SOURCES) {
+        route->shared = false;
+        route->sources = top;
+        for (uint32_t i = 0; i < top; i++)
+            route->mask[i] = all & (1u << i);
+    } else {
+        route->shared = true;
+        route->sources = 1;
+        route->mask[0] = all;
+    }
+
+    return 0;
+}
+
+/* pops the lowest pending IRQ bit, returns its target or NULL once nothing routed is left */
+static inline const struct litepcie_irq_target *litepcie_irq_route_next(const struct litepcie_irq_route *route, uint32_t *pending, uint32_t *bit)
+{
+    while (*pending != 0) {
+        uint32_t i = __builtin_ctz(*pending);
+
+        *pending &= *pending - 1;
+        if (route->target[i].valid) {
+            if (bit)
+                *bit = i;
+            return &route->target[i];
+        }
+    }
+
+    return NULL;
+}
+
+#endif /* litepcie_irq_route_h */
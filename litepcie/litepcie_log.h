@@ -0,0 +1,56 @@
+#ifndef litepcie_log_h
+#define litepcie_log_h
+
+#include <os/log.h>
+
+/*
+ * Leveled unified logging for the dext.
+ *
+ * Levels above LITEPCIE_LOG_LEVEL expand to an empty statement, their
+ * arguments are never evaluated, so tracing can stay in hot paths. Build with
+ * -DLITEPCIE_LOG_LEVEL=LITEPCIE_LOG_LEVEL_TRACE to see every method entry and
+ * exit again. Things that happen per call or per IRQ are counted instead and
+ * read back with LITEPCIE_GET_STATS.
+ */
+
+#define LITEPCIE_LOG_LEVEL_NONE  0
+#define LITEPCIE_LOG_LEVEL_ERROR 1
+#define LITEPCIE_LOG_LEVEL_INFO  2
+#define LITEPCIE_LOG_LEVEL_DEBUG 3
+#define LITEPCIE_LOG_LEVEL_TRACE 4
+
+#ifndef LITEPCIE_LOG_LEVEL
+#ifdef DEBUG
+#define LITEPCIE_LOG_LEVEL LITEPCIE_LOG_LEVEL_DEBUG
+#else
+#define LITEPCIE_LOG_LEVEL LITEPCIE_LOG_LEVEL_INFO
+#endif
+#endif
+
+#define LITEPCIE_LOG_NOTHING() do { } while (0)
+
+#if LITEPCIE_LOG_LEVEL >= LITEPCIE_LOG_LEVEL_ERROR
+#define LITEPCIE_LOG_ERROR(fmt, ...) os_log_error(OS_LOG_DEFAULT, fmt, ##__VA_ARGS__)
+#else
+#define LITEPCIE_LOG_ERROR(fmt, ...) LITEPCIE_LOG_NOTHING()
+#endif
+
+#if LITEPCIE_LOG_LEVEL >= LITEPCIE_LOG_LEVEL_INFO
+#define LITEPCIE_LOG_INFO(fmt, ...) os_log(OS_LOG_DEFAULT, fmt, ##__VA_ARGS__)
+#else
+#define LITEPCIE_LOG_INFO(fmt, ...) LITEPCIE_LOG_NOTHING()
+#endif
+
+#if LITEPCIE_LOG_LEVEL >= LITEPCIE_LOG_LEVEL_DEBUG
+#define LITEPCIE_LOG_DEBUG(fmt, ...) os_log_debug(OS_LOG_DEFAULT, fmt, ##__VA_ARGS__)
+#else
+#define LITEPCIE_LOG_DEBUG(fmt, ...) LITEPCIE_LOG_NOTHING()
+#endif
+
+#if LITEPCIE_LOG_LEVEL >= LITEPCIE_LOG_LEVEL_TRACE
+#define LITEPCIE_LOG_TRACE(fmt, ...) os_log_debug(OS_LOG_DEFAULT, fmt, ##__VA_ARGS__)
+#else
+#define LITEPCIE_LOG_TRACE(fmt, ...) LITEPCIE_LOG_NOTHING()
+#endif
+
+#endif /* litepcie_log_h */
@@ -1,5 +1,3 @@
-#include <os/log.h>
-
 #include <DriverKit/IOLib.h>
 #include <DriverKit/IOMemoryMap.h>
 #include <DriverKit/IOTimerDispatchSource.h>
@@ -13,36 +11,41 @@
 #include "litepcie.h"
 #include "litepcie_int.h"
 #include "litepcie_ext.h"
+#include "litepcie_log.h"
 #include "litepcie_userclient.h"
 
-#define Log(fmt, ...) os_log(OS_LOG_DEFAULT, "litepcie_userclient::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define Log(fmt, ...) LITEPCIE_LOG_INFO("litepcie_userclient::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LogError(fmt, ...) LITEPCIE_LOG_ERROR("litepcie_userclient::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LogDebug(fmt, ...) LITEPCIE_LOG_DEBUG("litepcie_userclient::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
+#define LogTrace(fmt, ...) LITEPCIE_LOG_TRACE("litepcie_userclient::%s - " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 
 struct litepcie_userclient_IVars {
     litepcie* litepcie = nullptr;
     IOBufferMemoryDescriptor* rdma[16] = {nullptr};
     IOBufferMemoryDescriptor* wdma[16] = {nullptr};
     IOBufferMemoryDescriptor* cdma[16] = {nullptr};
+    IOBufferMemoryDescriptor* hdma[16] = {nullptr};
 };
 
 bool litepcie_userclient::init(void)
 {
     bool result = false;
 
-    Log("entered");
+    LogTrace("entered");
 
     result = super::init();
     if (result != true) {
-        Log("super::init failed.");
+        LogError("super::init failed.");
         goto Exit;
     }
 
     ivars = IONewZero(litepcie_userclient_IVars, 1);
     if (ivars == nullptr) {
-        Log("failed to allocate memory for ivars");
+        LogError("failed to allocate memory for ivars");
         goto Exit;
     }
 
-    Log("finished.");
+    LogTrace("finished.");
     return true;
 
 Exit:
@@ -54,24 +57,24 @@ IMPL(litepcie_userclient, Start)
 {
     kern_return_t ret = kIOReturnSuccess;
 
-    Log("entered");
+    LogTrace("entered");
 
     ret = super::Start(provider, SUPERDISPATCH);
     if (ret != kIOReturnSuccess) {
-        Log("super::Start failed with error: 0x%08x", ret);
+        LogError("super::Start failed with error: 0x%08x", ret);
         goto Exit;
     }
 
     // try to cast the provider object to a PCI device because thats what it should be
     ivars->litepcie = OSDynamicCast(litepcie, provider);
     if (ivars->litepcie == NULL) {
-        Log("failed to cast provider litepcie driver");
+        LogError("failed to cast provider litepcie driver");
         ret = kIOReturnNoDevice;
         goto Exit;
     }
 
 Exit:
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
@@ -80,43 +83,58 @@ IMPL(litepcie_userclient, Stop)
 {
     kern_return_t ret = kIOReturnSuccess;
 
-    Log("entered");
+    LogTrace("entered");
+
+    if (ivars->litepcie != nullptr) {
+        ivars->litepcie->CancelDMAWaiters(this);
+    }
     
     for (int i = 0; i < 16; i += 1) {
         if (ivars->rdma[i] != nullptr) {
             ivars->rdma[i]->release();
+            if (ivars->litepcie != nullptr) {
+                ivars->litepcie->ReleaseDMABufferDescriptor(i, true);
+            }
         }
 
         if (ivars->wdma[i] != nullptr) {
             ivars->wdma[i]->release();
+            if (ivars->litepcie != nullptr) {
+                ivars->litepcie->ReleaseDMABufferDescriptor(i, false);
+            }
         }
         
         if (ivars->cdma[i] != nullptr) {
             ivars->cdma[i]->release();
         }
+
+        if (ivars->hdma[i] != nullptr) {
+            ivars->hdma[i]->release();
+        }
     }
 
-    Log("finished");
+    LogTrace("finished");
 
     return ret;
 }
 
 void litepcie_userclient::free(void)
 {
-    Log("free() entered");
+    LogTrace("free() entered");
 
     IOSafeDeleteNULL(ivars, litepcie_userclient_IVars, 1);
 
     super::free();
 
-    Log("free() finished");
+    LogTrace("free() finished");
 }
 
 kern_return_t litepcie_userclient::ExternalMethod(uint64_t selector, IOUserClientMethodArguments* arguments, const IOUserClientMethodDispatch* dispatch, OSObject* target, void* reference)
 {
     kern_return_t ret = kIOReturnSuccess;
-    Log("ExternalMethod() entered");
-    Log("ExternalMethod() selector: %lli", selector);
+    LogTrace("ExternalMethod() entered");
+    LogTrace("ExternalMethod() selector: %lli", selector);
+    ivars->litepcie->CountExternalMethod(selector);
 
     switch (selector) {
     case LITEPCIE_CONFIG_DMA_READER_CHANNEL: {
@@ -137,26 +155,59 @@ kern_return_t litepcie_userclient::ExternalMethod(uint64_t selector, IOUserClien
     case LITEPCIE_FLASH: {
         ret = HandleFlash(arguments);
     } break;
+    case LITEPCIE_CONFIG_DMA_GEOMETRY: {
+        ret = HandleConfigDmaGeometry(arguments);
+    } break;
+    case LITEPCIE_CONFIG_DMA_COALESCE: {
+        ret = HandleConfigDmaCoalesce(arguments);
+    } break;
+    case LITEPCIE_DMA_WAIT: {
+        ret = HandleDmaWait(arguments);
+    } break;
+    case LITEPCIE_CSR_BATCH: {
+        ret = HandleCsrBatch(arguments);
+    } break;
+    case LITEPCIE_GET_STATS: {
+        ret = HandleGetStats(arguments);
+    } break;
+    case LITEPCIE_GET_DMA_STATS: {
+        ret = HandleGetDmaStats(arguments);
+    } break;
+    case LITEPCIE_CONFIG_DMA_PAUSE: {
+        ret = HandleConfigDmaPause(arguments);
+    } break;
+    case LITEPCIE_FLASH_PROGRAM: {
+        ret = HandleFlashProgram(arguments);
+    } break;
+    case LITEPCIE_FLASH_READ: {
+        ret = HandleFlashRead(arguments);
+    } break;
+    case LITEPCIE_FLASH_ERASE: {
+        ret = HandleFlashErase(arguments);
+    } break;
+    case LITEPCIE_FLASH_CRC: {
+        ret = HandleFlashCrc(arguments);
+    } break;
 
     default:
         break;
     }
 
 Exit:
-    Log("ExternalMethod() finished");
+    LogTrace("ExternalMethod() finished");
     return ret;
 }
 
 kern_return_t litepcie_userclient::HandleConfigDmaChannel(IOUserClientMethodArguments* arguments, bool is_reader)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
     LitePCIeConfigDmaChannelData* input;
 
     // bunch of checks to see if out input is valid on multiple levels
     if (arguments == nullptr) {
-        Log("Arguments were null");
+        LogError("Arguments were null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -164,13 +215,13 @@ kern_return_t litepcie_userclient::HandleConfigDmaChannel(IOUserClientMethodArgu
     if (arguments->structureInput != nullptr) {
         input = (LitePCIeConfigDmaChannelData*)arguments->structureInput->getBytesNoCopy();
     } else {
-        Log("structureInput was null");
+        LogError("structureInput was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
 
-    if (input == nullptr) {
-        Log("input struct was null");
+    if (input == nullptr || input->channel >= DMA_CHANNEL_COUNT) {
+        LogError("input struct was null or channel out of range");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -178,7 +229,10 @@ kern_return_t litepcie_userclient::HandleConfigDmaChannel(IOUserClientMethodArgu
     if (is_reader) {
         if (ivars->litepcie->IsDMAReaderChannelEnabled(input->channel) != input->enable) {
             if (input->enable){
-                ivars->litepcie->SetupDMAReaderChannel(input->channel);
+                ret = ivars->litepcie->SetupDMAReaderChannel(input->channel);
+                if (ret != kIOReturnSuccess) {
+                    goto Exit;
+                }
                 ivars->litepcie->StartDMAReaderChannel(input->channel, true);
             } else {
                 ivars->litepcie->StopDMAReaderChannel(input->channel);
@@ -187,7 +241,10 @@ kern_return_t litepcie_userclient::HandleConfigDmaChannel(IOUserClientMethodArgu
     } else {
         if (ivars->litepcie->IsDMAWriterChannelEnabled(input->channel) != input->enable) {
             if (input->enable){
-                ivars->litepcie->SetupDMAWriterChannel(input->channel);
+                ret = ivars->litepcie->SetupDMAWriterChannel(input->channel);
+                if (ret != kIOReturnSuccess) {
+                    goto Exit;
+                }
                 ivars->litepcie->StartDMAWriterChannel(input->channel, true);
             } else {
                 ivars->litepcie->StopDMAWriterChannel(input->channel);
@@ -196,13 +253,161 @@ kern_return_t litepcie_userclient::HandleConfigDmaChannel(IOUserClientMethodArgu
     }
     
 Exit:
-    Log("finished");
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleConfigDmaGeometry(IOUserClientMethodArguments* arguments)
+{
+    LogTrace("entered");
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeConfigDmaGeometryData* input;
+
+    // bunch of checks to see if out input is valid on multiple levels
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeConfigDmaGeometryData)) {
+        input = (LitePCIeConfigDmaGeometryData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (input == nullptr || input->channel >= DMA_CHANNEL_COUNT) {
+        LogError("input struct was null or channel out of range");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    // our own reference doesn't keep the ring, the next map picks up the
+    // new one. Other clients' do, the driver refuses while they hold one
+    if (input->is_reader && ivars->rdma[input->channel] != nullptr) {
+        OSSafeReleaseNULL(ivars->rdma[input->channel]);
+        ivars->litepcie->ReleaseDMABufferDescriptor(input->channel, true);
+    } else if (!input->is_reader && ivars->wdma[input->channel] != nullptr) {
+        OSSafeReleaseNULL(ivars->wdma[input->channel]);
+        ivars->litepcie->ReleaseDMABufferDescriptor(input->channel, false);
+    }
+
+    ret = ivars->litepcie->SetDMAGeometry(input->channel, input->is_reader, input->buffer_size, input->buffer_count, input->buffer_per_irq);
+
+Exit:
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleConfigDmaCoalesce(IOUserClientMethodArguments* arguments)
+{
+    LogTrace("entered");
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeConfigDmaCoalesceData* input;
+
+    // bunch of checks to see if out input is valid on multiple levels
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeConfigDmaCoalesceData)) {
+        input = (LitePCIeConfigDmaCoalesceData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (input == nullptr || input->channel >= DMA_CHANNEL_COUNT) {
+        LogError("input struct was null or channel out of range");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->SetDMACoalesce(input->channel, input->is_reader, input->mode, input->buffer_per_irq, input->latency_us);
+
+Exit:
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleConfigDmaPause(IOUserClientMethodArguments* arguments)
+{
+    LogTrace("entered");
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeConfigDmaPauseData* input;
+
+    // arm/disarm path, called many times per second
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeConfigDmaPauseData)) {
+        input = (LitePCIeConfigDmaPauseData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (input == nullptr || input->channel >= DMA_CHANNEL_COUNT) {
+        LogError("input struct was null or channel out of range");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->PauseDMAChannel(input->channel, input->is_reader, input->pause);
+
+Exit:
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleDmaWait(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeDmaWaitData* input;
+
+    // called once per wait, keep the fast path quiet
+    if (arguments == nullptr || arguments->completion == nullptr) {
+        LogError("Arguments or completion were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeDmaWaitData)) {
+        input = (LitePCIeDmaWaitData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (input == nullptr || input->channel >= DMA_CHANNEL_COUNT) {
+        LogError("input struct was null or channel out of range");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->SetDMAWaiter(input->channel, input->is_reader, input->count, this, arguments->completion);
+
+Exit:
     return ret;
 }
 
 kern_return_t litepcie_userclient::HandleFlash(IOUserClientMethodArguments* arguments)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
     LitePCIeFlashCallData* input;
@@ -210,7 +415,7 @@ kern_return_t litepcie_userclient::HandleFlash(IOUserClientMethodArguments* argu
 
     // bunch of checks to see if out input is valid on multiple levels
     if (arguments == nullptr) {
-        Log("Arguments were null");
+        LogError("Arguments were null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -221,60 +426,185 @@ kern_return_t litepcie_userclient::HandleFlash(IOUserClientMethodArguments* argu
         output.tx_data = input->tx_data;
         output.rx_data = input->rx_data;
     } else {
-        Log("structureInput was null");
+        LogError("structureInput was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
 
     if (input == nullptr) {
-        Log("input struct was null");
+        LogError("input struct was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
     
     if (input->tx_len < 8 || input->tx_len > 40) {
-        Log("tx_len not >= 8 or <= 40");
+        LogError("tx_len not >= 8 or <= 40");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
 
-#ifdef CSR_FLASH_SPI_MOSI_ADDR
-    ivars->litepcie->WriteMemory(CSR_TO_OFFSET(CSR_FLASH_SPI_MOSI_ADDR), input->tx_data >> 32);
-    ivars->litepcie->WriteMemory(CSR_TO_OFFSET(CSR_FLASH_SPI_MOSI_ADDR) + 4, (uint32_t)(input->tx_data & 0xFF'FF'FF'FF));
-    ivars->litepcie->WriteMemory(CSR_TO_OFFSET(CSR_FLASH_SPI_CONTROL_ADDR), SPI_CTRL_START | (input->tx_len * SPI_CTRL_LENGTH));
-    IODelay(16);
-    for (int i = 0; i < SPI_TIMEOUT; i += 1) {
-        uint32_t val;
-        ivars->litepcie->ReadMemory(CSR_TO_OFFSET(CSR_FLASH_SPI_MOSI_ADDR), &val);
-        if(val & SPI_STATUS_DONE) {
-            break;
-        }
-        IODelay(1);
+    ret = ivars->litepcie->FlashTransfer(input->tx_len, input->tx_data, &output.rx_data);
+    if (ret != kIOReturnSuccess) {
+        goto Exit;
     }
-    uint32_t lsb, msb;
-    ivars->litepcie->ReadMemory(CSR_TO_OFFSET(CSR_FLASH_SPI_MISO_ADDR), &msb);
-    ivars->litepcie->ReadMemory(CSR_TO_OFFSET(CSR_FLASH_SPI_MISO_ADDR) + 4, &lsb);
-    output.rx_data = ((uint64_t)msb << 32) | lsb;
-#endif
-    
+
     // send our output out using osdata
     arguments->structureOutput = OSData::withBytes(&output, sizeof(LitePCIeFlashCallData));
 
 Exit:
-    Log("finished");
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleFlashProgram(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    const LitePCIeFlashProgramData* input;
+
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeFlashProgramData)) {
+        input = (const LitePCIeFlashProgramData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->FlashProgram(input->addr, input->data, input->size);
+
+Exit:
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleFlashErase(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    const LitePCIeFlashEraseData* input;
+
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeFlashEraseData)) {
+        input = (const LitePCIeFlashEraseData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->FlashErase(input->addr, input->cmd);
+
+Exit:
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleFlashRead(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    const LitePCIeFlashReadData* input;
+    IOMemoryMap* map = nullptr;
+    uint8_t* data = nullptr;
+    uint32_t dataSize = 0;
+
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeFlashReadData)) {
+        input = (const LitePCIeFlashReadData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (input->size == 0 || input->size > LITEPCIE_FLASH_READ_MAX) {
+        LogError("size %u out of range", input->size);
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    // above the inline struct limit the client buffer comes as a descriptor, read straight into it
+    if (arguments->structureOutputDescriptor != nullptr) {
+        ret = arguments->structureOutputDescriptor->CreateMapping(0, 0, 0, 0, 0, &map);
+        if (ret != kIOReturnSuccess || map->GetLength() < input->size) {
+            LogError("could not map the output buffer: 0x%x", ret);
+            ret = ret != kIOReturnSuccess ? ret : kIOReturnNoSpace;
+            goto Exit;
+        }
+        ret = ivars->litepcie->FlashRead(input->addr, (uint8_t*)map->GetAddress(), input->size);
+        arguments->structureOutputDescriptorSize = input->size;
+    } else {
+        dataSize = input->size;
+        data = IONewZero(uint8_t, dataSize);
+        if (data == nullptr) {
+            ret = kIOReturnNoMemory;
+            goto Exit;
+        }
+        ret = ivars->litepcie->FlashRead(input->addr, data, input->size);
+        if (ret == kIOReturnSuccess) {
+            arguments->structureOutput = OSData::withBytes(data, input->size);
+        }
+    }
+
+Exit:
+    OSSafeReleaseNULL(map);
+    IOSafeDeleteNULL(data, uint8_t, dataSize);
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleFlashCrc(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeFlashCrcData output;
+
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() >= sizeof(LitePCIeFlashCrcData)) {
+        output = *(const LitePCIeFlashCrcData*)arguments->structureInput->getBytesNoCopy();
+    } else {
+        LogError("structureInput was null or too short");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->FlashCrc32(output.addr, output.size, &output.crc);
+    if (ret == kIOReturnSuccess) {
+        arguments->structureOutput = OSData::withBytes(&output, sizeof(LitePCIeFlashCrcData));
+    }
+
+Exit:
     return ret;
 }
 
 kern_return_t litepcie_userclient::HandleICAP(IOUserClientMethodArguments* arguments)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
 
     LitePCIeICAPCallData* input;
 
     // bunch of checks to see if out input is valid on multiple levels
     if (arguments == nullptr) {
-        Log("Arguments were null");
+        LogError("Arguments were null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -282,13 +612,13 @@ kern_return_t litepcie_userclient::HandleICAP(IOUserClientMethodArguments* argum
     if (arguments->structureInput != nullptr) {
         input = (LitePCIeICAPCallData*)arguments->structureInput->getBytesNoCopy();
     } else {
-        Log("structureInput was null");
+        LogError("structureInput was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
 
     if (input == nullptr) {
-        Log("input struct was null");
+        LogError("input struct was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -298,13 +628,13 @@ kern_return_t litepcie_userclient::HandleICAP(IOUserClientMethodArguments* argum
     ivars->litepcie->WriteMemory(CSR_TO_OFFSET(CSR_ICAP_WRITE_ADDR), 1);
 
 Exit:
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie_userclient::HandleReadCSR(IOUserClientMethodArguments* arguments)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
     
     const uint64_t* input;
@@ -312,7 +642,7 @@ kern_return_t litepcie_userclient::HandleReadCSR(IOUserClientMethodArguments* ar
 
     // bunch of checks to see if out input is valid on multiple levels
     if (arguments == nullptr) {
-        Log("Arguments were null");
+        LogError("Arguments were null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -320,7 +650,7 @@ kern_return_t litepcie_userclient::HandleReadCSR(IOUserClientMethodArguments* ar
     if (arguments->scalarInput != nullptr && arguments->scalarInputCount == 1) {
         input = arguments->scalarInput;
     } else {
-        Log("scalarInput was null");
+        LogError("scalarInput was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -330,20 +660,20 @@ kern_return_t litepcie_userclient::HandleReadCSR(IOUserClientMethodArguments* ar
     arguments->scalarOutput[0] = output;
 
 Exit:
-    Log("finished");
+    LogTrace("finished");
     return ret;
 }
 
 kern_return_t litepcie_userclient::HandleWriteCSR(IOUserClientMethodArguments* arguments)
 {
-    Log("entered");
+    LogTrace("entered");
     kern_return_t ret = kIOReturnSuccess;
     
     const uint64_t* input;
 
     // bunch of checks to see if out input is valid on multiple levels
     if (arguments == nullptr) {
-        Log("Arguments were null");
+        LogError("Arguments were null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -351,7 +681,7 @@ kern_return_t litepcie_userclient::HandleWriteCSR(IOUserClientMethodArguments* a
     if (arguments->scalarInput != nullptr && arguments->scalarInputCount == 2) {
         input = arguments->scalarInput;
     } else {
-        Log("scalarInput was null");
+        LogError("scalarInput was null");
         ret = kIOReturnBadArgument;
         goto Exit;
     }
@@ -359,18 +689,144 @@ kern_return_t litepcie_userclient::HandleWriteCSR(IOUserClientMethodArguments* a
     ivars->litepcie->WriteMemory(input[0], (uint32_t)input[1]);
 
 Exit:
-    Log("finished");
+    LogTrace("finished");
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleCsrBatch(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    const LitePCIeCsrOp* input;
+    LitePCIeCsrBatchResult output = {};
+    uint32_t count;
+
+    // bunch of checks to see if out input is valid on multiple levels
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->structureInput != nullptr && arguments->structureInput->getLength() % sizeof(LitePCIeCsrOp) == 0
+        && arguments->structureInput->getLength() / sizeof(LitePCIeCsrOp) <= LITEPCIE_CSR_BATCH_MAX) {
+        input = (const LitePCIeCsrOp*)arguments->structureInput->getBytesNoCopy();
+        count = (uint32_t)(arguments->structureInput->getLength() / sizeof(LitePCIeCsrOp));
+    } else {
+        LogError("structureInput was null or not a whole number of ops");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    for (output.completed = 0; output.completed < count; output.completed += 1) {
+        const LitePCIeCsrOp* op = &input[output.completed];
+        uint32_t value = 0;
+        bool timedOut = false;
+
+        switch (op->type) {
+        case LITEPCIE_CSR_OP_READ:
+            ivars->litepcie->ReadMemory(op->addr, &value);
+            break;
+        case LITEPCIE_CSR_OP_WRITE:
+            ivars->litepcie->WriteMemory(op->addr, op->value);
+            value = op->value;
+            break;
+        case LITEPCIE_CSR_OP_RMW:
+            ivars->litepcie->ReadMemory(op->addr, &value);
+            value = (value & ~op->mask) | (op->value & op->mask);
+            ivars->litepcie->WriteMemory(op->addr, value);
+            break;
+        case LITEPCIE_CSR_OP_POLL:
+            timedOut = true;
+            for (int i = 0; i < LITEPCIE_CSR_POLL_TIMEOUT_US; i += 1) {
+                ivars->litepcie->ReadMemory(op->addr, &value);
+                if ((value & op->mask) == (op->value & op->mask)) {
+                    timedOut = false;
+                    break;
+                }
+                IODelay(1);
+            }
+            break;
+        default:
+            LogError("op %u has unknown type %u", output.completed, op->type);
+            ret = kIOReturnBadArgument;
+            goto Exit;
+        }
+        output.value[output.completed] = value;
+
+        // the caller sees it through completed, the ops after it never ran
+        if (timedOut) {
+            LogError("op %u poll of 0x%x timed out", output.completed, op->addr);
+            break;
+        }
+    }
+
+    arguments->structureOutput = OSData::withBytes(&output, sizeof(LitePCIeCsrBatchResult));
+
+Exit:
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleGetStats(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    LitePCIeStats stats;
+
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ivars->litepcie->CopyStats(&stats);
+    arguments->structureOutput = OSData::withBytes(&stats, sizeof(stats));
+
+Exit:
+    return ret;
+}
+
+kern_return_t litepcie_userclient::HandleGetDmaStats(IOUserClientMethodArguments* arguments)
+{
+    kern_return_t ret = kIOReturnSuccess;
+
+    DMACounts counts;
+
+    if (arguments == nullptr) {
+        LogError("Arguments were null");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    if (arguments->scalarInput == nullptr || arguments->scalarInputCount != 1 || arguments->scalarInput[0] >= DMA_CHANNEL_COUNT) {
+        LogError("scalarInput was null or channel out of range");
+        ret = kIOReturnBadArgument;
+        goto Exit;
+    }
+
+    ret = ivars->litepcie->CopyDMACounts((int)arguments->scalarInput[0], &counts);
+    if (ret != kIOReturnSuccess) {
+        goto Exit;
+    }
+    arguments->structureOutput = OSData::withBytes(&counts, sizeof(counts));
+
+Exit:
     return ret;
 }
 
 kern_return_t IMPL(litepcie_userclient, CopyClientMemoryForType) //(uint64_t type, uint64_t *options, IOMemoryDescriptor **memory)
 {
-    Log("entered");
+    LogTrace("entered");
 
     kern_return_t ret = kIOReturnSuccess;
     
     uint8_t dma_channel = type & 0xF;
-    
+
+    if ((type & (LITEPCIE_DMA_READER | LITEPCIE_DMA_WRITER | LITEPCIE_DMA_COUNTS | LITEPCIE_DMA_HOST)) && dma_channel >= DMA_CHANNEL_COUNT) {
+        LogError("dma channel %u out of range", dma_channel);
+        return kIOReturnBadArgument;
+    }
+
     if (type & LITEPCIE_DMA_READER) {
         if (ivars->rdma[dma_channel] != nullptr) {
             ivars->rdma[dma_channel]->retain();
@@ -378,7 +834,7 @@ kern_return_t IMPL(litepcie_userclient, CopyClientMemoryForType) //(uint64_t typ
         } else {
             ret = ivars->litepcie->CreateReaderBufferDescriptor(dma_channel, (IOMemoryDescriptor**)&(ivars->rdma[dma_channel]));
             if (ret != kIOReturnSuccess) {
-                Log("litepcie::CreateReaderBufferDescriptor failed: 0x%x", ret);
+                LogError("litepcie::CreateReaderBufferDescriptor failed: 0x%x", ret);
             } else {
                 ivars->rdma[dma_channel]->retain();
                 *memory = (IOMemoryDescriptor*)(ivars->rdma[dma_channel]);
@@ -391,7 +847,7 @@ kern_return_t IMPL(litepcie_userclient, CopyClientMemoryForType) //(uint64_t typ
         } else {
             ret = ivars->litepcie->CreateWriterBufferDescriptor(dma_channel, (IOMemoryDescriptor**)&(ivars->wdma[dma_channel]));
             if (ret != kIOReturnSuccess) {
-                Log("litepcie::CreateWriterBufferDescriptor failed: 0x%x", ret);
+                LogError("litepcie::CreateWriterBufferDescriptor failed: 0x%x", ret);
             } else {
                 ivars->wdma[dma_channel]->retain();
                 *memory = (IOMemoryDescriptor*)(ivars->wdma[dma_channel]);
@@ -405,18 +861,38 @@ kern_return_t IMPL(litepcie_userclient, CopyClientMemoryForType) //(uint64_t typ
         } else {
             ret = ivars->litepcie->GetDmaCountDescriptor(dma_channel, (IOMemoryDescriptor**)&(ivars->cdma[dma_channel]));
             if (ret != kIOReturnSuccess) {
-                Log("litepcie::GetDmaCountDescriptor failed: 0x%x", ret);
+                LogError("litepcie::GetDmaCountDescriptor failed: 0x%x", ret);
             } else {
                 ivars->cdma[dma_channel]->retain();
                 *memory = (IOMemoryDescriptor*)(ivars->cdma[dma_channel]);
                 *options |= kIOUserClientMemoryReadOnly;
             }
         }
-    }  else {
+    } else if (type & LITEPCIE_DMA_HOST) {
+        // the client's side of the zero-copy handshake, left writable
+        if (ivars->hdma[dma_channel] != nullptr) {
+            ivars->hdma[dma_channel]->retain();
+            *memory = (IOMemoryDescriptor*)(ivars->hdma[dma_channel]);
+        } else {
+            ret = ivars->litepcie->GetDmaHostDescriptor(dma_channel, (IOMemoryDescriptor**)&(ivars->hdma[dma_channel]));
+            if (ret != kIOReturnSuccess) {
+                LogError("litepcie::GetDmaHostDescriptor failed: 0x%x", ret);
+            } else {
+                ivars->hdma[dma_channel]->retain();
+                *memory = (IOMemoryDescriptor*)(ivars->hdma[dma_channel]);
+            }
+        }
+    } else if (type & LITEPCIE_CSR_MEMORY) {
+        // a fresh reference each time, nothing here outlives the mapping
+        ret = ivars->litepcie->CopyCsrDescriptor(type & 0xF, memory);
+        if (ret != kIOReturnSuccess) {
+            LogError("litepcie::CopyCsrDescriptor failed: 0x%x", ret);
+        }
+    } else {
         ret = this->CopyClientMemoryForType(type, options, memory, SUPERDISPATCH);
     }
 
-    Log("finished");
+    LogTrace("finished");
 
     return ret;
 }
@@ -29,6 +29,7 @@
 
 static char litepcie_device[1024];
 static int litepcie_device_num;
+static uint8_t litepcie_dma_channel;
 
 sig_atomic_t keep_running = 1;
 
@@ -44,6 +45,14 @@ static void info(void)
     int fd;
     int i;
     unsigned char fpga_identifier[256];
+    int identifier[256];
+    struct litepcie_csr_batch batch;
+#ifdef CSR_DNA_BASE
+    int dna[2];
+#endif
+#ifdef CSR_XADC_BASE
+    int xadc[4];
+#endif
 
     fd = litepcie_open(litepcie_device, O_RDWR);
     if (fd < 0) {
@@ -51,29 +60,50 @@ static void info(void)
         exit(1);
     }
 
+    /* Gather everything in one batch, a round trip per register adds up. */
+    litepcie_csr_batch_init(&batch);
+    for (i = 0; i < 256; i ++)
+        identifier[i] = litepcie_csr_batch_read(&batch, CSR_IDENTIFIER_MEM_BASE + 4 * i);
+#ifdef CSR_DNA_BASE
+    dna[0] = litepcie_csr_batch_read(&batch, CSR_DNA_ID_ADDR + 4 * 0);
+    dna[1] = litepcie_csr_batch_read(&batch, CSR_DNA_ID_ADDR + 4 * 1);
+#endif
+#ifdef CSR_XADC_BASE
+    xadc[0] = litepcie_csr_batch_read(&batch, CSR_XADC_TEMPERATURE_ADDR);
+    xadc[1] = litepcie_csr_batch_read(&batch, CSR_XADC_VCCINT_ADDR);
+    xadc[2] = litepcie_csr_batch_read(&batch, CSR_XADC_VCCAUX_ADDR);
+    xadc[3] = litepcie_csr_batch_read(&batch, CSR_XADC_VCCBRAM_ADDR);
+#endif
+    if (litepcie_csr_batch_submit(fd, &batch) != 0) {
+        fprintf(stderr, "CSR batch failed\n");
+        litepcie_csr_batch_free(&batch);
+        litepcie_close(fd);
+        exit(1);
+    }
 
     printf("\e[1m[> FPGA/SoC Information:\e[0m\n");
     printf("------------------------\n");
 
     for (i = 0; i < 256; i ++)
-        fpga_identifier[i] = litepcie_readl(fd, CSR_IDENTIFIER_MEM_BASE + 4 * i);
+        fpga_identifier[i] = litepcie_csr_batch_value(&batch, identifier[i]);
     printf("FPGA Identifier:  %s.\n", fpga_identifier);
 #ifdef CSR_DNA_BASE
     printf("FPGA DNA:         0x%08x%08x\n",
-        litepcie_readl(fd, CSR_DNA_ID_ADDR + 4 * 0),
-        litepcie_readl(fd, CSR_DNA_ID_ADDR + 4 * 1)
+        litepcie_csr_batch_value(&batch, dna[0]),
+        litepcie_csr_batch_value(&batch, dna[1])
     );
 #endif
 #ifdef CSR_XADC_BASE
     printf("FPGA Temperature: %0.1f °C\n",
-           (double)litepcie_readl(fd, CSR_XADC_TEMPERATURE_ADDR) * 503.975/4096 - 273.15);
+           (double)litepcie_csr_batch_value(&batch, xadc[0]) * 503.975/4096 - 273.15);
     printf("FPGA VCC-INT:     %0.2f V\n",
-           (double)litepcie_readl(fd, CSR_XADC_VCCINT_ADDR) / 4096 * 3);
+           (double)litepcie_csr_batch_value(&batch, xadc[1]) / 4096 * 3);
     printf("FPGA VCC-AUX:     %0.2f V\n",
-           (double)litepcie_readl(fd, CSR_XADC_VCCAUX_ADDR) / 4096 * 3);
+           (double)litepcie_csr_batch_value(&batch, xadc[2]) / 4096 * 3);
     printf("FPGA VCC-BRAM:    %0.2f V\n",
-           (double)litepcie_readl(fd, CSR_XADC_VCCBRAM_ADDR) / 4096 * 3);
+           (double)litepcie_csr_batch_value(&batch, xadc[3]) / 4096 * 3);
 #endif
+    litepcie_csr_batch_free(&batch);
     litepcie_close(fd);
 }
 
@@ -105,7 +135,7 @@ void scratch_test(void)
     printf("Read: 0x%08x\n", litepcie_readl(fd, CSR_CTRL_SCRATCH_ADDR));
 
     /* Close LitePCIe device. */
-    close(fd);
+    litepcie_close(fd);
 }
 
 /* SPI Flash */
@@ -122,9 +152,10 @@ static void flash_progress(void *opaque, const char *fmt, ...)
     va_end(ap);
 }
 
-static void flash_program(uint32_t base, const uint8_t *buf1, int size1)
+static void flash_program(uint32_t base, const uint8_t *buf1, int size1, uint8_t update)
 {
     int fd;
+    struct litepcie_flash_update_stats stats;
 
     uint32_t size;
     uint8_t *buf;
@@ -132,7 +163,7 @@ static void flash_program(uint32_t base, const uint8_t *buf1, int size1)
     int errors;
 
     /* Open LitePCIe device. */
-    fd = open(litepcie_device, O_RDWR);
+    fd = litepcie_open(litepcie_device, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Could not init driver\n");
         exit(1);
@@ -150,9 +181,15 @@ static void flash_program(uint32_t base, const uint8_t *buf1, int size1)
     }
     memcpy(buf, buf1, size1);
 
-    /* Program flash. */
+    /* Program flash, or only the sectors that changed. */
     printf("Programming (%d bytes at 0x%08x)...\n", size, base);
-    errors = litepcie_flash_write(fd, buf, base, size, flash_progress, NULL);
+    if (update) {
+        errors = litepcie_flash_update(fd, buf, base, size, &stats, flash_progress, NULL);
+        printf("Blocks: %u, %u unchanged, %u erased in %u commands, %u pages programmed.\n",
+               stats.blocks, stats.unchanged, stats.erased, stats.erase_ops, stats.pages);
+    } else {
+        errors = litepcie_flash_write(fd, buf, base, size, flash_progress, NULL);
+    }
     if (errors) {
         printf("Failed %d errors.\n", errors);
         exit(1);
@@ -162,10 +199,10 @@ static void flash_program(uint32_t base, const uint8_t *buf1, int size1)
 
     /* Free buffer and close LitePCIe device. */
     free(buf);
-    close(fd);
+    litepcie_close(fd);
 }
 
-static void flash_write(const char *filename, uint32_t offset)
+static void flash_write(const char *filename, uint32_t offset, uint8_t update)
 {
     uint8_t *data;
     int size;
@@ -194,7 +231,7 @@ static void flash_write(const char *filename, uint32_t offset)
     if (ret != 1)
         perror(filename);
     else
-        flash_program(offset, data, size);
+        flash_program(offset, data, size, update);
 
     /* Free buffer */
     free(data);
@@ -206,8 +243,8 @@ static void flash_read(const char *filename, uint32_t size, uint32_t offset)
     FILE * f;
     uint32_t base;
     uint32_t sector_size;
-    uint8_t byte;
-    int i;
+    uint8_t *sector;
+    uint32_t i, n;
 
     /* Open data destination file. */
     f = fopen(filename, "wb");
@@ -217,29 +254,90 @@ static void flash_read(const char *filename, uint32_t size, uint32_t offset)
     }
 
     /* Open LitePCIe device. */
-    fd = open(litepcie_device, O_RDWR);
+    fd = litepcie_open(litepcie_device, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Could not init driver\n");
         exit(1);
     }
 
-    /* Get flash sector size. */
-    sector_size = litepcie_flash_get_erase_block_size(fd);
+    /* Read in sector sized calls, progress per call. */
+    sector_size = FLASH_SECTOR_SIZE;
 
-    /* Read flash and write to destination file. */
+    sector = malloc(sector_size);
+    if (!sector) {
+        fprintf(stderr, "Could not allocate read buffer\n");
+        exit(1);
+    }
+
+    /* Read flash a sector at a time and write to destination file. */
     base = offset;
-    for (i = 0; i < size; i++) {
-        if ((i % sector_size) == 0) {
-            printf("Reading 0x%08x\r", base + i);
-            fflush(stdout);
+    for (i = 0; i < size; i += n) {
+        printf("Reading 0x%08x\r", base + i);
+        fflush(stdout);
+        n = size - i < sector_size ? size - i : sector_size;
+        if (litepcie_flash_read_buffer(fd, base + i, sector, n) != 0) {
+            fprintf(stderr, "Could not read flash at 0x%08x\n", base + i);
+            exit(1);
         }
-        byte = litepcie_flash_read(fd, base + i);
-        fwrite(&byte, 1, 1, f);
+        fwrite(sector, 1, n, f);
     }
 
     /* Close destination file and LitePCIe device. */
+    free(sector);
     fclose(f);
-    close(fd);
+    litepcie_close(fd);
+}
+
+static void flash_verify(const char *filename, uint32_t offset)
+{
+    int fd;
+    FILE * f;
+    uint8_t *data;
+    int size;
+    uint32_t file_crc, flash_crc;
+
+    /* Open source file and checksum it. */
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fseek(f, 0L, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0L, SEEK_SET);
+    data = malloc(size);
+    if (!data) {
+        fprintf(stderr, "%d: malloc failed\n", __LINE__);
+        exit(1);
+    }
+    if (fread(data, size, 1, f) != 1) {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
+    file_crc = litepcie_crc32(0, data, size);
+    free(data);
+
+    /* Open LitePCIe device. */
+    fd = litepcie_open(litepcie_device, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    /* Checksum the same range of the flash, in the driver when it can. */
+    if (litepcie_flash_crc32(fd, offset, size, &flash_crc) != 0) {
+        fprintf(stderr, "Could not read flash\n");
+        exit(1);
+    }
+    litepcie_close(fd);
+
+    printf("File CRC32: 0x%08x, flash CRC32 (%d bytes at 0x%08x): 0x%08x.\n", file_crc, size, offset, flash_crc);
+    if (file_crc != flash_crc) {
+        printf("Mismatch.\n");
+        exit(1);
+    }
+    printf("Match.\n");
 }
 
 static void flash_reload(void)
@@ -247,7 +345,7 @@ static void flash_reload(void)
     int fd;
 
     /* Open LitePCIe device. */
-    fd = open(litepcie_device, O_RDWR);
+    fd = litepcie_open(litepcie_device, O_RDWR);
     if (fd < 0) {
         fprintf(stderr, "Could not init driver\n");
         exit(1);
@@ -262,7 +360,7 @@ static void flash_reload(void)
     printf("================================================================\n");
 
     /* Close LitePCIe device. */
-    close(fd);
+    litepcie_close(fd);
 }
 #endif
 
@@ -319,7 +417,7 @@ static void write_pn_data(uint32_t *buf, int count, uint32_t *pseed, int data_wi
     seed = *pseed;
     for(i = 0; i < count; i++) {
         buf[i] = (seed_to_data(seed) & mask);
-        seed = add_mod_int(seed, 1, DMA_BUFFER_SIZE / sizeof(uint32_t));
+        seed = add_mod_int(seed, 1, count);
     }
     *pseed = seed;
 }
@@ -336,17 +434,21 @@ static int check_pn_data(const uint32_t *buf, int count, uint32_t *pseed, int da
         if (buf[i] != (seed_to_data(seed) & mask)) {
             errors ++;
         }
-        seed = add_mod_int(seed, 1, DMA_BUFFER_SIZE / sizeof(uint32_t));
+        seed = add_mod_int(seed, 1, count);
     }
     *pseed = seed;
     return errors;
 }
 #endif
 
-static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_width, int auto_rx_delay)
+static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_width, int auto_rx_delay,
+                     struct litepcie_dma_geometry geometry, uint32_t coalesce_latency_us, int64_t wait_spin_us)
 {
     static struct litepcie_dma_ctrl dma = {.use_reader = 1, .use_writer = 1, .dma_channel = 0};
+    dma.dma_channel = litepcie_dma_channel;
     dma.loopback = external_loopback ? 0 : 1;
+    dma.reader_geometry = geometry;
+    dma.writer_geometry = geometry;
 
     if (data_width > 32 || data_width < 1) {
         fprintf(stderr, "Invalid data width %d\n", data_width);
@@ -375,6 +477,47 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
     if (litepcie_dma_init(&dma, litepcie_device, zero_copy))
         exit(1);
 
+    /* Adaptive IRQ coalescing, has to be set before litepcie_dma_start. */
+    if (coalesce_latency_us != 0 &&
+        (litepcie_dma_set_coalesce(&dma, 1, LITEPCIE_COALESCE_ADAPTIVE, 0, coalesce_latency_us) != 0 ||
+         litepcie_dma_set_coalesce(&dma, 0, LITEPCIE_COALESCE_ADAPTIVE, 0, coalesce_latency_us) != 0)) {
+        fprintf(stderr, "Failed to enable IRQ coalescing\n");
+        litepcie_dma_cleanup(&dma);
+        exit(1);
+    }
+
+    if (wait_spin_us >= 0)
+        dma.wait_spin_us = wait_spin_us;
+
+    if (litepcie_dma_start(&dma) != 0) {
+        fprintf(stderr, "Failed to start DMA\n");
+        litepcie_dma_cleanup(&dma);
+        exit(1);
+    }
+
+#ifdef DMA_CHECK_DATA
+    uint32_t rd_words = dma.writer_geometry.buffer_size / sizeof(uint32_t);
+    uint32_t wr_words = dma.reader_geometry.buffer_size / sizeof(uint32_t);
+
+    /* RX is taken a ring's worth at a time, in place with zero_copy, through
+     * staging buffers otherwise */
+    uint32_t rx_batch = dma.writer_geometry.buffer_count;
+    char *rx_stage = NULL, *rx_next = NULL, *tx_stage = NULL;
+    int rx_left = 0;
+    uint8_t tx_staged = 0;
+    uint64_t rx_torn = 0, tx_unfilled = 0;
+
+    if (!zero_copy) {
+        rx_stage = malloc((size_t)rx_batch * dma.writer_geometry.buffer_size);
+        tx_stage = malloc(dma.reader_geometry.buffer_size);
+        if (!rx_stage || !tx_stage) {
+            fprintf(stderr, "Could not allocate staging buffers\n");
+            litepcie_dma_cleanup(&dma);
+            exit(1);
+        }
+    }
+#endif
+
     /* Test loop. */
     last_time = get_time_ms();
     for (;;) {
@@ -382,6 +525,9 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
         if (!keep_running)
             break;
 
+        /* Sleep until the next buffers complete instead of spinning on the counters. */
+        litepcie_dma_wait(&dma, 1, 100000);
+
         /* Update DMA status. */
         litepcie_dma_process(&dma);
 
@@ -395,51 +541,86 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
         char *buf_rd;
 
         /* DMA-TX Write. */
-        while (1) {
-            /* Get Write buffer. */
-            buf_wr = litepcie_dma_next_write_buffer(&dma);
-            /* Break when no buffer available for Write. */
-            if (!buf_wr)
+        while (zero_copy) {
+            /* Get every free Write buffer up to the wrap, fill them in place and hand them to the device. */
+            struct litepcie_dma_span span;
+            if (!litepcie_dma_acquire_write_span(&dma, &span, 0))
                 break;
-            /* Write data to buffer. */
-            write_pn_data((uint32_t *) buf_wr, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_wr, data_width);
+            for (buf_wr = span.data; buf_wr < span.data + (size_t)span.count * dma.reader_geometry.buffer_size;
+                 buf_wr += dma.reader_geometry.buffer_size)
+                write_pn_data((uint32_t *) buf_wr, wr_words, &seed_wr, data_width);
+            tx_unfilled += litepcie_dma_commit_write_span(&dma, &span) == 1;
+        }
+        while (!zero_copy) {
+            /* Fill the staging buffer once, queue it when the ring has room. */
+            if (!tx_staged) {
+                write_pn_data((uint32_t *) tx_stage, wr_words, &seed_wr, data_width);
+                tx_staged = 1;
+            }
+            if (litepcie_dma_write(&dma, tx_stage, 1) != 1)
+                break;
+            tx_staged = 0;
         }
 
         /* DMA-RX Read/Check */
         while (1) {
             /* Get Read buffer. */
-            buf_rd = litepcie_dma_next_read_buffer(&dma);
+            if (rx_left == 0) {
+                if (zero_copy) {
+                    /* whole span in place, released one buffer at a time below */
+                    struct litepcie_dma_span span;
+                    rx_left = litepcie_dma_acquire_read_span(&dma, &span, 0);
+                    rx_next = span.data;
+                } else {
+                    rx_left = litepcie_dma_read(&dma, rx_stage, rx_batch);
+                    rx_next = rx_stage;
+                }
+            }
+            buf_rd = rx_left > 0 ? rx_next : NULL;
+            if (buf_rd) {
+                rx_next += dma.writer_geometry.buffer_size;
+                rx_left--;
+            }
             /* Break when no buffer available for Read. */
             if (!buf_rd)
                 break;
             /* Skip the first 128 DMA loops. */
-            if (dma.writer_hw_count < 128*DMA_BUFFER_COUNT)
+            if (dma.writer_hw_count < 128*dma.writer_geometry.buffer_count) {
+                /* drop the rest of the span too, it would be stale next time */
+                while (zero_copy && litepcie_dma_release_read_buffer(&dma) >= 0)
+                    ;
+                rx_left = 0;
                 break;
+            }
             /* When running... */
             if (run) {
                 /* Check data in Read buffer. */
-                errors += check_pn_data((uint32_t *) buf_rd, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_rd, data_width);
+                errors += check_pn_data((uint32_t *) buf_rd, rd_words, &seed_rd, data_width);
                 /* Clear Read buffer */
-                memset(buf_rd, 0, DMA_BUFFER_SIZE);
+                memset(buf_rd, 0, dma.writer_geometry.buffer_size);
+                if (zero_copy)
+                    rx_torn += litepcie_dma_release_read_buffer(&dma) == 1;
             } else {
                 /* Find initial Delay/Seed (Useful when loopback is introducing delay). */
                 uint32_t errors_min = 0xffffffff;
-                for (int delay = 0; delay < DMA_BUFFER_SIZE / sizeof(uint32_t); delay++) {
+                for (int delay = 0; delay < rd_words; delay++) {
                     seed_rd = delay;
-                    errors = check_pn_data((uint32_t *) buf_rd, DMA_BUFFER_SIZE / sizeof(uint32_t), &seed_rd, data_width);
+                    errors = check_pn_data((uint32_t *) buf_rd, rd_words, &seed_rd, data_width);
                     //printf("delay: %d / errors: %d\n", delay, errors);
                     if (errors < errors_min)
                         errors_min = errors;
-                    if (errors < (DMA_BUFFER_SIZE / sizeof(uint32_t)) / 2) {
+                    if (errors < rd_words / 2) {
                         printf("RX_DELAY: %d (errors: %d)\n", delay, errors);
                         run = 1;
                         break;
                     }
                 }
+                if (zero_copy)
+                    litepcie_dma_release_read_buffer(&dma);
                 if (!run) {
-                    printf("Unable to find DMA RX_DELAY (min errors: %d/%ld), exiting.\n",
+                    printf("Unable to find DMA RX_DELAY (min errors: %d/%u), exiting.\n",
                         errors_min,
-                        DMA_BUFFER_SIZE / sizeof(uint32_t));
+                        rd_words);
                     goto end;
                 }
             }
@@ -456,7 +637,7 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
             i++;
             /* Print statistics. */
             printf("%14.2f\t%10" PRIu64 "\t%10" PRIu64 "\t%4" PRIi64 "\t%6u\n",
-                   (double)(dma.reader_sw_count - reader_sw_count_last) * DMA_BUFFER_SIZE * 8 * data_width / (get_next_pow2(data_width) * (double)duration * 1e6),
+                   (double)(dma.reader_sw_count - reader_sw_count_last) * dma.reader_geometry.buffer_size * 8 * data_width / (get_next_pow2(data_width) * (double)duration * 1e6),
                    dma.reader_sw_count,
                    dma.writer_sw_count,
                    dma.reader_sw_count - dma.writer_sw_count,
@@ -469,13 +650,132 @@ static void dma_test(uint8_t zero_copy, uint8_t external_loopback, int data_widt
     }
 
 
+    DMAProgress tx, rx;
+    litepcie_dma_get_progress(&dma, 1, &tx);
+    litepcie_dma_get_progress(&dma, 0, &rx);
+    printf("IRQs: TX %" PRIu64 " (%" PRIu64 " held off), RX %" PRIu64 " (%" PRIu64 " held off)\n",
+           tx.irq.irqs, tx.irq.holdoffs, rx.irq.irqs, rx.irq.holdoffs);
+    printf("Waits: %" PRIu64 " spun, %" PRIu64 " slept\n", dma.wait_spins, dma.wait_sleeps);
+    printf("Losses: RX %" PRIu64 " overruns (%" PRIu64 " buffers), TX %" PRIu64 " underruns (%" PRIu64 " buffers)\n",
+           dma.writer_overruns, dma.writer_dropped, dma.reader_underruns, dma.reader_dropped);
+#ifdef DMA_CHECK_DATA
+    if (zero_copy)
+        printf("Held: RX %" PRIu64 " slots overwritten, TX %" PRIu64 " sent unfilled\n", rx_torn, tx_unfilled);
+#endif
+
     /* Cleanup DMA. */
 #ifdef DMA_CHECK_DATA
 end:
+    free(rx_stage);
+    free(tx_stage);
 #endif
     litepcie_dma_cleanup(&dma);
 }
 
+/* Stats */
+/*-------*/
+
+/* upper bound in us of the bucket holding the given fraction of the samples, 0 without samples */
+static uint32_t hist_percentile(const uint64_t *now, const uint64_t *last, double fraction)
+{
+    uint64_t total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < LITEPCIE_DMA_HIST_BUCKETS; b++)
+        total += now[b] - last[b];
+    if (total == 0)
+        return 0;
+    for (b = 0; b < LITEPCIE_DMA_HIST_BUCKETS; b++) {
+        seen += now[b] - last[b];
+        if (seen >= total * fraction)
+            break;
+    }
+    return 1u << (b < LITEPCIE_DMA_HIST_BUCKETS ? b : LITEPCIE_DMA_HIST_BUCKETS - 1);
+}
+
+static void stats_direction(const char *name, const DMAProgress *p, const DMAStats *s, const DMALevels *l,
+                            const DMAProgress *lp, const DMAStats *ls, const DMALevels *ll, double seconds)
+{
+    printf("%-3s %9.2f %9.0f %9.0f %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %9u %9u %9u %5.0f %5.0f %6" PRIu64 " %6u\n",
+           name,
+           (double)(s->bytes - ls->bytes) / (seconds * 1e6),
+           (double)(p->countTotal >= lp->countTotal ? p->countTotal - lp->countTotal : p->countTotal) / seconds,
+           (double)(p->irq.irqs - lp->irq.irqs) / seconds,
+           s->missedIrqs - ls->missedIrqs,
+           s->wraps - ls->wraps,
+           s->lapped - ls->lapped,
+           hist_percentile(s->irqInterval, ls->irqInterval, 0.5),
+           hist_percentile(s->irqHandler, ls->irqHandler, 0.5),
+           hist_percentile(s->irqHandler, ls->irqHandler, 0.99),
+           l->fifoDepth ? 100.0 * l->fifoLevel / l->fifoDepth : 0.0,
+           l->fifoDepth ? 100.0 * l->fifoHigh / l->fifoDepth : 0.0,
+           l->fifoNearFull >= ll->fifoNearFull ? l->fifoNearFull - ll->fifoNearFull : l->fifoNearFull,
+           l->tableLow);
+}
+
+static void stats(void)
+{
+    int fd;
+    int i = 0;
+    LitePCIeStats drv, drv_last;
+    DMACounts counts, counts_last;
+    int64_t last_time;
+
+    signal(SIGINT, intHandler);
+
+    printf("\e[1m[> DMA statistics (channel %d):\e[0m\n", litepcie_dma_channel);
+    printf("-----------------------------\n");
+
+    fd = litepcie_open(litepcie_device, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Could not init driver\n");
+        exit(1);
+    }
+
+    if (litepcie_get_stats(fd, &drv_last) != 0 ||
+        litepcie_get_dma_stats(fd, litepcie_dma_channel, &counts_last) != 0) {
+        fprintf(stderr, "Could not read statistics\n");
+        litepcie_close(fd);
+        exit(1);
+    }
+    last_time = get_time_ms();
+
+    /* Rates over the last second, histogram columns are bucket upper bounds in us. */
+    while (keep_running) {
+        double seconds;
+        uint64_t calls = 0, interrupts = 0;
+        int j;
+
+        sleep(1);
+        if (litepcie_get_stats(fd, &drv) != 0 ||
+            litepcie_get_dma_stats(fd, litepcie_dma_channel, &counts) != 0)
+            break;
+        seconds = (double)(get_time_ms() - last_time) / 1000;
+        if (seconds <= 0)
+            continue;
+
+        for (j = 0; j < LITEPCIE_STATS_SELECTORS; j++)
+            calls += drv.calls[j] - drv_last.calls[j];
+        for (j = 0; j < LITEPCIE_STATS_SOURCES; j++)
+            interrupts += drv.interrupts[j] - drv_last.interrupts[j];
+
+        if (i % 10 == 0)
+            printf("\e[1mDIR      MB/s BUFFERS/s    IRQS/s MISSED  WRAPS LAPPED IVL50(us) HND50(us) HND99(us) FIFO%% PEAK%%  NFULL TBLMIN\e[0m\n");
+        i++;
+        stats_direction("TX", &counts.reader, &counts.readerStats, &counts.readerLevels,
+                        &counts_last.reader, &counts_last.readerStats, &counts_last.readerLevels, seconds);
+        stats_direction("RX", &counts.writer, &counts.writerStats, &counts.writerLevels,
+                        &counts_last.writer, &counts_last.writerStats, &counts_last.writerLevels, seconds);
+        printf("drv %.0f calls/s, %.0f MSI/s\n", (double)calls / seconds, (double)interrupts / seconds);
+
+        drv_last = drv;
+        counts_last = counts;
+        last_time = get_time_ms();
+    }
+
+    litepcie_close(fd);
+}
+
 /* Help */
 /*------*/
 
@@ -487,20 +787,30 @@ static void help(void)
            "options:\n"
            "-h                                Help.\n"
            "-c device_num                     Select the device (default = 0).\n"
+           "-s                                Use the simulated device.\n"
+           "-d dma_channel                    Select the DMA channel (default = 0).\n"
            "-z                                Enable zero-copy DMA mode.\n"
            "-e                                Use external loopback (default = internal).\n"
            "-w data_width                     Width of data bus (default = 16).\n"
            "-a                                Automatic DMA RX-Delay calibration.\n"
+           "-b buffer_size                    DMA buffer size in bytes (default = driver).\n"
+           "-n buffer_count                   DMA buffers per ring (default = driver).\n"
+           "-i buffer_per_irq                 DMA buffers per interrupt (default = driver).\n"
+           "-l latency_us                     Adaptive IRQ coalescing with this latency target.\n"
+           "-p spin_us                        Busy-poll budget before sleeping on DMA (default = 20).\n"
            "\n"
            "available commands:\n"
            "info                              Get Board information.\n"
            "\n"
            "dma_test                          Test DMA.\n"
+           "stats                             Show live DMA statistics of the channel.\n"
            "scratch_test                      Test Scratch register.\n"
            "\n"
 #ifdef CSR_FLASH_BASE
            "flash_write filename [offset]     Write file contents to SPI Flash.\n"
+           "flash_update filename [offset]    Same, but only erase and program the sectors that changed.\n"
            "flash_read filename size [offset] Read from SPI Flash and write contents to file.\n"
+           "flash_verify filename [offset]    Compare file and SPI Flash contents by CRC32.\n"
            "flash_reload                      Reload FPGA Image.\n"
 #endif
            );
@@ -518,16 +828,21 @@ int main(int argc, char **argv)
     static uint8_t litepcie_device_external_loopback;
     static int litepcie_data_width;
     static int litepcie_auto_rx_delay;
+    static uint8_t litepcie_device_sim;
+    static struct litepcie_dma_geometry litepcie_dma_geometry;
+    static uint32_t litepcie_coalesce_latency_us;
+    static int64_t litepcie_wait_spin_us = -1;
 
     litepcie_device_num = 0;
     litepcie_data_width = 16;
     litepcie_auto_rx_delay = 0;
     litepcie_device_zero_copy = 0;
     litepcie_device_external_loopback = 0;
+    litepcie_device_sim = 0;
 
     /* Parameters. */
     for (;;) {
-        c = getopt(argc, argv, "hc:w:zea");
+        c = getopt(argc, argv, "hc:d:w:zeasb:n:i:l:p:");
         if (c == -1)
             break;
         switch(c) {
@@ -537,6 +852,9 @@ int main(int argc, char **argv)
         case 'c':
             litepcie_device_num = atoi(optarg);
             break;
+        case 'd':
+            litepcie_dma_channel = atoi(optarg);
+            break;
         case 'w':
             litepcie_data_width = atoi(optarg);
             break;
@@ -549,6 +867,24 @@ int main(int argc, char **argv)
         case 'a':
             litepcie_auto_rx_delay = 1;
             break;
+        case 's':
+            litepcie_device_sim = 1;
+            break;
+        case 'b':
+            litepcie_dma_geometry.buffer_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            litepcie_dma_geometry.buffer_count = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            litepcie_dma_geometry.buffer_per_irq = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            litepcie_coalesce_latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            litepcie_wait_spin_us = strtoll(optarg, NULL, 0);
+            break;
         default:
             exit(1);
         }
@@ -559,7 +895,10 @@ int main(int argc, char **argv)
         help();
 
     /* Select device. */
-    snprintf(litepcie_device, sizeof(litepcie_device), "/dev/litepcie%d", litepcie_device_num);
+    if (litepcie_device_sim)
+        snprintf(litepcie_device, sizeof(litepcie_device), "sim%d:0:%d", litepcie_device_num, litepcie_dma_channel + 1);
+    else
+        snprintf(litepcie_device, sizeof(litepcie_device), "/dev/litepcie%d", litepcie_device_num);
 
     cmd = argv[optind++];
 
@@ -571,7 +910,7 @@ int main(int argc, char **argv)
         scratch_test();
     /* SPI Flash cmds. */
 #if CSR_FLASH_BASE
-    else if (!strcmp(cmd, "flash_write")) {
+    else if (!strcmp(cmd, "flash_write") || !strcmp(cmd, "flash_update")) {
         const char *filename;
         uint32_t offset = 0;
         if (optind + 1 > argc)
@@ -579,7 +918,7 @@ int main(int argc, char **argv)
         filename = argv[optind++];
         if (optind < argc)
             offset = strtoul(argv[optind++], NULL, 0);
-        flash_write(filename, offset);
+        flash_write(filename, offset, !strcmp(cmd, "flash_update"));
     }
     else if (!strcmp(cmd, "flash_read")) {
         const char *filename;
@@ -593,6 +932,16 @@ int main(int argc, char **argv)
             offset = strtoul(argv[optind++], NULL, 0);
         flash_read(filename, size, offset);
     }
+    else if (!strcmp(cmd, "flash_verify")) {
+        const char *filename;
+        uint32_t offset = 0;
+        if (optind + 1 > argc)
+            goto show_help;
+        filename = argv[optind++];
+        if (optind < argc)
+            offset = strtoul(argv[optind++], NULL, 0);
+        flash_verify(filename, offset);
+    }
     else if (!strcmp(cmd, "flash_reload"))
         flash_reload();
 #endif
@@ -602,7 +951,12 @@ int main(int argc, char **argv)
             litepcie_device_zero_copy,
             litepcie_device_external_loopback,
             litepcie_data_width,
-            litepcie_auto_rx_delay);
+            litepcie_auto_rx_delay,
+            litepcie_dma_geometry,
+            litepcie_coalesce_latency_us,
+            litepcie_wait_spin_us);
+    else if (!strcmp(cmd, "stats"))
+        stats();
 
     /* Show help otherwise. */
     else
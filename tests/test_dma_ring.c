@@ -0,0 +1,108 @@
+/*
+ * Ring layout checks for litepcie_dma_ring.h, builds on linux:
+ * cc tests/test_dma_ring.c -o test_dma_ring -I litepcie && ./test_dma_ring
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "litepcie_dma_ring.h"
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+/* the whole region in one segment, buffers land at base + i * size */
+static void test_single_segment(void)
+{
+    struct litepcie_dma_segment seg[] = { { 0x80000000, 256 * 8192 } };
+    uint64_t addr[256];
+
+    CHECK(litepcie_dma_ring_layout(seg, 1, 8192, 256, addr) == 0);
+    for (uint32_t i = 0; i < 256; i++)
+        CHECK(addr[i] == 0x80000000 + (uint64_t)i * 8192);
+}
+
+/* buffers split evenly over scattered segments */
+static void test_multi_segment(void)
+{
+    struct litepcie_dma_segment seg[] = {
+        { 0x10000000, 4 * 4096 },
+        { 0x20000000, 2 * 4096 },
+        { 0x30000000, 2 * 4096 },
+    };
+    uint64_t addr[8];
+
+    CHECK(litepcie_dma_ring_layout(seg, 3, 4096, 8, addr) == 0);
+    CHECK(addr[0] == 0x10000000);
+    CHECK(addr[3] == 0x10000000 + 3 * 4096);
+    CHECK(addr[4] == 0x20000000);
+    CHECK(addr[5] == 0x20000000 + 4096);
+    CHECK(addr[6] == 0x30000000);
+    CHECK(addr[7] == 0x30000000 + 4096);
+}
+
+/* a buffer may not straddle a segment boundary */
+static void test_straddle(void)
+{
+    struct litepcie_dma_segment seg[] = {
+        { 0x10000000, 6144 },
+        { 0x20000000, 10240 },
+    };
+    uint64_t addr[4], one;
+
+    CHECK(litepcie_dma_ring_layout(seg, 2, 4096, 4, addr) == -1);
+    /* the buffers before the straddling one still resolve */
+    CHECK(litepcie_dma_ring_address(seg, 2, 0, 4096, &one) == 0 && one == 0x10000000);
+    CHECK(litepcie_dma_ring_address(seg, 2, 4096, 4096, &one) == -1);
+    /* a range that starts exactly on the next segment is fine */
+    CHECK(litepcie_dma_ring_address(seg, 2, 6144, 4096, &one) == 0 && one == 0x20000000);
+}
+
+/* offsets past the mapped region, and a ring bigger than the region */
+static void test_out_of_range(void)
+{
+    struct litepcie_dma_segment seg[] = { { 0x10000000, 4 * 4096 } };
+    uint64_t addr[5], one;
+
+    CHECK(litepcie_dma_ring_address(seg, 1, 3 * 4096, 4096, &one) == 0 && one == 0x10000000 + 3 * 4096);
+    CHECK(litepcie_dma_ring_address(seg, 1, 4 * 4096, 4096, &one) == -1);
+    CHECK(litepcie_dma_ring_address(seg, 1, 0, 4096, &one) == 0);
+    CHECK(litepcie_dma_ring_address(seg, 0, 0, 4096, &one) == -1);
+    CHECK(litepcie_dma_ring_layout(seg, 1, 4096, 5, addr) == -1);
+}
+
+/* bus addresses above 4G and offsets past 32 bits keep all their bits */
+static void test_wide(void)
+{
+    struct litepcie_dma_segment seg[] = {
+        { 0x100000000ULL, 0x100000000ULL },
+        { 0x7f00000000ULL, 1 << 20 },
+    };
+    uint64_t one;
+
+    CHECK(litepcie_dma_ring_address(seg, 2, 0xfffff000ULL, 4096, &one) == 0 && one == 0x1fffff000ULL);
+    CHECK(litepcie_dma_ring_address(seg, 2, 0x100000000ULL + 8192, 4096, &one) == 0 && one == 0x7f00002000ULL);
+}
+
+int main(void)
+{
+    test_single_segment();
+    test_multi_segment();
+    test_straddle();
+    test_out_of_range();
+    test_wide();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_dma_ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * MSI routing checks for litepcie_irq_route.h, builds on linux:
+ * cc tests/test_irq_route.c -o test_irq_route -I litepcie && ./test_irq_route
+ */
+
+#include <stdio.h>
+
+#include "litepcie_irq_route.h"
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+/* every channel's reader and writer bit points back at it */
+static void check_targets(const struct litepcie_irq_route *route, uint32_t channels)
+{
+    for (uint32_t ch = 0; ch < channels; ch++) {
+        const struct litepcie_irq_target *r = &route->target[litepcie_dma_reader_irq(ch)];
+        const struct litepcie_irq_target *w = &route->target[litepcie_dma_writer_irq(ch)];
+
+        CHECK(r->valid && r->channel == ch && r->is_reader == 1);
+        CHECK(w->valid && w->channel == ch && w->is_reader == 0);
+    }
+    for (uint32_t bit = 2 * channels; bit < 32; bit++)
+        CHECK(!route->target[bit].valid);
+}
+
+/* a single MSI, everything on source 0 and the handler decodes the vector */
+static void test_single_msi(void)
+{
+    struct litepcie_irq_route route;
+
+    CHECK(litepcie_irq_route_build(&route, 1, 1, false) == 0);
+    CHECK(route.shared && route.sources == 1);
+    CHECK(route.mask[0] == 0x3);
+    check_targets(&route, 1);
+
+    CHECK(litepcie_irq_route_build(&route, 4, 1, true) == 0);
+    CHECK(route.shared && route.sources == 1);
+    CHECK(route.mask[0] == 0xff);
+    for (uint32_t i = 1; i < LITEPCIE_IRQ_MAX_SOURCES; i++)
+        CHECK(route.mask[i] == 0);
+    check_targets(&route, 4);
+}
+
+/* enough vectors on a multi-vector core, one source per IRQ bit */
+static void test_per_channel(void)
+{
+    struct litepcie_irq_route route;
+
+    CHECK(litepcie_irq_route_build(&route, 4, 8, true) == 0);
+    CHECK(!route.shared && route.sources == 8);
+    for (uint32_t i = 0; i < 8; i++)
+        CHECK(route.mask[i] == 1u << i);
+    check_targets(&route, 4);
+
+    /* more vectors than bits, the extra ones stay unused */
+    CHECK(litepcie_irq_route_build(&route, 2, 32, true) == 0);
+    CHECK(!route.shared && route.sources == 4);
+    CHECK(route.mask[4] == 0);
+
+    /* 16 channels use all 32 bits */
+    CHECK(litepcie_irq_route_build(&route, 16, 32, true) == 0);
+    CHECK(!route.shared && route.sources == 32);
+    check_targets(&route, 16);
+}
+
+/* too few vectors, or a single-vector core, falls back to a shared source */
+static void test_shared_fallback(void)
+{
+    struct litepcie_irq_route route;
+
+    CHECK(litepcie_irq_route_build(&route, 4, 4, true) == 0);
+    CHECK(route.shared && route.sources == 1 && route.mask[0] == 0xff);
+
+    CHECK(litepcie_irq_route_build(&route, 4, 8, false) == 0);
+    CHECK(route.shared && route.sources == 1 && route.mask[0] == 0xff);
+    check_targets(&route, 4);
+}
+
+static void test_unroutable(void)
+{
+    struct litepcie_irq_route route;
+
+    CHECK(litepcie_irq_route_build(&route, 4, 0, true) == -1);
+    CHECK(route.sources == 0);
+    /* a 17th channel needs IRQ bit 32 */
+    CHECK(litepcie_irq_route_build(&route, 17, 32, true) == -1);
+}
+
+/* decoding a shared vector register, lowest bit first, unrouted bits dropped */
+static void test_decode(void)
+{
+    struct litepcie_irq_route route;
+    const struct litepcie_irq_target *target;
+    uint32_t pending, bit = 0;
+
+    CHECK(litepcie_irq_route_build(&route, 4, 1, true) == 0);
+
+    pending = 0x22 | (1u << 20);
+    target = litepcie_irq_route_next(&route, &pending, &bit);
+    CHECK(target != NULL && bit == 1 && target->channel == 0 && !target->is_reader);
+    target = litepcie_irq_route_next(&route, &pending, &bit);
+    CHECK(target != NULL && bit == 5 && target->channel == 2 && !target->is_reader);
+    CHECK(litepcie_irq_route_next(&route, &pending, &bit) == NULL);
+    CHECK(pending == 0);
+
+    /* the bit out pointer is optional */
+    pending = 1u << 6;
+    target = litepcie_irq_route_next(&route, &pending, NULL);
+    CHECK(target != NULL && target->channel == 3 && target->is_reader);
+
+    pending = 0;
+    CHECK(litepcie_irq_route_next(&route, &pending, &bit) == NULL);
+}
+
+int main(void)
+{
+    test_single_msi();
+    test_per_channel();
+    test_shared_fallback();
+    test_unroutable();
+    test_decode();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("test_irq_route: ok\n");
+    return 0;
+}